@@ -54,45 +54,65 @@ static bool isPhoneEqual(const std::string &n1, const std::string &n2)
     return !strcmp(s1, s2);
 }
 
-bool isPrivateChat(const td::td_api::chat &chat)
+static UserId getUserIdByPrivateChat(const td::td_api::object_ptr<td::td_api::ChatType> &type)
 {
-    return getUserIdByPrivateChat(chat).valid();
-}
-
-UserId getUserIdByPrivateChat(const td::td_api::chat &chat)
-{
-    if (chat.type_ && (chat.type_->get_id() == td::td_api::chatTypePrivate::ID)) {
-        const td::td_api::chatTypePrivate &privType = static_cast<const td::td_api::chatTypePrivate &>(*chat.type_);
+    if (type && (type->get_id() == td::td_api::chatTypePrivate::ID)) {
+        const td::td_api::chatTypePrivate &privType = static_cast<const td::td_api::chatTypePrivate &>(*type);
         return getUserId(privType);
     }
     return UserId::invalid;
 }
 
-bool isChatInContactList(const td::td_api::chat &chat, const td::td_api::user *privateChatUser)
+static BasicGroupId getBasicGroupId(const td::td_api::object_ptr<td::td_api::ChatType> &type)
 {
-    return !chat.positions_.empty() || (privateChatUser && privateChatUser->is_contact_);
+    if (type && (type->get_id() == td::td_api::chatTypeBasicGroup::ID))
+        return getBasicGroupId(static_cast<const td::td_api::chatTypeBasicGroup &>(*type));
+
+    return BasicGroupId::invalid;
 }
 
-BasicGroupId getBasicGroupId(const td::td_api::chat &chat)
+static SupergroupId getSupergroupId(const td::td_api::object_ptr<td::td_api::ChatType> &type)
 {
-    if (chat.type_ && (chat.type_->get_id() == td::td_api::chatTypeBasicGroup::ID))
-        return getBasicGroupId(static_cast<const td::td_api::chatTypeBasicGroup &>(*chat.type_));
+    if (type && (type->get_id() == td::td_api::chatTypeSupergroup::ID))
+        return getSupergroupId(static_cast<const td::td_api::chatTypeSupergroup &>(*type));
 
-    return BasicGroupId::invalid;
+    return SupergroupId::invalid;
 }
 
-SupergroupId getSupergroupId(const td::td_api::chat &chat)
+bool isPrivateChat(const TgChat &chat)
 {
-    if (chat.type_ && (chat.type_->get_id() == td::td_api::chatTypeSupergroup::ID))
-        return getSupergroupId(static_cast<const td::td_api::chatTypeSupergroup &>(*chat.type_));
+    return getUserIdByPrivateChat(chat).valid();
+}
 
-    return SupergroupId::invalid;
+UserId getUserIdByPrivateChat(const TgChat &chat)
+{
+    return getUserIdByPrivateChat(chat.type);
 }
 
-SecretChatId getSecretChatId(const td::td_api::chat &chat)
+UserId getUserIdByPrivateChat(const td::td_api::chat &chat)
 {
-    if (chat.type_ && (chat.type_->get_id() == td::td_api::chatTypeSecret::ID))
-        return getSecretChatId(static_cast<const td::td_api::chatTypeSecret&>(*chat.type_));
+    return getUserIdByPrivateChat(chat.type_);
+}
+
+bool isChatInContactList(const TgChat &chat, const TgUser *privateChatUser)
+{
+    return !chat.positions.empty() || (privateChatUser && privateChatUser->isContact);
+}
+
+BasicGroupId getBasicGroupId(const TgChat &chat)
+{
+    return getBasicGroupId(chat.type);
+}
+
+SupergroupId getSupergroupId(const TgChat &chat)
+{
+    return getSupergroupId(chat.type);
+}
+
+SecretChatId getSecretChatId(const TgChat &chat)
+{
+    if (chat.type && (chat.type->get_id() == td::td_api::chatTypeSecret::ID))
+        return getSecretChatId(static_cast<const td::td_api::chatTypeSecret&>(*chat.type));
 
     return SecretChatId::invalid;
 }
@@ -127,7 +147,7 @@ bool isSameUser(const td::td_api::MessageSender &member1, const td::td_api::Mess
     return false;
 }
 
-static std::string makeDisplayName(const td::td_api::user &user)
+static std::string makeDisplayName(const TgUser &user)
 {
     std::string result = makeBasicDisplayName(user);
 
@@ -140,24 +160,63 @@ static std::string makeDisplayName(const td::td_api::user &user)
     return result;
 }
 
-auto PendingMessageQueue::getChatQueue(ChatId chatId) -> std::vector<ChatQueue>::iterator 
+auto PendingMessageQueue::getChatQueue(ChatId chatId) -> QueueMap::iterator
 {
-    return std::find_if(m_queues.begin(), m_queues.end(), [chatId](const ChatQueue &queue) {
-        return (queue.chatId == chatId);
-    });
+    return m_queues.find(chatId);
 }
 
-PendingMessageQueue::Message &PendingMessageQueue::addMessage(ChatQueue &queue, MessageAction action)
+PendingMessageQueue::ChatQueue &PendingMessageQueue::createChatQueue(ChatId chatId)
+{
+    ChatQueue &queue = m_queues[chatId];
+    queue.chatId        = chatId;
+    queue.creationOrder = m_queuesCreated++;
+    return queue;
+}
+
+PendingMessageQueue::Message &PendingMessageQueue::addMessage(ChatQueue &queue, MessageId messageId,
+                                                              MessageAction action)
 {
     if (action == MessageAction::Append) {
+        queue.index.emplace(messageId, queue.frontNumber + int64_t(queue.messages.size()));
         queue.messages.emplace_back();
         return queue.messages.back();
     } else {
+        queue.index.emplace(messageId, --queue.frontNumber);
         queue.messages.emplace_front();
         return queue.messages.front();
     }
 }
 
+PendingMessageQueue::Message *PendingMessageQueue::findMessage(ChatQueue &queue, MessageId messageId)
+{
+    // If the same message was queued more than once, use the one closest to the front
+    auto    range  = queue.index.equal_range(messageId);
+    int64_t number = 0;
+    bool    found  = false;
+    for (auto it = range.first; it != range.second; ++it)
+        if (!found || (it->second < number)) {
+            number = it->second;
+            found  = true;
+        }
+
+    return found ? &queue.messages[number - queue.frontNumber] : nullptr;
+}
+
+IncomingMessage PendingMessageQueue::takeFrontMessage(ChatQueue &queue)
+{
+    IncomingMessage result = std::move(queue.messages.front().message);
+    auto range = queue.index.equal_range(getId(*result.message));
+    for (auto it = range.first; it != range.second; ++it)
+        if (it->second == queue.frontNumber) {
+            queue.index.erase(it);
+            break;
+        }
+
+    queue.messages.pop_front();
+    queue.frontNumber++;
+    return result;
+}
+
 IncomingMessage &PendingMessageQueue::addPendingMessage(IncomingMessage &&message,
     MessageAction action)
 {
@@ -171,37 +230,29 @@ IncomingMessage &PendingMessageQueue::addPendingMessage(IncomingMessage &&messag
                       chatId.value(), message.message->id_);
 
     if (queueIt != m_queues.end())
-        queue = &*queueIt;
-    else {
-        m_queues.emplace_back();
-        m_queues.back().chatId = chatId;
-        queue = &m_queues.back();
-    }
+        queue = &queueIt->second;
+    else
+        queue = &createChatQueue(chatId);
 
-    Message &newEntry = addMessage(*queue, action);
+    Message &newEntry = addMessage(*queue, getId(*message.message), action);
     newEntry.ready = false;
     newEntry.message = std::move(message);
     return newEntry.message;
 }
 
-void PendingMessageQueue::extractReadyMessages(
-    std::vector<ChatQueue>::iterator pQueue,
-    std::vector<IncomingMessage> &readyMessages)
+void PendingMessageQueue::extractReadyMessages(QueueMap::iterator pQueue,
+                                               std::vector<IncomingMessage> &readyMessages)
 {
-    std::list<Message>::iterator pReady;
-    for (pReady = pQueue->messages.begin(); pReady != pQueue->messages.end(); ++pReady) {
-        if (!pReady->ready) break;
+    ChatQueue &queue = pQueue->second;
+    while (!queue.messages.empty() && queue.messages.front().ready) {
         purple_debug_misc(config::pluginId,"MessageQueue: chat %" G_GINT64_FORMAT ": "
                             "showing message %" G_GINT64_FORMAT "\n",
-                            pQueue->chatId.value(), getId(*pReady->message.message).value());
-        readyMessages.push_back(std::move(pReady->message));
+                            queue.chatId.value(), getId(*queue.messages.front().message.message).value());
+        readyMessages.push_back(takeFrontMessage(queue));
     }
 
-    pQueue->messages.erase(pQueue->messages.begin(), pReady);
-    if (pQueue->messages.empty()) {
+    if (queue.messages.empty())
         m_queues.erase(pQueue);
-        pQueue = m_queues.end();
-    }
 }
 
 void PendingMessageQueue::setMessageReady(ChatId chatId, MessageId messageId,
@@ -216,13 +267,11 @@ void PendingMessageQueue::setMessageReady(ChatId chatId, MessageId messageId,
                       "message %" G_GINT64_FORMAT " now ready\n",
                       chatId.value(), messageId.value());
 
-    auto it = std::find_if(pQueue->messages.begin(), pQueue->messages.end(), [messageId](const Message &m) {
-        return (getId(*m.message.message) == messageId);
-    });
-    if (it == pQueue->messages.end()) return;
+    Message *message = findMessage(pQueue->second, messageId);
+    if (!message) return;
 
-    it->ready = true;
-    if (pQueue->ready && (it == pQueue->messages.begin()))
+    message->ready = true;
+    if (pQueue->second.ready && (message == &pQueue->second.messages.front()))
         extractReadyMessages(pQueue, readyMessages);
 }
 
@@ -240,7 +289,7 @@ IncomingMessage PendingMessageQueue::addReadyMessage(IncomingMessage &&message,
                       "adding pending message %" G_GINT64_FORMAT " (ready)\n",
                       chatId.value(), message.message->id_);
 
-    Message &newEntry = addMessage(*queueIt, action);
+    Message &newEntry = addMessage(queueIt->second, getId(*message.message), action);
     newEntry.ready = true;
     newEntry.message = std::move(message);
 
@@ -251,19 +300,23 @@ IncomingMessage *PendingMessageQueue::findPendingMessage(ChatId chatId, MessageI
 {
     auto queueIt = getChatQueue(chatId);
     if (queueIt == m_queues.end()) return nullptr;
-    ChatQueue *queue = &*queueIt;
 
-    auto it = std::find_if(queue->messages.begin(), queue->messages.end(), [messageId](const Message &m) {
-        return (getId(*m.message.message) == messageId);
-    });
-    return (it != queue->messages.end()) ? &it->message : nullptr;
+    Message *message = findMessage(queueIt->second, messageId);
+    return message ? &message->message : nullptr;
 }
 
 void PendingMessageQueue::flush(std::vector<IncomingMessage> &messages)
 {
+    std::vector<ChatQueue *> queues;
+    for (QueueMap::value_type &entry: m_queues)
+        queues.push_back(&entry.second);
+    std::sort(queues.begin(), queues.end(), [](const ChatQueue *queue1, const ChatQueue *queue2) {
+        return (queue1->creationOrder < queue2->creationOrder);
+    });
+
     messages.clear();
-    for (ChatQueue &queue: m_queues)
-        for (Message &message: queue.messages)
+    for (ChatQueue *queue: queues)
+        for (Message &message: queue->messages)
             messages.push_back(std::move(message.message));
     m_queues.clear();
 }
@@ -272,12 +325,9 @@ void PendingMessageQueue::setChatNotReady(ChatId chatId)
 {
     auto pQueue = getChatQueue(chatId);
     if (pQueue != m_queues.end())
-        pQueue->ready = false;
-    else {
-        m_queues.emplace_back();
-        m_queues.back().chatId = chatId;
-        m_queues.back().ready = false;
-    }
+        pQueue->second.ready = false;
+    else
+        createChatQueue(chatId).ready = false;
 }
 
 void PendingMessageQueue::setChatReady(ChatId chatId, std::vector<IncomingMessage>& readyMessages)
@@ -286,7 +336,7 @@ void PendingMessageQueue::setChatReady(ChatId chatId, std::vector<IncomingMessag
     auto pQueue = getChatQueue(chatId);
     if (pQueue == m_queues.end()) return;
 
-    pQueue->ready = true;
+    pQueue->second.ready = true;
     extractReadyMessages(pQueue, readyMessages);
 }
 
@@ -294,16 +344,94 @@ bool PendingMessageQueue::isChatReady(ChatId chatId)
 {
     auto pQueue = getChatQueue(chatId);
     if (pQueue != m_queues.end())
-        return pQueue->ready;
+        return pQueue->second.ready;
     else
         return true;
 }
 
+void PendingMessageQueue::sortChat(ChatId chatId)
+{
+    auto pQueue = getChatQueue(chatId);
+    if (pQueue == m_queues.end()) return;
+
+    ChatQueue &queue = pQueue->second;
+    std::stable_sort(queue.messages.begin(), queue.messages.end(), [](const Message &m1, const Message &m2) {
+        return (getId(*m1.message.message).value() < getId(*m2.message.message).value());
+    });
+    queue.index.clear();
+    for (size_t i = 0; i < queue.messages.size(); i++)
+        queue.index.emplace(getId(*queue.messages[i].message.message), queue.frontNumber + int64_t(i));
+}
+
+void PendingMessageQueue::extractOverflowMessages(ChatId chatId, std::vector<IncomingMessage> &messages)
+{
+    messages.clear();
+    auto pQueue = getChatQueue(chatId);
+    if ((m_maxDepth == 0) || (pQueue == m_queues.end()) || !pQueue->second.ready)
+        return;
+
+    ChatQueue &queue = pQueue->second;
+    while (queue.messages.size() > m_maxDepth) {
+        purple_debug_misc(config::pluginId,"MessageQueue: chat %" G_GINT64_FORMAT ": "
+                          "queue full, showing message %" G_GINT64_FORMAT "\n",
+                          chatId.value(), getId(*queue.messages.front().message.message).value());
+        messages.push_back(takeFrontMessage(queue));
+        // Same as for messages still pending at logout: don't wait for inline download any more
+        messages.back().inlineDownloadTimeout = true;
+    }
+
+    extractReadyMessages(pQueue, messages);
+}
+
+TdAccountData::~TdAccountData()
+{
+    if (readReceiptTimer)
+        transceiver.cancelTimeout(readReceiptTimer);
+    if (gapRecoveryTimer)
+        transceiver.cancelTimeout(gapRecoveryTimer);
+    if (lastMessageFlushTimer)
+        transceiver.cancelTimeout(lastMessageFlushTimer);
+}
+
+static void makeUser(td::td_api::user &tdUser, TgUser &user)
+{
+    user.id          = getId(tdUser);
+    user.firstName   = InternedString(tdUser.first_name_);
+    user.lastName    = InternedString(tdUser.last_name_);
+    user.phoneNumber = InternedString(tdUser.phone_number_);
+    user.usernames.clear();
+    if (tdUser.usernames_)
+        for (const std::string &username: tdUser.usernames_->active_usernames_)
+            user.usernames.emplace_back(username);
+    user.status      = std::move(tdUser.status_);
+    user.photoId     = 0;
+    user.smallPhoto  = nullptr;
+    if (tdUser.profile_photo_) {
+        user.photoId    = tdUser.profile_photo_->id_;
+        user.smallPhoto = std::move(tdUser.profile_photo_->small_);
+    }
+    user.isContact   = tdUser.is_contact_;
+    user.isDeleted   = (tdUser.type_ && (tdUser.type_->get_id() == td::td_api::userTypeDeleted::ID));
+}
+
+static void makeChat(td::td_api::chat &tdChat, TgChat &chat)
+{
+    chat.id         = getId(tdChat);
+    chat.title      = InternedString(tdChat.title_);
+    chat.type       = std::move(tdChat.type_);
+    chat.smallPhoto = nullptr;
+    if (tdChat.photo_)
+        chat.smallPhoto = std::move(tdChat.photo_->small_);
+    chat.positions.clear();
+    for (const auto &position: tdChat.positions_)
+        if (position && position->list_)
+            chat.positions.push_back(TgChatPosition{position->list_->get_id(), position->order_});
+}
+
 void TdAccountData::updateUser(TdUserPtr userPtr)
 {
-    const td::td_api::user *user = userPtr.get();
-    if (user) {
-        UserId   userId = getId(*user);
+    if (userPtr) {
+        UserId   userId = getId(*userPtr);
         auto     it     = m_userInfo.find(userId);
 
         if (it == m_userInfo.end()) {
@@ -312,43 +440,96 @@ void TdAccountData::updateUser(TdUserPtr userPtr)
         }
 
         UserInfo &entry = it->second;
-        entry.user = std::move(userPtr);
-        entry.displayName = makeDisplayName(*user);
-        for (unsigned n = 0; n != UINT32_MAX; n++) {
-            std::string displayName = entry.displayName;
-            if (n != 0) {
-                displayName += " #";
-                displayName += std::to_string(n);
-            }
+        makeUser(*userPtr, entry.user);
+        assignDisplayName(userId, entry, makeDisplayName(entry.user));
+    }
+}
+
+bool TdAccountData::isDisplayNameTaken(const std::string &displayName, UserId userId) const
+{
+    auto range = m_usersByDisplayName.equal_range(displayName);
+    return std::any_of(range.first, range.second,
+                       [userId](const std::pair<const std::string, UserId> &entry) {
+                           return (entry.second != userId);
+                       });
+}
+
+void TdAccountData::releaseDisplayName(UserId userId, const UserInfo &entry)
+{
+    auto range = m_usersByDisplayName.equal_range(entry.displayName);
+    for (auto it = range.first; it != range.second; ++it)
+        if (it->second == userId) {
+            m_usersByDisplayName.erase(it);
+            break;
+        }
+
+    auto it = (entry.displayNameSuffix != 0) ? m_displayNameSuffixes.find(entry.baseDisplayName)
+                                             : m_displayNameSuffixes.end();
+    if (it != m_displayNameSuffixes.end()) {
+        DisplayNameSuffixes &suffixes = it->second;
+        suffixes.released.insert(entry.displayNameSuffix);
+        while (!suffixes.released.empty() && (*suffixes.released.rbegin() == suffixes.next - 1)) {
+            suffixes.released.erase(std::prev(suffixes.released.end()));
+            suffixes.next--;
+        }
+        if (suffixes.next == 1)
+            m_displayNameSuffixes.erase(it);
+    }
+}
 
-            std::vector<const td::td_api::user *> existingUsers;
-            getUsersByDisplayName(displayName.c_str(), existingUsers);
-            if (std::none_of(existingUsers.begin(), existingUsers.end(),
-                                [user](const td::td_api::user *otherUser) {
-                                    return (otherUser != user);
-                                }))
-            {
-                entry.displayName = std::move(displayName);
+void TdAccountData::assignDisplayName(UserId userId, UserInfo &entry, std::string baseName)
+{
+    // Keep the name already assigned (possibly with a suffix) as long as the user's own name
+    // hasn't changed, so that group chat member names stay stable
+    if (!entry.displayName.empty() && (entry.baseDisplayName == baseName))
+        return;
+
+    releaseDisplayName(userId, entry);
+    entry.baseDisplayName   = baseName;
+    entry.displayNameSuffix = 0;
+
+    if (!isDisplayNameTaken(baseName, userId))
+        entry.displayName = std::move(baseName);
+    else {
+        // Lowest free suffix, so that released ones are reused. Another user's own name may
+        // still look like a suffixed one, so such suffixes are skipped but stay free.
+        DisplayNameSuffixes  &suffixes = m_displayNameSuffixes[baseName];
+        std::vector<unsigned> skipped;
+        unsigned              suffix;
+        std::string           displayName;
+        while (true) {
+            if (!suffixes.released.empty()) {
+                suffix = *suffixes.released.begin();
+                suffixes.released.erase(suffixes.released.begin());
+            } else
+                suffix = suffixes.next++;
+            displayName = baseName + " #" + std::to_string(suffix);
+            if (!isDisplayNameTaken(displayName, userId))
                 break;
-            }
+            skipped.push_back(suffix);
         }
+        suffixes.released.insert(skipped.begin(), skipped.end());
+        entry.displayName       = std::move(displayName);
+        entry.displayNameSuffix = suffix;
     }
+
+    m_usersByDisplayName.emplace(entry.displayName, userId);
 }
 
 void TdAccountData::setUserStatus(UserId userId, td::td_api::object_ptr<td::td_api::UserStatus> status)
 {
     auto it = m_userInfo.find(userId);
     if (it != m_userInfo.end())
-        it->second.user->status_ = std::move(status);
+        it->second.user.status = std::move(status);
 }
 
 void TdAccountData::updateSmallProfilePhoto(UserId userId, td::td_api::object_ptr<td::td_api::file> photo)
 {
     auto it = m_userInfo.find(userId);
     if (it != m_userInfo.end()) {
-        td::td_api::user &user = *it->second.user;
-        if (user.profile_photo_)
-            user.profile_photo_->small_ = std::move(photo);
+        TgUser &user = it->second.user;
+        if (user.smallPhoto)
+            user.smallPhoto = std::move(photo);
     }
 }
 
@@ -375,8 +556,24 @@ bool TdAccountData::isBasicGroupInfoRequested(BasicGroupId groupId)
 
 void TdAccountData::updateBasicGroupInfo(BasicGroupId groupId, TdGroupInfoPtr groupInfo)
 {
-    if (groupInfo)
-        m_groups[groupId].fullInfo = std::move(groupInfo);
+    if (groupInfo) {
+        TdGroupInfoPtr &fullInfo = m_groups[groupId].fullInfo;
+        if (fullInfo)
+            for (const auto &member: fullInfo->members_)
+                if (member) {
+                    auto it = m_basicGroupsByMember.find(getUserId(*member));
+                    if (it != m_basicGroupsByMember.end()) {
+                        it->second.erase(groupId);
+                        if (it->second.empty())
+                            m_basicGroupsByMember.erase(it);
+                    }
+                }
+
+        fullInfo = std::move(groupInfo);
+        for (const auto &member: fullInfo->members_)
+            if (member)
+                m_basicGroupsByMember[getUserId(*member)].insert(groupId);
+    }
 }
 
 void TdAccountData::updateSupergroup(TdSupergroupPtr group)
@@ -431,42 +628,101 @@ void TdAccountData::addChat(TdChatPtr chat)
 
     auto it = m_chatInfo.find(getId(*chat));
     if (it != m_chatInfo.end())
-        it->second.chat = std::move(chat);
+        unindexChat(it->second.chat, it->second.purpleId);
     else {
-        auto entry = m_chatInfo.emplace(getId(*chat), ChatInfo());
-        entry.first->second.chat     = std::move(chat);
-        entry.first->second.purpleId = ++m_lastChatPurpleId;
+        it = m_chatInfo.emplace(getId(*chat), ChatInfo()).first;
+        it->second.purpleId = ++m_lastChatPurpleId;
     }
+    makeChat(*chat, it->second.chat);
+    indexChat(it->second.chat, it->second.purpleId);
+}
+
+template<typename IdType, typename MapType>
+static void addIndexEntry(MapType &index, IdType key, ChatId chatId)
+{
+    if (key.valid())
+        index[key] = chatId;
+}
+
+template<typename IdType, typename MapType>
+static void removeIndexEntry(MapType &index, IdType key, ChatId chatId)
+{
+    auto it = index.find(key);
+    if ((it != index.end()) && (it->second == chatId))
+        index.erase(it);
+}
+
+void TdAccountData::indexChat(const TgChat &chat, int32_t purpleId)
+{
+    ChatId chatId = getId(chat);
+    addIndexEntry(m_privateChatByUser, getUserIdByPrivateChat(chat), chatId);
+    addIndexEntry(m_chatByBasicGroup,  getBasicGroupId(chat), chatId);
+    addIndexEntry(m_chatBySupergroup,  getSupergroupId(chat), chatId);
+    addIndexEntry(m_chatBySecretChat,  getSecretChatId(chat), chatId);
+    m_chatByPurpleId[purpleId] = chatId;
+}
+
+void TdAccountData::unindexChat(const TgChat &chat, int32_t purpleId)
+{
+    ChatId chatId = getId(chat);
+    removeIndexEntry(m_privateChatByUser, getUserIdByPrivateChat(chat), chatId);
+    removeIndexEntry(m_chatByBasicGroup,  getBasicGroupId(chat), chatId);
+    removeIndexEntry(m_chatBySupergroup,  getSupergroupId(chat), chatId);
+    removeIndexEntry(m_chatBySecretChat,  getSecretChatId(chat), chatId);
+    removeIndexEntry(m_chatByPurpleId,    purpleId, chatId);
+}
+
+const TgChat *TdAccountData::getIndexedChat(ChatId chatId) const
+{
+    auto it = m_chatInfo.find(chatId);
+    return (it != m_chatInfo.end()) ? &it->second.chat : nullptr;
+}
+
+static int64_t getChatOrder(const TgChat *chat)
+{
+    int64_t order = 0;
+    if (chat)
+        for (const TgChatPosition &position: chat->positions)
+            order = std::max<int64_t>(order, position.order);
+    return order;
 }
 
 void TdAccountData::updateChatPosition(ChatId chatId, td::td_api::object_ptr<td::td_api::chatPosition> &&position)
 {
     auto it = m_chatInfo.find(chatId);
     if (position && position->list_ && (it != m_chatInfo.end())) {
-        auto listId = position->list_->get_id();
-        td::td_api::chat &chat = *it->second.chat;
+        int32_t listId = position->list_->get_id();
+        TgChat &chat   = it->second.chat;
         if (position->order_ == 0) {
             purpleDebug("Removing chat {} from list {}", {std::to_string(chatId.value()), std::to_string(listId)});
-            chat.positions_.erase(
-                std::remove_if(chat.positions_.begin(), chat.positions_.end(),
-                               [listId](const td::td_api::object_ptr<td::td_api::chatPosition> &chatPos) {
-                                   return chatPos && (chatPos->list_->get_id() == listId);
+            chat.positions.erase(
+                std::remove_if(chat.positions.begin(), chat.positions.end(),
+                               [listId](const TgChatPosition &chatPos) {
+                                   return (chatPos.listType == listId);
                                }),
-                chat.positions_.end());
+                chat.positions.end());
         } else {
-            auto pExisting = std::find_if(chat.positions_.begin(), chat.positions_.end(),
-                                          [listId](const td::td_api::object_ptr<td::td_api::chatPosition> &chatPos) {
-                                              return chatPos && (chatPos->list_->get_id() == listId);
+            auto pExisting = std::find_if(chat.positions.begin(), chat.positions.end(),
+                                          [listId](const TgChatPosition &chatPos) {
+                                              return (chatPos.listType == listId);
                                           });
-            if (pExisting != chat.positions_.end()) {
+            if (pExisting != chat.positions.end()) {
                 purpleDebug("Changing chat {}, list {} order to {}",
                             {std::to_string(chatId.value()), std::to_string(listId), std::to_string(position->order_)});
-                *pExisting = std::move(position);
+                pExisting->order = position->order_;
             } else {
                 purpleDebug("Adding chat {} to list {}", {std::to_string(chatId.value()), std::to_string(listId)});
-                chat.positions_.push_back(std::move(position));
+                chat.positions.push_back(TgChatPosition{listId, position->order_});
             }
         }
+
+        auto pGap = m_chatGaps.find(chatId);
+        int64_t order = getChatOrder(&chat);
+        if ((pGap != m_chatGaps.end()) && (pGap->second.chatOrder != order)) {
+            m_chatGapQueue.erase(getChatGapQueueKey(pGap->second));
+            pGap->second.chatOrder = order;
+            m_chatGapQueue.insert(getChatGapQueueKey(pGap->second));
+        }
     }
 }
 
@@ -474,16 +730,16 @@ void TdAccountData::updateChatTitle(ChatId chatId, const std::string &title)
 {
     auto it = m_chatInfo.find(chatId);
     if (it != m_chatInfo.end())
-        it->second.chat->title_ = title;
+        it->second.chat.title = InternedString(title);
 }
 
 void TdAccountData::updateSmallChatPhoto(ChatId chatId, td::td_api::object_ptr<td::td_api::file> photo)
 {
     auto it = m_chatInfo.find(chatId);
     if (it != m_chatInfo.end()) {
-        td::td_api::chat &chat = *it->second.chat;
-        if (chat.photo_)
-            chat.photo_->small_ = std::move(photo);
+        TgChat &chat = it->second.chat;
+        if (chat.smallPhoto)
+            chat.smallPhoto = std::move(photo);
     }
 }
 
@@ -503,13 +759,13 @@ void TdAccountData::getContactsWithNoChat(std::vector<UserId> &userIds)
     userIds = m_contactUserIdsNoChat;
 }
 
-const td::td_api::chat *TdAccountData::getChat(ChatId chatId) const
+const TgChat *TdAccountData::getChat(ChatId chatId) const
 {
     auto pChatInfo = m_chatInfo.find(chatId);
     if (pChatInfo == m_chatInfo.end())
         return nullptr;
     else
-        return pChatInfo->second.chat.get();
+        return &pChatInfo->second.chat;
 }
 
 int TdAccountData::getPurpleChatId(ChatId tdChatId)
@@ -521,62 +777,46 @@ int TdAccountData::getPurpleChatId(ChatId tdChatId)
         return pChatInfo->second.purpleId;
 }
 
-const td::td_api::chat *TdAccountData::getChatByPurpleId(int32_t purpleChatId) const
+const TgChat *TdAccountData::getChatByPurpleId(int32_t purpleChatId) const
 {
-    auto pChatInfo = std::find_if(m_chatInfo.begin(), m_chatInfo.end(),
-                                  [purpleChatId](const ChatMap::value_type &entry) {
-                                      return (entry.second.purpleId == purpleChatId);
-                                  });
-
-    if (pChatInfo != m_chatInfo.end())
-        return pChatInfo->second.chat.get();
+    auto it = m_chatByPurpleId.find(purpleChatId);
+    if (it != m_chatByPurpleId.end())
+        return getIndexedChat(it->second);
     else
         return nullptr;
 }
 
-static bool isPrivateChat(const td::td_api::chat &chat, UserId userId)
-{
-    if (chat.type_->get_id() == td::td_api::chatTypePrivate::ID) {
-        const td::td_api::chatTypePrivate &privType = static_cast<const td::td_api::chatTypePrivate &>(*chat.type_);
-        return (getUserId(privType) == userId);
-    }
-    return false;
-}
-
-const td::td_api::chat *TdAccountData::getPrivateChatByUserId(UserId userId) const
+const TgChat *TdAccountData::getPrivateChatByUserId(UserId userId) const
 {
-    auto pChatInfo = std::find_if(m_chatInfo.begin(), m_chatInfo.end(),
-                                  [userId](const ChatMap::value_type &entry) {
-                                      return isPrivateChat(*entry.second.chat, userId);
-                                  });
-    if (pChatInfo == m_chatInfo.end())
-        return nullptr;
+    auto it = m_privateChatByUser.find(userId);
+    if (it != m_privateChatByUser.end())
+        return getIndexedChat(it->second);
     else
-        return pChatInfo->second.chat.get();
+        return nullptr;
 }
 
-const td::td_api::user *TdAccountData::getUser(UserId userId) const
+const TgUser *TdAccountData::getUser(UserId userId) const
 {
     auto pUser = m_userInfo.find(userId);
     if (pUser == m_userInfo.end())
         return nullptr;
     else
-        return pUser->second.user.get();
+        return &pUser->second.user;
 }
 
-const td::td_api::user *TdAccountData::getUserByPhone(const char *phoneNumber) const
+const TgUser *TdAccountData::getUserByPhone(const char *phoneNumber) const
 {
     auto pUser = std::find_if(m_userInfo.begin(), m_userInfo.end(),
                               [phoneNumber](const UserMap::value_type &entry) {
-                                  return isPhoneEqual(entry.second.user->phone_number_, phoneNumber);
+                                  return isPhoneEqual(entry.second.user.phoneNumber.str(), phoneNumber);
                               });
     if (pUser == m_userInfo.end())
         return nullptr;
     else
-        return pUser->second.user.get();
+        return &pUser->second.user;
 }
 
-const td::td_api::user *TdAccountData::getUserByPrivateChat(const td::td_api::chat &chat)
+const TgUser *TdAccountData::getUserByPrivateChat(const TgChat &chat)
 {
     UserId userId = getUserIdByPrivateChat(chat);
     if (userId.valid())
@@ -584,7 +824,7 @@ const td::td_api::user *TdAccountData::getUserByPrivateChat(const td::td_api::ch
     return nullptr;
 }
 
-std::string TdAccountData::getDisplayName(const td::td_api::user &user) const
+std::string TdAccountData::getDisplayName(const TgUser &user) const
 {
     return getDisplayName(getId(user));
 }
@@ -599,15 +839,24 @@ std::string TdAccountData::getDisplayName(UserId userId) const
 }
 
 void TdAccountData::getUsersByDisplayName(const char *displayName,
-                                          std::vector<const td::td_api::user*> &users)
+                                          std::vector<const TgUser*> &users)
 {
     users.clear();
     if (!displayName || (*displayName == '\0'))
         return;
 
-    for (const UserMap::value_type &entry: m_userInfo)
-        if (entry.second.displayName == displayName)
-            users.push_back(entry.second.user.get());
+    auto range = m_usersByDisplayName.equal_range(displayName);
+    std::vector<UserId> userIds;
+    for (auto it = range.first; it != range.second; ++it)
+        userIds.push_back(it->second);
+
+    // Same order as iterating over m_userInfo
+    std::sort(userIds.begin(), userIds.end());
+    for (UserId userId: userIds) {
+        const TgUser *user = getUser(userId);
+        if (user)
+            users.push_back(user);
+    }
 }
 
 const td::td_api::basicGroup *TdAccountData::getBasicGroup(BasicGroupId groupId) const
@@ -655,46 +904,40 @@ const td::td_api::chatMembers *TdAccountData::getSupergroupMembers(SupergroupId
         return nullptr;
 }
 
-const td::td_api::chat *TdAccountData::getBasicGroupChatByGroup(BasicGroupId groupId) const
+const TgChat *TdAccountData::getBasicGroupChatByGroup(BasicGroupId groupId) const
 {
-    if (!groupId.valid())
-        return nullptr;
-
-    auto it = std::find_if(m_chatInfo.begin(), m_chatInfo.end(),
-                           [groupId](const ChatMap::value_type &entry) {
-                               return (getBasicGroupId(*entry.second.chat) == groupId);
-                           });
-
-    if (it != m_chatInfo.end())
-        return it->second.chat.get();
+    auto it = m_chatByBasicGroup.find(groupId);
+    if (it != m_chatByBasicGroup.end())
+        return getIndexedChat(it->second);
     else
         return nullptr;
 }
 
-const td::td_api::chat *TdAccountData::getSupergroupChatByGroup(SupergroupId groupId) const
+const TgChat *TdAccountData::getSupergroupChatByGroup(SupergroupId groupId) const
 {
-    if (!groupId.valid())
-        return nullptr;
-
-    auto it = std::find_if(m_chatInfo.begin(), m_chatInfo.end(),
-                           [groupId](const ChatMap::value_type &entry) {
-                               return (getSupergroupId(*entry.second.chat) == groupId);
-                           });
-
-    if (it != m_chatInfo.end())
-        return it->second.chat.get();
+    auto it = m_chatBySupergroup.find(groupId);
+    if (it != m_chatBySupergroup.end())
+        return getIndexedChat(it->second);
     else
         return nullptr;
 }
 
+bool TdAccountData::isGroupChatWithMembership(const TgChat &chat) const
+{
+    return isGroupWithMembership(getBasicGroupId(chat), getSupergroupId(chat));
+}
+
 bool TdAccountData::isGroupChatWithMembership(const td::td_api::chat &chat) const
 {
-    BasicGroupId groupId = getBasicGroupId(chat);
+    return isGroupWithMembership(getBasicGroupId(chat.type_), getSupergroupId(chat.type_));
+}
+
+bool TdAccountData::isGroupWithMembership(BasicGroupId groupId, SupergroupId supergroupId) const
+{
     if (groupId.valid()) {
         const td::td_api::basicGroup *group = getBasicGroup(groupId);
         return (group && isGroupMember(group->status_));
     }
-    SupergroupId supergroupId = getSupergroupId(chat);
     if (supergroupId.valid()) {
         const td::td_api::supergroup *group = getSupergroup(supergroupId);
         return (group && isGroupMember(group->status_));
@@ -702,29 +945,29 @@ bool TdAccountData::isGroupChatWithMembership(const td::td_api::chat &chat) cons
     return false;
 }
 
-const td::td_api::chat *TdAccountData::getChatBySecretChat(SecretChatId secretChatId)
+const TgChat *TdAccountData::getChatBySecretChat(SecretChatId secretChatId)
 {
-    auto it = std::find_if(m_chatInfo.begin(), m_chatInfo.end(),
-                           [secretChatId](const ChatMap::value_type &entry) {
-                               return (getSecretChatId(*entry.second.chat) == secretChatId);
-                           });
-
-    if (it != m_chatInfo.end())
-        return it->second.chat.get();
+    auto it = m_chatBySecretChat.find(secretChatId);
+    if (it != m_chatBySecretChat.end())
+        return getIndexedChat(it->second);
     else
         return nullptr;
 }
 
-void TdAccountData::getChats(std::vector<const td::td_api::chat *> &chats) const
+void TdAccountData::getChats(std::vector<const TgChat *> &chats) const
 {
     chats.clear();
     for (const ChatMap::value_type &item: m_chatInfo)
-        chats.push_back(item.second.chat.get());
+        chats.push_back(&item.second.chat);
 }
 
 void TdAccountData::deleteChat(ChatId id)
 {
-    m_chatInfo.erase(id);
+    auto it = m_chatInfo.find(id);
+    if (it != m_chatInfo.end()) {
+        unindexChat(it->second.chat, it->second.purpleId);
+        m_chatInfo.erase(it);
+    }
 }
 
 void TdAccountData::addExpectedChat(ChatId id)
@@ -746,16 +989,62 @@ void TdAccountData::removeExpectedChat(ChatId id)
 
 }
 
-std::unique_ptr<PendingRequest> TdAccountData::getPendingRequestImpl(uint64_t requestId)
+template<typename MapType, typename ValueType>
+static void removeRequestIndexEntry(MapType &index, typename MapType::key_type key, ValueType *request)
 {
-    auto it = std::find_if(m_requests.begin(), m_requests.end(),
-                           [requestId](const std::unique_ptr<PendingRequest> &req) {
-                               return (req->requestId == requestId);
-                           });
+    auto range = index.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it)
+        if (it->second == request) {
+            index.erase(it);
+            break;
+        }
+}
+
+// Request ids grow over time, so the smallest one is the request that was added first
+template<typename MapType>
+static typename MapType::mapped_type findOldestRequest(const MapType &index, typename MapType::key_type key)
+{
+    typename MapType::mapped_type result = nullptr;
+    auto range = index.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it)
+        if (!result || (it->second->requestId < result->requestId))
+            result = it->second;
+
+    return result;
+}
+
+void TdAccountData::addPendingRequestImpl(std::unique_ptr<PendingRequest> &&request)
+{
+    std::unique_ptr<PendingRequest> &entry = m_requests[request->requestId];
+    if (entry)
+        unindexPendingRequest(*entry);
+    entry = std::move(request);
+
+    DownloadRequest *downloadReq = entry->asDownloadRequest();
+    if (downloadReq)
+        m_downloadRequestsByFile.emplace(downloadReq->fileId, downloadReq);
+    ContactRequest *contactReq = entry->asContactRequest();
+    if (contactReq)
+        m_contactRequestsByUser.emplace(contactReq->userId, contactReq);
+}
+
+void TdAccountData::unindexPendingRequest(PendingRequest &request)
+{
+    DownloadRequest *downloadReq = request.asDownloadRequest();
+    if (downloadReq)
+        removeRequestIndexEntry(m_downloadRequestsByFile, downloadReq->fileId, downloadReq);
+    ContactRequest *contactReq = request.asContactRequest();
+    if (contactReq)
+        removeRequestIndexEntry(m_contactRequestsByUser, contactReq->userId, contactReq);
+}
 
+std::unique_ptr<PendingRequest> TdAccountData::getPendingRequestImpl(uint64_t requestId)
+{
+    auto it = m_requests.find(requestId);
     if (it != m_requests.end()) {
-        auto result = std::move(*it);
+        auto result = std::move(it->second);
         m_requests.erase(it);
+        unindexPendingRequest(*result);
         return result;
     }
 
@@ -764,62 +1053,42 @@ std::unique_ptr<PendingRequest> TdAccountData::getPendingRequestImpl(uint64_t re
 
 PendingRequest *TdAccountData::findPendingRequestImpl(uint64_t requestId)
 {
-    auto it = std::find_if(m_requests.begin(), m_requests.end(),
-                           [requestId](const std::unique_ptr<PendingRequest> &req) {
-                               return (req->requestId == requestId);
-                           });
-
+    auto it = m_requests.find(requestId);
     if (it != m_requests.end())
-        return it->get();
+        return it->second.get();
 
     return nullptr;
 }
 
 const ContactRequest *TdAccountData::findContactRequest(UserId userId)
 {
-    auto it = std::find_if(m_requests.begin(), m_requests.end(),
-                           [userId](const std::unique_ptr<PendingRequest> &req) {
-                               const ContactRequest *contactReq = dynamic_cast<const ContactRequest *>(req.get());
-                               return (contactReq && (contactReq->userId == userId));
-                           });
-
-    if (it != m_requests.end())
-        return static_cast<const ContactRequest *>(it->get());
-    return nullptr;
+    return findOldestRequest(m_contactRequestsByUser, userId);
 }
 
 DownloadRequest* TdAccountData::findDownloadRequest(int32_t fileId)
 {
-    auto it = std::find_if(m_requests.begin(), m_requests.end(),
-                           [fileId](const std::unique_ptr<PendingRequest> &req) {
-                               DownloadRequest *downloadReq = dynamic_cast<DownloadRequest *>(req.get());
-                               return (downloadReq && (downloadReq->fileId == fileId));
-                           });
-
-    if (it != m_requests.end())
-        return static_cast<DownloadRequest *>(it->get());
-    return nullptr;
+    return findOldestRequest(m_downloadRequestsByFile, fileId);
 }
 
 void TdAccountData::extractFileTransferRequests(std::vector<PurpleXfer *> &transfers)
 {
-    transfers.clear();
-
-    for (unsigned i = 0; i < m_requests.size(); ) {
-        UploadRequest *uploadReq = dynamic_cast<UploadRequest *>(m_requests[i].get());
-        NewPrivateChatForMessage *newChatReq = dynamic_cast<NewPrivateChatForMessage *>(m_requests[i].get());
-        PurpleXfer *xfer = NULL;
-        if (uploadReq)
-            xfer = uploadReq->xfer;
-        else if (newChatReq)
-            xfer = newChatReq->fileUpload;
+    std::vector<std::pair<uint64_t, PurpleXfer *>> uploads;
 
+    for (auto it = m_requests.begin(); it != m_requests.end(); ) {
+        PurpleXfer *xfer = it->second->getFileUpload();
         if (xfer) {
-            transfers.push_back(xfer);
-            m_requests.erase(m_requests.begin() + i);
+            uploads.emplace_back(it->first, xfer);
+            unindexPendingRequest(*it->second);
+            it = m_requests.erase(it);
         } else
-            i++;
+            ++it;
     }
+
+    // Same order as the requests were made
+    std::sort(uploads.begin(), uploads.end());
+    transfers.clear();
+    for (const auto &upload: uploads)
+        transfers.push_back(upload.second);
 }
 
 void TdAccountData::addTempFileUpload(int64_t messageId, const std::string &path)
@@ -920,16 +1189,12 @@ TdAccountData::getBasicGroupsWithMember(UserId userId)
 {
     std::vector<std::pair<BasicGroupId, const td::td_api::basicGroupFullInfo *>> result;
 
-    for (const auto &item: m_groups)
-        if (item.second.fullInfo) {
-            auto &members = item.second.fullInfo->members_;
-            if (std::any_of(members.begin(), members.end(),
-                            [userId](const td::td_api::object_ptr<td::td_api::chatMember> &member) {
-                                return (member && (getUserId(*member) == userId));
-                            }))
-            {
-                result.push_back(std::make_pair(getId(*item.second.group), item.second.fullInfo.get()));
-            }
+    auto it = m_basicGroupsByMember.find(userId);
+    if (it != m_basicGroupsByMember.end())
+        for (BasicGroupId groupId: it->second) {
+            auto pGroup = m_groups.find(groupId);
+            if ((pGroup != m_groups.end()) && pGroup->second.fullInfo)
+                result.push_back(std::make_pair(groupId, pGroup->second.fullInfo.get()));
         }
 
     return result;
@@ -961,27 +1226,129 @@ void TdAccountData::removeActiveCall()
 
 void TdAccountData::addPendingReadReceipt(ChatId chatId, MessageId messageId)
 {
-    auto pChatReceipts = std::find_if(m_pendingReadReceipts.begin(), m_pendingReadReceipts.end(),
-                                      [chatId](const std::vector<ReadReceipt> &receipts) {
-                                          return (!receipts.empty() && (receipts[0].chatId == chatId));
-                                      });
-    if (pChatReceipts != m_pendingReadReceipts.end())
-        pChatReceipts->push_back(ReadReceipt{chatId, messageId});
-    else {
-        m_pendingReadReceipts.emplace_back();
-        m_pendingReadReceipts.back().push_back(ReadReceipt{chatId, messageId});
-    }
+    PendingReadReceipts &receipts = m_pendingReadReceipts[chatId];
+    // Same message may be displayed more than once, e.g. after being edited
+    if (receipts.known.insert(messageId).second)
+        receipts.messageIds.push_back(messageId);
 }
 
 void TdAccountData::extractPendingReadReceipts(ChatId chatId, std::vector<ReadReceipt>& receipts)
 {
-    auto pChatReceipts = std::find_if(m_pendingReadReceipts.begin(), m_pendingReadReceipts.end(),
-                                      [chatId](const std::vector<ReadReceipt> &receipts) {
-                                          return (!receipts.empty() && (receipts[0].chatId == chatId));
-                                      });
+    receipts.clear();
+    auto pChatReceipts = m_pendingReadReceipts.find(chatId);
     if (pChatReceipts != m_pendingReadReceipts.end()) {
-        receipts = std::move(*pChatReceipts);
+        for (MessageId messageId: pChatReceipts->second.messageIds)
+            receipts.push_back(ReadReceipt{chatId, messageId});
         m_pendingReadReceipts.erase(pChatReceipts);
-    } else
-        receipts.clear();
+    }
+}
+
+bool TdAccountData::queueReadReceiptFlush(ChatId chatId)
+{
+    auto pChatReceipts = m_pendingReadReceipts.find(chatId);
+    if ((pChatReceipts == m_pendingReadReceipts.end()) || pChatReceipts->second.flushQueued)
+        return false;
+
+    pChatReceipts->second.flushQueued = true;
+    m_readReceiptFlushQueue.push_back(chatId);
+    return true;
+}
+
+void TdAccountData::extractReadReceiptFlushQueue(std::vector<ChatId> &chatIds)
+{
+    chatIds.clear();
+    std::swap(chatIds, m_readReceiptFlushQueue);
+    for (ChatId chatId: chatIds) {
+        auto pChatReceipts = m_pendingReadReceipts.find(chatId);
+        if (pChatReceipts != m_pendingReadReceipts.end())
+            pChatReceipts->second.flushQueued = false;
+    }
+}
+
+void TdAccountData::queueReplyFetch(ChatId chatId, MessageId messageId, MessageId replyMessageId)
+{
+    ReplyBatch &batch = m_replyFetches[chatId];
+    if (batch.replies.empty())
+        m_replyFetchChats.push_back(chatId);
+    batch.replies.emplace_back(messageId, replyMessageId);
+}
+
+void TdAccountData::extractReplyFetches(std::vector<std::pair<ChatId, ReplyBatch>> &batches)
+{
+    batches.clear();
+    for (ChatId chatId: m_replyFetchChats) {
+        auto it = m_replyFetches.find(chatId);
+        batches.emplace_back(chatId, std::move(it->second));
+        m_replyFetches.erase(it);
+    }
+    m_replyFetchChats.clear();
+}
+
+auto TdAccountData::getChatGapQueueKey(const QueuedChatGap &queuedGap) -> ChatGapQueueKey
+{
+    return ChatGapQueueKey(!queuedGap.gap.firstNewMessage.valid(), -queuedGap.chatOrder, queuedGap.gap.chatId);
+}
+
+bool TdAccountData::addChatGap(ChatId chatId, MessageId lastMessage)
+{
+    if ((m_chatGaps.find(chatId) != m_chatGaps.end()) ||
+        (m_activeGapRecoveries.find(chatId) != m_activeGapRecoveries.end()))
+    {
+        return false;
+    }
+
+    if (m_chatGaps.empty() && m_activeGapRecoveries.empty()) {
+        m_finishedGapRecoveries = 0;
+        m_gapRecoveryStartTime  = g_get_monotonic_time();
+    }
+
+    QueuedChatGap &queuedGap = m_chatGaps[chatId];
+    queuedGap.gap.chatId      = chatId;
+    queuedGap.gap.lastMessage = lastMessage;
+    queuedGap.chatOrder       = getChatOrder(getChat(chatId));
+    m_chatGapQueue.insert(getChatGapQueueKey(queuedGap));
+    return true;
+}
+
+bool TdAccountData::setChatGapNewMessage(ChatId chatId, MessageId messageId)
+{
+    auto pGap = m_chatGaps.find(chatId);
+    if ((pGap == m_chatGaps.end()) || pGap->second.gap.firstNewMessage.valid())
+        return false;
+
+    m_chatGapQueue.erase(getChatGapQueueKey(pGap->second));
+    pGap->second.gap.firstNewMessage = messageId;
+    m_chatGapQueue.insert(getChatGapQueueKey(pGap->second));
+    return true;
+}
+
+void TdAccountData::setMaxActiveGapRecoveries(unsigned maxActive)
+{
+    m_maxActiveGapRecoveries = std::max(maxActive, 1U);
+}
+
+bool TdAccountData::startChatGapRecovery(ChatGap &gap)
+{
+    if (m_chatGapQueue.empty() || (m_activeGapRecoveries.size() >= m_maxActiveGapRecoveries))
+        return false;
+
+    auto pGap = m_chatGaps.find(std::get<2>(*m_chatGapQueue.begin()));
+    m_chatGapQueue.erase(m_chatGapQueue.begin());
+    gap = pGap->second.gap;
+    m_chatGaps.erase(pGap);
+    m_activeGapRecoveries.insert(gap.chatId);
+    return true;
+}
+
+bool TdAccountData::finishChatGapRecovery(ChatId chatId)
+{
+    if (m_activeGapRecoveries.erase(chatId) == 0)
+        return false;
+    m_finishedGapRecoveries++;
+    return true;
+}
+
+unsigned TdAccountData::getTotalGapRecoveryCount() const
+{
+    return m_finishedGapRecoveries + m_activeGapRecoveries.size() + m_chatGaps.size();
 }
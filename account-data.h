@@ -4,12 +4,18 @@
 #include "buildopt.h"
 #include "identifiers.h"
 #include "transceiver.h"
+#include "last-message-store.h"
+#include "interned-string.h"
 #include <td/telegram/td_api.h>
 
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <mutex>
 #include <set>
 #include <list>
+#include <deque>
+#include <tuple>
 #include <purple.h>
 
 #ifndef NoVoip
@@ -21,16 +27,48 @@ namespace tgvoip {
 }
 #endif
 
+// Parts of td_api::user and td_api::chat this plugin uses. These are what TdAccountData keeps for
+// every known user and chat, rather than whole tdlib objects.
+struct TgUser {
+    UserId                                         id;
+    InternedString                                 firstName;
+    InternedString                                 lastName;
+    InternedString                                 phoneNumber;
+    std::vector<InternedString>                    usernames; // Active ones
+    td::td_api::object_ptr<td::td_api::UserStatus> status;
+    int64_t                                        photoId   = 0;
+    td::td_api::object_ptr<td::td_api::file>       smallPhoto;
+    bool                                           isContact = false;
+    bool                                           isDeleted = false;
+};
+
+struct TgChatPosition {
+    int32_t listType; // td_api::ChatList constructor id
+    int64_t order;
+};
+
+struct TgChat {
+    ChatId                                       id;
+    InternedString                               title;
+    td::td_api::object_ptr<td::td_api::ChatType> type;
+    td::td_api::object_ptr<td::td_api::file>     smallPhoto;
+    std::vector<TgChatPosition>                  positions;
+};
+
+inline UserId getId(const TgUser &user) { return user.id; }
+inline ChatId getId(const TgChat &chat) { return chat.id; }
+
 bool        isPhoneNumber(const char *s);
 const char *getCanonicalPhoneNumber(const char *s);
 UserId      purpleBuddyNameToUserId(const char *s);
 SecretChatId purpleBuddyNameToSecretChatId(const char *s);
-bool        isPrivateChat(const td::td_api::chat &chat);
+bool        isPrivateChat(const TgChat &chat);
+UserId      getUserIdByPrivateChat(const TgChat &chat);
 UserId      getUserIdByPrivateChat(const td::td_api::chat &chat);
-bool        isChatInContactList(const td::td_api::chat &chat, const td::td_api::user *privateChatUser);
-BasicGroupId getBasicGroupId(const td::td_api::chat &chat);
-SupergroupId getSupergroupId(const td::td_api::chat &chat);
-SecretChatId getSecretChatId(const td::td_api::chat &chat);
+bool        isChatInContactList(const TgChat &chat, const TgUser *privateChatUser);
+BasicGroupId getBasicGroupId(const TgChat &chat);
+SupergroupId getSupergroupId(const TgChat &chat);
+SecretChatId getSecretChatId(const TgChat &chat);
 bool        isGroupMember(const td::td_api::object_ptr<td::td_api::ChatMemberStatus> &status);
 bool        isSameUser(const td::td_api::MessageSender &member1, const td::td_api::MessageSender &member2);
 
@@ -39,12 +77,20 @@ enum {
     CHAT_HISTORY_RETRIEVE_LIMIT = 100
 };
 
+class DownloadRequest;
+class ContactRequest;
+
 class PendingRequest {
 public:
     uint64_t requestId;
 
     PendingRequest(uint64_t requestId) : requestId(requestId) {}
     virtual ~PendingRequest() {}
+
+    // Let TdAccountData index requests by something other than request id without dynamic_cast
+    virtual DownloadRequest *asDownloadRequest() { return nullptr; }
+    virtual ContactRequest  *asContactRequest()  { return nullptr; }
+    virtual PurpleXfer      *getFileUpload() const { return nullptr; }
 };
 
 class GroupInfoRequest: public PendingRequest {
@@ -83,6 +129,8 @@ public:
                    const std::string &groupName, UserId userId)
     : PendingRequest(requestId), phoneNumber(phoneNumber), alias(alias), groupName(groupName),
       userId(userId) {}
+
+    ContactRequest *asContactRequest() override { return this; }
 };
 
 class GroupJoinRequest: public PendingRequest {
@@ -116,6 +164,8 @@ public:
 
     UploadRequest(uint64_t requestId, PurpleXfer *xfer, ChatId chatId)
     : PendingRequest(requestId), xfer(xfer), chatId(chatId) {}
+
+    PurpleXfer *getFileUpload() const override { return xfer; }
 };
 
 struct TgMessageInfo {
@@ -132,6 +182,8 @@ struct TgMessageInfo {
     bool        sentLocally = false; // For outgoing messages, whether sent by this very client
     MessageId   repliedMessageId;
     td::td_api::object_ptr<td::td_api::message> repliedMessage;
+    // Quote made in advance when replied message was not fetched separately
+    std::string repliedMessageQuote;
     std::string forwardedFrom;
 
     void assign(const TgMessageInfo &other)
@@ -144,6 +196,7 @@ struct TgMessageInfo {
         sentLocally = other.sentLocally;
         repliedMessageId = other.repliedMessageId;
         repliedMessage = nullptr;
+        repliedMessageQuote = other.repliedMessageQuote;
         forwardedFrom = other.forwardedFrom;
     }
 };
@@ -183,6 +236,8 @@ public:
         if (message.repliedMessage)
             this->message.repliedMessage = std::move(message.repliedMessage);
     }
+
+    DownloadRequest *asDownloadRequest() override { return this; }
 };
 
 class AvatarDownloadRequest: public PendingRequest {
@@ -190,9 +245,9 @@ public:
     UserId userId;
     ChatId chatId;
 
-    AvatarDownloadRequest(uint64_t requestId, const td::td_api::user *user)
+    AvatarDownloadRequest(uint64_t requestId, const TgUser *user)
     : PendingRequest(requestId), userId(getId(*user)), chatId(ChatId::invalid) {}
-    AvatarDownloadRequest(uint64_t requestId, const td::td_api::chat *chat)
+    AvatarDownloadRequest(uint64_t requestId, const TgChat *chat)
     : PendingRequest(requestId), userId(UserId::invalid), chatId(getId(*chat)) {}
 };
 
@@ -208,6 +263,8 @@ public:
 
     NewPrivateChatForMessage(uint64_t requestId, const char *username, PurpleXfer *upload)
     : PendingRequest(requestId), username(username), fileUpload(upload) {}
+
+    PurpleXfer *getFileUpload() const override { return fileUpload; }
 };
 
 class ChatActionRequest: public PendingRequest {
@@ -263,22 +320,42 @@ public:
     void             setChatNotReady(ChatId chatId);
     void             setChatReady(ChatId chatId, std::vector<IncomingMessage> &readyMessages);
     bool             isChatReady(ChatId chatId);
+    // Puts chat's queued messages in message id order, for when they could not be added in order
+    void             sortChat(ChatId chatId);
+
+    // 0 means no limit. When a chat has more messages queued than that, the oldest ones are
+    // released by extractOverflowMessages even if they aren't ready. Nothing is released while the
+    // chat is not ready, as history being fetched may still go in front of queued messages.
+    void             setMaxDepth(unsigned maxDepth) { m_maxDepth = maxDepth; }
+    void             extractOverflowMessages(ChatId chatId, std::vector<IncomingMessage> &messages);
 private:
     struct Message {
         IncomingMessage message;
         bool            ready;
     };
+    using MessageIndex = std::unordered_multimap<MessageId, int64_t, IdentifierHash>;
     struct ChatQueue {
-        ChatId             chatId;
-        bool               ready = true;
-        std::list<Message> messages;
+        ChatId              chatId;
+        bool                ready = true;
+        std::deque<Message> messages;
+        // Messages are numbered in queue order: messages[i] has number frontNumber + i, and index
+        // maps message id to that number
+        int64_t             frontNumber = 0;
+        MessageIndex        index;
+        unsigned            creationOrder;
     };
-    std::vector<ChatQueue> m_queues;
-
-    std::vector<ChatQueue>::iterator getChatQueue(ChatId chatId);
-    Message &addMessage(ChatQueue &queue, MessageAction action);
-    void extractReadyMessages(std::vector<ChatQueue>::iterator pQueue,
-                              std::vector<IncomingMessage> &readyMessages);
+    using QueueMap = std::unordered_map<ChatId, ChatQueue, IdentifierHash>;
+    QueueMap m_queues;
+    unsigned m_queuesCreated = 0;
+    unsigned m_maxDepth = 0;
+
+    QueueMap::iterator getChatQueue(ChatId chatId);
+    ChatQueue &createChatQueue(ChatId chatId);
+    Message &addMessage(ChatQueue &queue, MessageId messageId, MessageAction action);
+    Message *findMessage(ChatQueue &queue, MessageId messageId);
+    IncomingMessage takeFrontMessage(ChatQueue &queue);
+    void     extractReadyMessages(QueueMap::iterator pQueue,
+                                  std::vector<IncomingMessage> &readyMessages);
 };
 
 struct ReadReceipt {
@@ -286,6 +363,17 @@ struct ReadReceipt {
     MessageId messageId;
 };
 
+// Replies among messages of one history fetch or update slice, whose sources are looked up together
+struct ReplyBatch {
+    std::vector<std::pair<MessageId, MessageId>> replies; // message id, replied message id
+};
+
+struct ChatGap {
+    ChatId    chatId;
+    MessageId lastMessage;     // Last message seen before the gap
+    MessageId firstNewMessage; // First message received after the gap, if any
+};
+
 class TdAccountData {
 public:
     using TdUserPtr           = td::td_api::object_ptr<td::td_api::user>;
@@ -306,6 +394,7 @@ public:
     TdTransceiver        &transceiver;
     TdAccountData(PurpleAccount *purpleAccount, TdTransceiver &transceiver)
     : purpleAccount(purpleAccount), transceiver(transceiver) {}
+    ~TdAccountData();
 
     void updateUser(TdUserPtr user);
     void setUserStatus(UserId UserId, td::td_api::object_ptr<td::td_api::UserStatus> status);
@@ -326,45 +415,46 @@ public:
     void updateSmallChatPhoto(ChatId chatId, td::td_api::object_ptr<td::td_api::file> photo);
     void setContacts(const td::td_api::users &users);
     void getContactsWithNoChat(std::vector<UserId> &userIds);
-    void getChats(std::vector<const td::td_api::chat *> &chats) const;
+    void getChats(std::vector<const TgChat *> &chats) const;
     void deleteChat(ChatId id);
     void addExpectedChat(ChatId id);
     bool isExpectedChat(ChatId chatId);
     void removeExpectedChat(ChatId id);
 
-    const td::td_api::chat       *getChat(ChatId chatId) const;
+    const TgChat                 *getChat(ChatId chatId) const;
     int                           getPurpleChatId(ChatId tdChatId);
-    const td::td_api::chat       *getChatByPurpleId(int32_t purpleChatId) const;
-    const td::td_api::chat       *getPrivateChatByUserId(UserId userId) const;
-    const td::td_api::user       *getUser(UserId userId) const;
-    const td::td_api::user       *getUserByPhone(const char *phoneNumber) const;
-    const td::td_api::user       *getUserByPrivateChat(const td::td_api::chat &chat);
-    std::string                   getDisplayName(const td::td_api::user &user) const;
+    const TgChat                 *getChatByPurpleId(int32_t purpleChatId) const;
+    const TgChat                 *getPrivateChatByUserId(UserId userId) const;
+    const TgUser                 *getUser(UserId userId) const;
+    const TgUser                 *getUserByPhone(const char *phoneNumber) const;
+    const TgUser                 *getUserByPrivateChat(const TgChat &chat);
+    std::string                   getDisplayName(const TgUser &user) const;
     std::string                   getDisplayName(UserId userId) const;
     void                          getUsersByDisplayName(const char *displayName,
-                                                        std::vector<const td::td_api::user*> &users);
+                                                        std::vector<const TgUser*> &users);
 
     const td::td_api::basicGroup *getBasicGroup(BasicGroupId groupId) const;
     const td::td_api::basicGroupFullInfo *getBasicGroupInfo(BasicGroupId groupId) const;
     const td::td_api::supergroup *getSupergroup(SupergroupId groupId) const;
     const td::td_api::supergroupFullInfo *getSupergroupInfo(SupergroupId groupId) const;
     const td::td_api::chatMembers*getSupergroupMembers(SupergroupId groupId) const;
-    const td::td_api::chat       *getBasicGroupChatByGroup(BasicGroupId groupId) const;
-    const td::td_api::chat       *getSupergroupChatByGroup(SupergroupId groupId) const;
+    const TgChat                 *getBasicGroupChatByGroup(BasicGroupId groupId) const;
+    const TgChat                 *getSupergroupChatByGroup(SupergroupId groupId) const;
+    bool                          isGroupChatWithMembership(const TgChat &chat) const;
     bool                          isGroupChatWithMembership(const td::td_api::chat &chat) const;
 
-    const td::td_api::chat       *getChatBySecretChat(SecretChatId secretChatId);
+    const TgChat                 *getChatBySecretChat(SecretChatId secretChatId);
 
     template<typename ReqType, typename... ArgsType>
     void addPendingRequest(ArgsType... args)
     {
-        m_requests.push_back(std::make_unique<ReqType>(args...));
+        addPendingRequestImpl(std::make_unique<ReqType>(args...));
     }
     template<typename ReqType>
     void addPendingRequest(uint64_t requestId, std::unique_ptr<ReqType> &&request)
     {
-        m_requests.push_back(std::move(request));
-        m_requests.back()->requestId = requestId;
+        request->requestId = requestId;
+        addPendingRequestImpl(std::move(request));
     }
     template<typename ReqType>
     std::unique_ptr<ReqType> getPendingRequest(uint64_t requestId)
@@ -403,23 +493,54 @@ public:
     void                       removeActiveCall();
 
     PendingMessageQueue        pendingMessages;
+    // Used instead of account settings if open, see saveChatLastMessage
+    LastMessageStore           lastMessages;
+    guint                      lastMessageFlushTimer = 0;
 
     void                       addPendingReadReceipt(ChatId chatId, MessageId messageId);
     void                       extractPendingReadReceipts(ChatId chatId, std::vector<ReadReceipt> &receipts);
+    // Chats whose pending read receipts are to be sent when readReceiptTimer fires, in the order
+    // they were queued. Returns false if the chat was already queued.
+    bool                       queueReadReceiptFlush(ChatId chatId);
+    void                       extractReadReceiptFlushQueue(std::vector<ChatId> &chatIds);
+    guint                      readReceiptTimer = 0;
+
+    void                       queueReplyFetch(ChatId chatId, MessageId messageId, MessageId replyMessageId);
+    // In the order the chats were first queued
+    void                       extractReplyFetches(std::vector<std::pair<ChatId, ReplyBatch>> &batches);
+
+    // Chats with skipped messages, recovered by fetching history a few chats at a time.
+    // addChatGap returns false if the chat already has a gap, queued or being recovered.
+    bool                       addChatGap(ChatId chatId, MessageId lastMessage);
+    // For a queued gap, remembers the first message received after it. Returns false if there is
+    // no such gap or a message was already remembered.
+    bool                       setChatGapNewMessage(ChatId chatId, MessageId messageId);
+    bool                       hasQueuedChatGaps() const { return !m_chatGaps.empty(); }
+    void                       setMaxActiveGapRecoveries(unsigned maxActive);
+    // Picks next gap to recover if the limit allows: chats with new messages first, then by
+    // position in chat list
+    bool                       startChatGapRecovery(ChatGap &gap);
+    // Returns false if chat was not being recovered
+    bool                       finishChatGapRecovery(ChatId chatId);
+    unsigned                   getActiveGapRecoveryCount() const { return m_activeGapRecoveries.size(); }
+    unsigned                   getFinishedGapRecoveryCount() const { return m_finishedGapRecoveries; }
+    unsigned                   getTotalGapRecoveryCount() const;
+    int64_t                    getGapRecoveryStartTime() const { return m_gapRecoveryStartTime; }
+    guint                      gapRecoveryTimer = 0;
 private:
     TdAccountData(const TdAccountData &other) = delete;
     TdAccountData &operator=(const TdAccountData &other) = delete;
 
     struct UserInfo {
-        TdUserPtr   user;
+        TgUser      user;
+        std::string baseDisplayName;
         std::string displayName;
+        unsigned    displayNameSuffix = 0; // " #n" added to baseDisplayName, 0 if none
     };
 
     struct ChatInfo {
-        int32_t   purpleId;
-        TdChatPtr chat;
-
-        ChatInfo() : purpleId(0), chat() {}
+        int32_t purpleId = 0;
+        TgChat  chat;
     };
 
     struct GroupInfo {
@@ -450,7 +571,26 @@ private:
     using UserMap = std::map<UserId, UserInfo>;
     UserMap                            m_userInfo;
     ChatMap                            m_chatInfo;
+
+    // Display name -> user, for resolving duplicate names without scanning m_userInfo
+    std::unordered_multimap<std::string, UserId>  m_usersByDisplayName;
+    struct DisplayNameSuffixes {
+        unsigned           next = 1; // Lowest suffix never handed out
+        std::set<unsigned> released; // Free suffixes below next
+    };
+    // Base display name -> " #n" suffixes for users whose base name is taken
+    std::unordered_map<std::string, DisplayNameSuffixes> m_displayNameSuffixes;
+
+    // Secondary indexes into m_chatInfo, maintained by addChat and deleteChat
+    std::unordered_map<UserId, ChatId, IdentifierHash>       m_privateChatByUser;
+    std::unordered_map<BasicGroupId, ChatId, IdentifierHash> m_chatByBasicGroup;
+    std::unordered_map<SupergroupId, ChatId, IdentifierHash> m_chatBySupergroup;
+    std::unordered_map<SecretChatId, ChatId, IdentifierHash> m_chatBySecretChat;
+    std::unordered_map<int32_t, ChatId>                      m_chatByPurpleId;
+
     std::map<BasicGroupId, GroupInfo>  m_groups;
+    // Basic groups each user is a member of, according to basicGroupFullInfo in m_groups
+    std::unordered_map<UserId, std::set<BasicGroupId>, IdentifierHash> m_basicGroupsByMember;
     std::map<SupergroupId, SupergroupInfo>  m_supergroups;
     std::map<SecretChatId, SecretChatPtr>   m_secretChats;
     int                                m_lastChatPurpleId = 0;
@@ -464,7 +604,10 @@ private:
     // Chats we want to libpurple-join when we get an updateNewChat about them
     std::vector<ChatId>                m_expectedChats;
 
-    std::vector<std::unique_ptr<PendingRequest>> m_requests;
+    std::unordered_map<uint64_t, std::unique_ptr<PendingRequest>> m_requests;
+    // Secondary indexes into m_requests
+    std::unordered_multimap<int32_t, DownloadRequest *>                m_downloadRequestsByFile;
+    std::unordered_multimap<UserId, ContactRequest *, IdentifierHash> m_contactRequestsByUser;
 
     // Newly sent messages containing inline images, for which a temporary file must be removed when
     // transfer is completed
@@ -477,11 +620,47 @@ private:
     std::unique_ptr<tgvoip::VoIPController> m_callData;
     int32_t                                 m_callId;
 
+    struct QueuedChatGap {
+        ChatGap gap;
+        int64_t chatOrder; // Kept up to date by updateChatPosition
+    };
+    // No new message, negated chat order, chat id
+    using ChatGapQueueKey = std::tuple<bool, int64_t, ChatId>;
+    static ChatGapQueueKey          getChatGapQueueKey(const QueuedChatGap &queuedGap);
+    bool                            isDisplayNameTaken(const std::string &displayName, UserId userId) const;
+    void                            releaseDisplayName(UserId userId, const UserInfo &entry);
+    void                            assignDisplayName(UserId userId, UserInfo &entry, std::string baseName);
+    bool                            isGroupWithMembership(BasicGroupId basicGroupId,
+                                                          SupergroupId supergroupId) const;
+    void                            indexChat(const TgChat &chat, int32_t purpleId);
+    void                            unindexChat(const TgChat &chat, int32_t purpleId);
+    const TgChat *                  getIndexedChat(ChatId chatId) const;
+    void                            addPendingRequestImpl(std::unique_ptr<PendingRequest> &&request);
+    void                            unindexPendingRequest(PendingRequest &request);
     std::unique_ptr<PendingRequest> getPendingRequestImpl(uint64_t requestId);
     PendingRequest *                findPendingRequestImpl(uint64_t requestId);
 
-    // Read receipts not sent immediately due to away status (grouped per chat)
-    std::vector<std::vector<ReadReceipt>> m_pendingReadReceipts;
+    // Read receipts not sent yet, due to away status or to be sent together with later ones
+    struct PendingReadReceipts {
+        std::vector<MessageId>                       messageIds;
+        std::unordered_set<MessageId, IdentifierHash> known;
+        bool                                         flushQueued = false;
+    };
+    std::unordered_map<ChatId, PendingReadReceipts, IdentifierHash> m_pendingReadReceipts;
+    std::vector<ChatId>                                             m_readReceiptFlushQueue;
+
+    std::unordered_map<ChatId, ReplyBatch, IdentifierHash> m_replyFetches;
+    std::vector<ChatId>                                    m_replyFetchChats;
+
+    // Not being recovered yet, in recovery order: chats with new messages first, then by position
+    // in chat list
+    std::unordered_map<ChatId, QueuedChatGap, IdentifierHash> m_chatGaps;
+    std::set<ChatGapQueueKey>                                 m_chatGapQueue;
+    std::unordered_set<ChatId, IdentifierHash>          m_activeGapRecoveries;
+    unsigned                                            m_maxActiveGapRecoveries = 1;
+    // Since the last time there were no gaps at all
+    unsigned                                            m_finishedGapRecoveries  = 0;
+    int64_t                                             m_gapRecoveryStartTime   = 0;
 };
 
 #endif
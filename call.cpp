@@ -69,9 +69,9 @@ static void discardCallCb(CallRequestData *data, int action)
 
 static std::string getPurpleUserName(UserId userId, TdAccountData &account)
 {
-    const td::td_api::user *user = account.getUser(userId);
+    const TgUser *user = account.getUser(userId);
     if (user) {
-        const td::td_api::chat *privateChat = account.getPrivateChatByUserId(userId);
+        const TgChat *privateChat = account.getPrivateChatByUserId(userId);
         if (privateChat && isChatInContactList(*privateChat, user))
             return getPurpleBuddyName(*user);
         else
@@ -269,7 +269,7 @@ void discardCurrentCall(TdAccountData &account, TdTransceiver &transceiver)
         discardCall(account.getActiveCallId(), transceiver);
 }
 
-void showCallMessage(const td::td_api::chat &chat, const TgMessageInfo &message,
+void showCallMessage(const TgChat &chat, const TgMessageInfo &message,
                      const td::td_api::messageCall &callEnded, TdAccountData &account)
 {
     std::string notification;
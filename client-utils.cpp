@@ -9,9 +9,16 @@
 #include <algorithm>
 #include <functional>
 #include <ctime>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
 
 enum {
     MAX_MESSAGE_PARTS = 10,
+    LAST_MESSAGE_FLUSH_SECONDS = 30,
+    // Worker threads with nothing to do exit after this long
+    WORKER_IDLE_TIMEOUT = 30
 };
 
 const char *errorCodeMessage()
@@ -127,10 +134,10 @@ const char *getPurpleStatusId(const td::td_api::UserStatus &tdStatus)
         return purple_primitive_get_id_from_type(PURPLE_STATUS_AWAY);
 }
 
-std::string getPurpleBuddyName(const td::td_api::user &user)
+std::string getPurpleBuddyName(const TgUser &user)
 {
     // Prepend "id" so it's not accidentally equal to our phone number which is account name
-    return "id" + std::to_string(user.id_);
+    return "id" + std::to_string(user.id.value());
 }
 
 std::string getSecretChatBuddyName(SecretChatId secretChatId)
@@ -138,14 +145,14 @@ std::string getSecretChatBuddyName(SecretChatId secretChatId)
     return "secret" + std::to_string(secretChatId.value());
 }
 
-std::vector<const td::td_api::user *> getUsersByPurpleName(const char *buddyName, TdAccountData &account,
-                                                           const char *action)
+std::vector<const TgUser *> getUsersByPurpleName(const char *buddyName, TdAccountData &account,
+                                                 const char *action)
 {
-    std::vector<const td::td_api::user *> result;
+    std::vector<const TgUser *> result;
 
     UserId userId = purpleBuddyNameToUserId(buddyName);
     if (userId.valid()) {
-        const td::td_api::user *tdUser = account.getUser(userId);
+        const TgUser *tdUser = account.getUser(userId);
         if (tdUser != nullptr)
             result.push_back(tdUser);
         else if (action)
@@ -174,7 +181,7 @@ PurpleConversation *getImConversation(PurpleAccount *account, const char *userna
     return conv;
 }
 
-PurpleConvChat *getChatConversation(TdAccountData &account, const td::td_api::chat &chat,
+PurpleConvChat *getChatConversation(TdAccountData &account, const TgChat &chat,
                                     int chatPurpleId)
 {
     std::string chatName       = getPurpleChatName(chat);
@@ -194,12 +201,12 @@ PurpleConvChat *getChatConversation(TdAccountData &account, const td::td_api::ch
     if ((conv == NULL) || purple_conv_chat_has_left(purple_conversation_get_chat_data(conv))) {
         if (chatPurpleId != 0) {
             purple_debug_misc(config::pluginId, "Creating conversation for chat %s (purple id %d)\n",
-                              chat.title_.c_str(), chatPurpleId);
+                              chat.title.c_str(), chatPurpleId);
             serv_got_joined_chat(purple_account_get_connection(account.purpleAccount), chatPurpleId, chatName.c_str());
             conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_CHAT, chatName.c_str(),
                                                          account.purpleAccount);
             if (conv == NULL)
-                purple_debug_warning(config::pluginId, "Did not create conversation for chat %s\n", chat.title_.c_str());
+                purple_debug_warning(config::pluginId, "Did not create conversation for chat %s\n", chat.title.c_str());
             else {
                 // Sometimes when the group has just been created, or we left it and then got
                 // messageChatDeleteMember, the chat will not be in buddy list. In that case,
@@ -207,14 +214,14 @@ PurpleConvChat *getChatConversation(TdAccountData &account, const td::td_api::ch
                 // to prevent that.
                 PurpleChat *purpleChat = purple_blist_find_chat(account.purpleAccount, chatName.c_str());
                 if (!purpleChat) {
-                    purple_debug_misc(config::pluginId, "Setting conversation title to '%s'\n", chat.title_.c_str());
-                    purple_conversation_set_title(conv, chat.title_.c_str());
+                    purple_debug_misc(config::pluginId, "Setting conversation title to '%s'\n", chat.title.c_str());
+                    purple_conversation_set_title(conv, chat.title.c_str());
                 }
                 newChatCreated = true;
             }
 
         } else
-            purple_debug_warning(config::pluginId, "No internal ID for chat %s\n", chat.title_.c_str());
+            purple_debug_warning(config::pluginId, "No internal ID for chat %s\n", chat.title.c_str());
     }
 
     if (conv) {
@@ -243,7 +250,7 @@ PurpleConvChat *getChatConversation(TdAccountData &account, const td::td_api::ch
     return NULL;
 }
 
-PurpleConvChat *findChatConversation(PurpleAccount *account, const td::td_api::chat &chat)
+PurpleConvChat *findChatConversation(PurpleAccount *account, const TgChat &chat)
 {
     std::string         name = getPurpleChatName(chat);
     PurpleConversation *conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_CHAT,
@@ -265,10 +272,10 @@ bool conversationHasFocus(PurpleConversation *conv)
         return purple_conversation_has_focus(conv);
 }
 
-void updatePrivateChat(TdAccountData &account, const td::td_api::chat *chat, const td::td_api::user &user)
+void updatePrivateChat(TdAccountData &account, const TgChat *chat, const TgUser &user)
 {
     std::string purpleUserName = getPurpleBuddyName(user);
-    std::string alias          = chat ? chat->title_ : makeBasicDisplayName(user);
+    std::string alias          = chat ? chat->title.str() : makeBasicDisplayName(user);
 
     PurpleBuddy *buddy = purple_find_buddy(account.purpleAccount, purpleUserName.c_str());
     if (buddy == NULL) {
@@ -306,11 +313,11 @@ void updatePrivateChat(TdAccountData &account, const td::td_api::chat *chat, con
         int64_t     oldPhotoId    = 0;
         if (oldPhotoIdStr)
             sscanf(oldPhotoIdStr, "%" G_GINT64_FORMAT, &oldPhotoId);
-        if (user.profile_photo_ && user.profile_photo_->small_)
+        if (user.smallPhoto)
         {
-            const td::td_api::file &photo = *user.profile_photo_->small_;
+            const td::td_api::file &photo = *user.smallPhoto;
             if (photo.local_ && photo.local_->is_downloading_completed_ &&
-                (user.profile_photo_->id_ != oldPhotoId))
+                (user.photoId != oldPhotoId))
             {
                 gchar  *img = NULL;
                 size_t  len;
@@ -321,7 +328,7 @@ void updatePrivateChat(TdAccountData &account, const td::td_api::chat *chat, con
                                          photo.local_->path_.c_str(), purpleUserName.c_str(),  err->message);
                     g_error_free(err);
                 } else {
-                    std::string newPhotoIdStr = std::to_string(user.profile_photo_->id_);
+                    std::string newPhotoIdStr = std::to_string(user.photoId);
                     purple_blist_node_set_string(PURPLE_BLIST_NODE(buddy), BuddyOptions::ProfilePhotoId,
                                                  newPhotoIdStr.c_str());
                     purple_debug_info(config::pluginId, "Loaded new profile photo for %s (id %s)\n",
@@ -338,7 +345,7 @@ void updatePrivateChat(TdAccountData &account, const td::td_api::chat *chat, con
     }
 }
 
-static void updateGroupChat(TdAccountData &account, const td::td_api::chat &chat,
+static void updateGroupChat(TdAccountData &account, const TgChat &chat,
                             const td::td_api::object_ptr<td::td_api::ChatMemberStatus> &groupStatus,
                             const char *groupType, const std::string &groupId)
 {
@@ -350,14 +357,14 @@ static void updateGroupChat(TdAccountData &account, const td::td_api::chat &chat
     std::string  chatName   = getPurpleChatName(chat);
     PurpleChat  *purpleChat = purple_blist_find_chat(account.purpleAccount, chatName.c_str());
     if (!purpleChat) {
-        purpleDebug("Adding new chat for {} {} ({})", {std::string(groupType), groupId, chat.title_});
-        purpleChat = purple_chat_new(account.purpleAccount, chat.title_.c_str(), getChatComponents(chat));
+        purpleDebug("Adding new chat for {} {} ({})", {std::string(groupType), groupId, chat.title.str()});
+        purpleChat = purple_chat_new(account.purpleAccount, chat.title.c_str(), getChatComponents(chat));
         purple_blist_add_chat(purpleChat, NULL, NULL);
     } else {
         const char *oldName = purple_chat_get_name(purpleChat);
-        if (chat.title_ != oldName) {
-            purple_debug_misc(config::pluginId, "Renaming chat '%s' to '%s'\n", oldName, chat.title_.c_str());
-            purple_blist_alias_chat(purpleChat, chat.title_.c_str());
+        if (chat.title.str() != oldName) {
+            purple_debug_misc(config::pluginId, "Renaming chat '%s' to '%s'\n", oldName, chat.title.c_str());
+            purple_blist_alias_chat(purpleChat, chat.title.c_str());
         }
     }
 
@@ -373,9 +380,9 @@ static void updateGroupChat(TdAccountData &account, const td::td_api::chat &chat
     }
 
     const char *oldPhotoId = purple_blist_node_get_string(PURPLE_BLIST_NODE(purpleChat), BuddyOptions::ProfilePhotoId);
-    if (chat.photo_ && chat.photo_->small_)
+    if (chat.smallPhoto)
     {
-        const td::td_api::file &photo = *chat.photo_->small_;
+        const td::td_api::file &photo = *chat.smallPhoto;
         if (photo.local_ && photo.local_->is_downloading_completed_ && photo.remote_ &&
             !photo.remote_->unique_id_.empty() && (!oldPhotoId || (photo.remote_->unique_id_ != oldPhotoId)))
         {
@@ -385,19 +392,19 @@ static void updateGroupChat(TdAccountData &account, const td::td_api::chat &chat
             g_file_get_contents(photo.local_->path_.c_str(), &img, &len, &err);
             if (err) {
                 purple_debug_warning(config::pluginId, "Failed to load chat photo %s for %s: %s\n",
-                                        photo.local_->path_.c_str(), chat.title_.c_str(),  err->message);
+                                        photo.local_->path_.c_str(), chat.title.c_str(),  err->message);
                 g_error_free(err);
             } else {
                 purple_blist_node_set_string(PURPLE_BLIST_NODE(purpleChat), BuddyOptions::ProfilePhotoId,
                                              photo.remote_->unique_id_.c_str());
                 purple_debug_info(config::pluginId, "Loaded new chat photo for %s (id %s)\n",
-                                  chat.title_.c_str(), photo.remote_->unique_id_.c_str());
+                                  chat.title.c_str(), photo.remote_->unique_id_.c_str());
                 purple_buddy_icons_node_set_custom_icon(PURPLE_BLIST_NODE(purpleChat),
                                                         reinterpret_cast<guchar *>(img), len);
             }
         }
     } else if (oldPhotoId) {
-        purple_debug_info(config::pluginId, "Removing chat photo from %s\n", chat.title_.c_str());
+        purple_debug_info(config::pluginId, "Removing chat photo from %s\n", chat.title.c_str());
         purple_blist_node_remove_setting(PURPLE_BLIST_NODE(purpleChat), BuddyOptions::ProfilePhotoId);
         purple_buddy_icons_node_set_custom_icon(PURPLE_BLIST_NODE(purpleChat), NULL, 0);
     }
@@ -406,7 +413,7 @@ static void updateGroupChat(TdAccountData &account, const td::td_api::chat &chat
 void updateBasicGroupChat(TdAccountData &account, BasicGroupId groupId)
 {
     const td::td_api::basicGroup *group = account.getBasicGroup(groupId);
-    const td::td_api::chat       *chat  = account.getBasicGroupChatByGroup(groupId);
+    const TgChat                 *chat  = account.getBasicGroupChatByGroup(groupId);
 
     if (!group)
         purpleDebug("Basic group {} does not exist yet\n", groupId.value());
@@ -419,7 +426,7 @@ void updateBasicGroupChat(TdAccountData &account, BasicGroupId groupId)
 void updateSupergroupChat(TdAccountData &account, SupergroupId groupId)
 {
     const td::td_api::supergroup *group = account.getSupergroup(groupId);
-    const td::td_api::chat       *chat  = account.getSupergroupChatByGroup(groupId);
+    const TgChat                 *chat  = account.getSupergroupChatByGroup(groupId);
 
     if (!group)
         purpleDebug("Supergroup {} does not exist yet\n", groupId.value());
@@ -441,7 +448,7 @@ static std::string lastMessageSetting(ChatId chatId)
     return "last-message-chat" + std::to_string(chatId.value());
 }
 
-void removeGroupChat(PurpleAccount *purpleAccount, const td::td_api::chat &chat)
+void removeGroupChat(PurpleAccount *purpleAccount, const TgChat &chat)
 {
     std::string  chatName   = getPurpleChatName(chat);
     PurpleChat  *purpleChat = purple_blist_find_chat(purpleAccount, chatName.c_str());
@@ -454,7 +461,7 @@ void removeGroupChat(PurpleAccount *purpleAccount, const td::td_api::chat &chat)
     //purple_account_remove_setting(purpleAccount, setting.c_str());
 }
 
-void removePrivateChat(TdAccountData &account, const td::td_api::chat &chat)
+void removePrivateChat(TdAccountData &account, const TgChat &chat)
 {
     // TODO: uncomment when updateNewChat(chat_list=NULL) + updateChatChatList(non-NULL) at login
     // no longer removes chat
@@ -462,8 +469,26 @@ void removePrivateChat(TdAccountData &account, const td::td_api::chat &chat)
     //purple_account_remove_setting(account.purpleAccount, setting.c_str());
 }
 
+static gboolean flushLastMessages(gpointer data)
+{
+    TdAccountData &account = *static_cast<TdAccountData *>(data);
+    account.lastMessageFlushTimer = 0;
+    account.lastMessages.flush();
+
+    return G_SOURCE_REMOVE;
+}
+
 void saveChatLastMessage(TdAccountData &account, ChatId chatId, MessageId messageId)
 {
+    if (account.lastMessages.isOpen()) {
+        // Last message changes all the time in busy chats, so write all changes together later
+        account.lastMessages.set(chatId, messageId);
+        if (account.lastMessages.hasChanges() && !account.lastMessageFlushTimer)
+            account.lastMessageFlushTimer = account.transceiver.addTimeout(LAST_MESSAGE_FLUSH_SECONDS,
+                                                                           flushLastMessages, &account);
+        return;
+    }
+
     std::string setting = lastMessageSetting(chatId);
     std::string value = std::to_string(messageId.value());
     purple_account_set_string(account.purpleAccount, setting.c_str(), value.c_str());
@@ -471,23 +496,30 @@ void saveChatLastMessage(TdAccountData &account, ChatId chatId, MessageId messag
 
 MessageId getChatLastMessage(TdAccountData &account, ChatId chatId)
 {
+    if (account.lastMessages.isOpen()) {
+        MessageId messageId = account.lastMessages.get(chatId);
+        if (messageId.valid())
+            return messageId;
+        // Otherwise fall back to value saved by earlier versions
+    }
+
     std::string setting = lastMessageSetting(chatId);
     const char *value = purple_account_get_string(account.purpleAccount, setting.c_str(), NULL);
 
     return value ? MessageId::fromString(value) : MessageId();
 }
 
-std::string makeBasicDisplayName(const td::td_api::user &user)
+std::string makeBasicDisplayName(const TgUser &user)
 {
-    std::string result = user.first_name_;
-    if (!result.empty() && !user.last_name_.empty())
+    std::string result = user.firstName.str();
+    if (!result.empty() && !user.lastName.empty())
         result += ' ';
-    result += user.last_name_;
+    result += user.lastName.str();
 
     return result;
 }
 
-std::string getIncomingGroupchatSenderPurpleName(const td::td_api::chat &chat, const td::td_api::message &message,
+std::string getIncomingGroupchatSenderPurpleName(const TgChat &chat, const td::td_api::message &message,
                                                  const TdAccountData &account)
 {
     if (!message.is_outgoing_ && (getBasicGroupId(chat).valid() || getSupergroupId(chat).valid())) {
@@ -528,9 +560,9 @@ std::string getForwardSource(const td::td_api::messageForwardInfo &forwardInfo,
         case td::td_api::messageOriginHiddenUser::ID:
             return static_cast<const td::td_api::messageOriginHiddenUser &>(*forwardInfo.origin_).sender_name_;
         case td::td_api::messageOriginChannel::ID: {
-            const td::td_api::chat *chat = account.getChat(getChatId(static_cast<const td::td_api::messageOriginChannel&>(*forwardInfo.origin_)));
+            const TgChat *chat = account.getChat(getChatId(static_cast<const td::td_api::messageOriginChannel&>(*forwardInfo.origin_)));
             if (chat)
-                return chat->title_;
+                return chat->title.str();
         }
     }
 
@@ -622,12 +654,12 @@ static void setChatMembers(PurpleConvChat *purpleChat,
         if (!member || !isGroupMember(member->status_))
             continue;
 
-        const td::td_api::user *user = account.getUser(getUserId(*member));
-        if (!user || (user->type_ && (user->type_->get_id() == td::td_api::userTypeDeleted::ID)))
+        const TgUser *user = account.getUser(getUserId(*member));
+        if (!user || user->isDeleted)
             continue;
 
         std::string userName    = getPurpleBuddyName(*user);
-        const char *phoneNumber = getCanonicalPhoneNumber(user->phone_number_.c_str());
+        const char *phoneNumber = getCanonicalPhoneNumber(user->phoneNumber.c_str());
         if (purple_find_buddy(account.purpleAccount, userName.c_str()))
             // libpurple will be able to map user name to alias because there is a buddy
             nameData.emplace_back(userName);
@@ -830,13 +862,13 @@ int transmitMessage(ChatId chatId, const char *message, TdTransceiver &transceiv
     return 0;
 }
 
-std::string getSenderDisplayName(const td::td_api::chat &chat, const TgMessageInfo &message,
+std::string getSenderDisplayName(const TgChat &chat, const TgMessageInfo &message,
                                  PurpleAccount *account)
 {
     if (message.outgoing)
         return purple_account_get_name_for_display(account);
     else if (isPrivateChat(chat) || getSecretChatId(chat).valid())
-        return chat.title_;
+        return chat.title.str();
     else
         return message.incomingGroupchatSender;
 }
@@ -845,9 +877,9 @@ std::string getDownloadXferPeerName(ChatId chatId,
                                     const TgMessageInfo &message,
                                     TdAccountData &account)
 {
-    const td::td_api::chat *chat = account.getChat(chatId);
+    const TgChat *chat = account.getChat(chatId);
     if (chat) {
-        const td::td_api::user *privateUser = account.getUserByPrivateChat(*chat);
+        const TgUser *privateUser = account.getUserByPrivateChat(*chat);
         if (privateUser)
             return getPurpleBuddyName(*privateUser);
         auto secretChatId = getSecretChatId(*chat);
@@ -860,7 +892,7 @@ std::string getDownloadXferPeerName(ChatId chatId,
 void notifySendFailed(const td::td_api::updateMessageSendFailed &sendFailed, TdAccountData &account)
 {
     if (sendFailed.message_) {
-        const td::td_api::chat *chat = account.getChat(getChatId(*sendFailed.message_));
+        const TgChat *chat = account.getChat(getChatId(*sendFailed.message_));
         if (chat) {
             std::string errorMessage = formatMessage(errorCodeMessage(), {std::to_string(sendFailed.error_->code_),
                                                      sendFailed.error_->message_});
@@ -897,13 +929,13 @@ void updateOption(const td::td_api::updateOption &option, TdAccountData &account
         purple_debug_misc(config::pluginId, "Option update %s\n", option.name_.c_str());
 }
 
-void populateGroupChatList(PurpleRoomlist *roomlist, const std::vector<const td::td_api::chat *> &chats,
+void populateGroupChatList(PurpleRoomlist *roomlist, const std::vector<const TgChat *> &chats,
                            const TdAccountData &account)
 {
-    for (const td::td_api::chat *chat: chats)
+    for (const TgChat *chat: chats)
         if (account.isGroupChatWithMembership(*chat)) {
             PurpleRoomlistRoom *room = purple_roomlist_room_new(PURPLE_ROOMLIST_ROOMTYPE_ROOM,
-                                                                chat->title_.c_str(), NULL);
+                                                                chat->title.c_str(), NULL);
             purple_roomlist_room_add_field (roomlist, room, getPurpleChatName(*chat).c_str());
             BasicGroupId groupId = getBasicGroupId(*chat);
             if (groupId.valid()) {
@@ -928,14 +960,47 @@ AccountThread::AccountThread(PurpleAccount* purpleAccount)
     m_accountProtocolId = purple_account_get_protocol_id(purpleAccount);
 }
 
-void AccountThread::threadFunc()
+bool AccountThread::isForAccount(PurpleAccount *purpleAccount) const
 {
-    run();
-    g_idle_add(&AccountThread::mainThreadCallback, this);
+    return (m_accountUserName == purple_account_get_username(purpleAccount)) &&
+           (m_accountProtocolId == purple_account_get_protocol_id(purpleAccount));
 }
 
 static bool g_singleThread = false;
 
+static struct {
+    std::mutex                  mutex;
+    std::condition_variable     hasWork;
+    std::deque<AccountThread *> highPriority;
+    std::deque<AccountThread *> normalPriority;
+    // Thread limit set by each account, 0 meaning number of CPU cores
+    std::map<PurpleAccount *, unsigned> accountLimits;
+    unsigned                    maxThreads  = 1;
+    unsigned                    threadCount = 0;
+    unsigned                    idleThreads = 0;
+    unsigned                    running     = 0;
+    size_t                      maxQueued   = 0;
+    bool                        stopping    = false;
+    std::vector<std::thread>    threads;
+    // Threads which exited after being idle, joined when next thread is started
+    std::vector<std::thread>    exitedThreads;
+} g_workerPool;
+
+static unsigned getWorkerPoolLimit()
+{
+    return g_workerPool.maxThreads;
+}
+
+// Must be called with g_workerPool.mutex locked
+static void updateWorkerPoolLimit()
+{
+    unsigned cores = std::max(std::thread::hardware_concurrency(), 1U);
+    unsigned limit = 0;
+    for (const auto &entry: g_workerPool.accountLimits)
+        limit = std::max(limit, (entry.second != 0) ? entry.second : cores);
+    g_workerPool.maxThreads = (limit != 0) ? limit : cores;
+}
+
 void AccountThread::setSingleThread()
 {
     g_singleThread = true;
@@ -946,14 +1011,148 @@ bool AccountThread::isSingleThread()
     return g_singleThread;
 }
 
-void AccountThread::startThread()
+void AccountThread::setMaxThreads(PurpleAccount *purpleAccount, unsigned maxThreads)
 {
-    if (!g_singleThread) {
-        if (!m_thread.joinable())
-            m_thread = std::thread(std::bind(&AccountThread::threadFunc, this));
-    } else {
+    std::lock_guard<std::mutex> lock(g_workerPool.mutex);
+    g_workerPool.accountLimits[purpleAccount] = maxThreads;
+    updateWorkerPoolLimit();
+    // Excess threads exit once they finish their current task
+    g_workerPool.hasWork.notify_all();
+}
+
+// Must be called with g_workerPool.mutex locked
+static void takeQueuedTasks(std::vector<AccountThread *> &tasks,
+                            std::function<bool(const AccountThread *task)> predicate)
+{
+    for (std::deque<AccountThread *> *queue: {&g_workerPool.highPriority, &g_workerPool.normalPriority}) {
+        auto pTaken = std::stable_partition(queue->begin(), queue->end(),
+                                            [&predicate](const AccountThread *task) {
+                                                return !predicate(task);
+                                            });
+        tasks.insert(tasks.end(), pTaken, queue->end());
+        queue->erase(pTaken, queue->end());
+    }
+}
+
+void AccountThread::removeAccount(PurpleAccount *purpleAccount)
+{
+    std::vector<AccountThread *> cancelled;
+    {
+        std::lock_guard<std::mutex> lock(g_workerPool.mutex);
+        g_workerPool.accountLimits.erase(purpleAccount);
+        updateWorkerPoolLimit();
+        g_workerPool.hasWork.notify_all();
+        takeQueuedTasks(cancelled, [purpleAccount](const AccountThread *task) {
+            return task->isForAccount(purpleAccount);
+        });
+    }
+
+    if (!cancelled.empty())
+        purple_debug_misc(config::pluginId, "Cancelled %zu queued worker tasks\n", cancelled.size());
+    for (AccountThread *task: cancelled)
+        delete task;
+}
+
+void AccountThread::shutdown()
+{
+    std::vector<AccountThread *> cancelled;
+    std::vector<std::thread>     threads;
+    {
+        std::lock_guard<std::mutex> lock(g_workerPool.mutex);
+        g_workerPool.stopping = true;
+        g_workerPool.hasWork.notify_all();
+        takeQueuedTasks(cancelled, [](const AccountThread *) { return true; });
+        threads = std::move(g_workerPool.threads);
+        g_workerPool.threads.clear();
+        for (std::thread &thread: g_workerPool.exitedThreads)
+            threads.push_back(std::move(thread));
+        g_workerPool.exitedThreads.clear();
+    }
+
+    purple_debug_misc(config::pluginId, "Stopping %zu worker threads, cancelled %zu queued tasks\n",
+                      threads.size(), cancelled.size());
+    for (std::thread &thread: threads)
+        thread.join();
+    for (AccountThread *task: cancelled)
+        delete task;
+
+    std::lock_guard<std::mutex> lock(g_workerPool.mutex);
+    g_workerPool.stopping = false;
+}
+
+void AccountThread::submit(Priority priority)
+{
+    if (g_singleThread) {
         run();
         mainThreadCallback(this);
+        return;
+    }
+
+    std::vector<std::thread> exitedThreads;
+    {
+        std::lock_guard<std::mutex> lock(g_workerPool.mutex);
+        if (priority == Priority::High)
+            g_workerPool.highPriority.push_back(this);
+        else
+            g_workerPool.normalPriority.push_back(this);
+
+        size_t queued = g_workerPool.highPriority.size() + g_workerPool.normalPriority.size();
+        g_workerPool.maxQueued = std::max(g_workerPool.maxQueued, queued);
+        purple_debug_misc(config::pluginId, "Worker tasks: %zu queued (at most %zu so far), %u running\n",
+                          queued, g_workerPool.maxQueued, g_workerPool.running);
+
+        if ((g_workerPool.idleThreads == 0) && (g_workerPool.threadCount < getWorkerPoolLimit())) {
+            g_workerPool.threadCount++;
+            g_workerPool.threads.emplace_back(&AccountThread::workerFunc);
+            std::swap(exitedThreads, g_workerPool.exitedThreads);
+        } else
+            g_workerPool.hasWork.notify_one();
+    }
+
+    // These have already left workerFunc, so this doesn't block
+    for (std::thread &thread: exitedThreads)
+        thread.join();
+}
+
+void AccountThread::workerFunc()
+{
+    std::unique_lock<std::mutex> lock(g_workerPool.mutex);
+    auto hasWork = []() {
+        return !g_workerPool.highPriority.empty() || !g_workerPool.normalPriority.empty() ||
+               (g_workerPool.threadCount > getWorkerPoolLimit()) || g_workerPool.stopping;
+    };
+
+    while (!g_workerPool.stopping && (g_workerPool.threadCount <= getWorkerPoolLimit())) {
+        std::deque<AccountThread *> &queue = !g_workerPool.highPriority.empty() ? g_workerPool.highPriority
+                                                                                 : g_workerPool.normalPriority;
+        if (queue.empty()) {
+            g_workerPool.idleThreads++;
+            bool woken = g_workerPool.hasWork.wait_for(lock, std::chrono::seconds(WORKER_IDLE_TIMEOUT), hasWork);
+            g_workerPool.idleThreads--;
+            if (!woken)
+                break;
+            continue;
+        }
+
+        AccountThread *task = queue.front();
+        queue.pop_front();
+        g_workerPool.running++;
+        lock.unlock();
+        task->run();
+        g_idle_add(&AccountThread::mainThreadCallback, task);
+        lock.lock();
+        g_workerPool.running--;
+    }
+
+    g_workerPool.threadCount--;
+    // Unless shutdown has already taken it, hand own std::thread over to be joined later
+    auto pSelf = std::find_if(g_workerPool.threads.begin(), g_workerPool.threads.end(),
+                              [](const std::thread &thread) {
+                                  return (thread.get_id() == std::this_thread::get_id());
+                              });
+    if (pSelf != g_workerPool.threads.end()) {
+        g_workerPool.exitedThreads.push_back(std::move(*pSelf));
+        g_workerPool.threads.erase(pSelf);
     }
 }
 
@@ -963,11 +1162,11 @@ gboolean AccountThread::mainThreadCallback(gpointer data)
     PurpleAccount  *account  = purple_accounts_find(self->m_accountUserName.c_str(),
                                                     self->m_accountProtocolId.c_str());
     PurpleTdClient *tdClient = account ? getTdClient(account) : nullptr;
-    if (self->m_thread.joinable())
-        self->m_thread.join();
 
     if (tdClient)
         self->callback(tdClient);
+    else
+        delete self;
 
     return FALSE; // this idle callback will not be called again
 }
@@ -12,26 +12,26 @@ std::string         getDisplayedError(const td::td_api::object_ptr<td::td_api::O
 std::string         proxyTypeToString(PurpleProxyType proxyType);
 
 const char *        getPurpleStatusId(const td::td_api::UserStatus &tdStatus);
-std::string         getPurpleBuddyName(const td::td_api::user &user);
+std::string         getPurpleBuddyName(const TgUser &user);
 std::string         getSecretChatBuddyName(SecretChatId secretChatId);
-std::vector<const td::td_api::user *> getUsersByPurpleName(const char *buddyName, TdAccountData &account,
-                                                           const char *action);
+std::vector<const TgUser *> getUsersByPurpleName(const char *buddyName, TdAccountData &account,
+                                                 const char *action);
 PurpleConversation *getImConversation(PurpleAccount *account, const char *username);
-PurpleConvChat *    getChatConversation(TdAccountData &account, const td::td_api::chat &chat,
+PurpleConvChat *    getChatConversation(TdAccountData &account, const TgChat &chat,
                                         int chatPurpleId);
-PurpleConvChat *    findChatConversation(PurpleAccount *account, const td::td_api::chat &chat);
+PurpleConvChat *    findChatConversation(PurpleAccount *account, const TgChat &chat);
 bool                conversationHasFocus(PurpleConversation *conv);
 
-void                updatePrivateChat(TdAccountData &account, const td::td_api::chat *chat, const td::td_api::user &user);
+void                updatePrivateChat(TdAccountData &account, const TgChat *chat, const TgUser &user);
 void                updateBasicGroupChat(TdAccountData &account, BasicGroupId groupId);
 void                updateSupergroupChat(TdAccountData &account, SupergroupId groupId);
 bool                isInviteLinkActive(const td::td_api::chatInviteLink &linkInfo);
-void                removeGroupChat(PurpleAccount *purpleAccount, const td::td_api::chat &chat);
-void                removePrivateChat(TdAccountData &account, const td::td_api::chat &chat);
+void                removeGroupChat(PurpleAccount *purpleAccount, const TgChat &chat);
+void                removePrivateChat(TdAccountData &account, const TgChat &chat);
 void                saveChatLastMessage(TdAccountData &account, ChatId chatId, MessageId messageId);
 MessageId           getChatLastMessage(TdAccountData &account, ChatId chatId);
-std::string         makeBasicDisplayName(const td::td_api::user &user);
-std::string         getIncomingGroupchatSenderPurpleName(const td::td_api::chat &chat, const td::td_api::message &message,
+std::string         makeBasicDisplayName(const TgUser &user);
+std::string         getIncomingGroupchatSenderPurpleName(const TgChat &chat, const td::td_api::message &message,
                                                          const TdAccountData &account);
 std::string         getForwardSource(const td::td_api::messageForwardInfo &forwardInfo,
                                      const TdAccountData &accountData);
@@ -39,7 +39,7 @@ void                getNamesFromAlias(const char *alias, std::string &firstName,
 std::vector<PurpleChat *> findChatsByJoinString(const std::string &inviteLink);
 std::vector<PurpleChat *> findChatsByNewGroup(const char *name, int type);
 
-std::string getSenderDisplayName(const td::td_api::chat &chat, const TgMessageInfo &message,
+std::string getSenderDisplayName(const TgChat &chat, const TgMessageInfo &message,
                                  PurpleAccount *account);
 std::string getDownloadXferPeerName(ChatId chatId,
                                     const TgMessageInfo &message,
@@ -59,24 +59,38 @@ int  transmitMessage(ChatId chatId, const char *message, TdTransceiver &transcei
 void requestRecoveryEmailConfirmation(PurpleConnection *gc, const char *emailInfo);
 
 void updateOption(const td::td_api::updateOption &option, TdAccountData &account);
-void populateGroupChatList(PurpleRoomlist *roomlist, const std::vector<const td::td_api::chat *> &chats,
+void populateGroupChatList(PurpleRoomlist *roomlist, const std::vector<const TgChat *> &chats,
                            const TdAccountData &account);
 
+// Task run on a pool of worker threads shared by all accounts. When run() is done, callback() is
+// called on the main thread, provided the account is still logged in.
 class AccountThread {
 public:
     using Callback = void (PurpleTdClient::*)(AccountThread *thread);
+    enum class Priority {
+        Normal,
+        High // E.g. when other messages are waiting for this one to be shown
+    };
     static void setSingleThread();
     static bool isSingleThread();
+    // 0 means number of CPU cores. The pool is shared by all accounts, so it is as large as the
+    // highest limit of any account.
+    static void setMaxThreads(PurpleAccount *purpleAccount, unsigned maxThreads);
+    // Drops the account's thread limit, and its tasks which have not started yet
+    static void removeAccount(PurpleAccount *purpleAccount);
+    // Drops all queued tasks and waits for worker threads to finish running ones and exit
+    static void shutdown();
 
     AccountThread(PurpleAccount *purpleAccount);
     virtual ~AccountThread() {}
-    void startThread();
+    // Takes ownership; the task is queued until a worker thread is free
+    void submit(Priority priority = Priority::Normal);
 private:
-    std::thread m_thread;
     std::string m_accountUserName;
     std::string m_accountProtocolId;
 
-    void            threadFunc();
+    bool            isForAccount(PurpleAccount *purpleAccount) const;
+    static void     workerFunc();
     static gboolean mainThreadCallback(gpointer data);
 protected:
     virtual void run() = 0;
@@ -197,7 +197,7 @@ static void inlineDownloadResponse(uint64_t requestId,
                     StickerConversionThread *thread;
                     thread = new StickerConversionThread(account.purpleAccount, path, getChatId(*pendingMessage->message),
                                                          &pendingMessage->messageInfo);
-                    thread->startThread();
+                    thread->submit(AccountThread::Priority::High);
                 } else
                     replacementFile = pendingMessage->thumbnail.get();
             }
@@ -299,6 +299,7 @@ static void handleLongInlineDownload(uint64_t requestId, TdTransceiver &transcei
             for (IncomingMessage &pendingMessage: readyMessages)
                 if (pendingMessage.message && (getId(*pendingMessage.message) == pRequest->message.id)) {
                     pRequest->message.repliedMessage = std::move(pendingMessage.repliedMessage);
+                    pRequest->message.repliedMessageQuote = pendingMessage.messageInfo.repliedMessageQuote;
                     pRequest->thumbnail = std::move(pendingMessage.thumbnail);
                 }
         }
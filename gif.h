@@ -133,6 +133,35 @@ static void GifGetClosestPaletteColor(GifPalette* pPal, int r, int g, int b, int
     }
 }
 
+// Remembers GifGetClosestPaletteColor results for one palette. Animation frames tend to
+// contain few distinct colors, so most pixels skip the tree search.
+struct GifColorCache
+{
+    enum { kBits = 12, kSize = 1 << kBits };
+    uint32_t key[kSize];    // 0x01rrggbb for filled entries
+    uint8_t  index[kSize];
+};
+
+static void GifResetColorCache(GifColorCache* cache)
+{
+    memset(cache->key, 0, sizeof(cache->key));
+}
+
+static int GifLookupPaletteColor(GifPalette* pPal, GifColorCache* cache, int r, int g, int b)
+{
+    uint32_t key = (1u << 24) | ((uint32_t)r << 16) | ((uint32_t)g << 8) | (uint32_t)b;
+    uint32_t slot = (key * 2654435761u) >> (32 - GifColorCache::kBits);
+    if(cache->key[slot] == key)
+        return cache->index[slot];
+
+    int32_t bestDiff = 1000000;
+    int32_t bestInd = 1;
+    GifGetClosestPaletteColor(pPal, r, g, b, bestInd, bestDiff);
+    cache->key[slot] = key;
+    cache->index[slot] = (uint8_t)bestInd;
+    return bestInd;
+}
+
 static void GifSwapPixels(uint8_t* image, int pixA, int pixB)
 {
     uint32_t *pA = reinterpret_cast<uint32_t *>(image) + pixA;
@@ -311,20 +340,25 @@ static void GifSplitPalette(uint8_t* image, int numPixels, int firstElt, int las
 // moves them to the fromt of th buffer.
 // This allows us to build a palette optimized for the colors of the
 // changed pixels only.
+// Pixels are compared as whole words with alpha masked out, and only every
+// fourth pixel is sampled - plenty for building a palette.
 static int GifPickChangedPixels( const uint8_t* lastFrame, uint8_t* frame, int numPixels )
 {
+    static const uint8_t kRgbMaskBytes[4] = {0xff, 0xff, 0xff, 0};
+    uint32_t rgbMask;
+    memcpy(&rgbMask, kRgbMaskBytes, sizeof(rgbMask));
+
     int numChanged = 0;
     uint8_t* writeIter = frame;
 
     for (int ii=0; ii<numPixels; ii += 4)
     {
-        if(lastFrame[0] != frame[0] ||
-           lastFrame[1] != frame[1] ||
-           lastFrame[2] != frame[2])
+        uint32_t lastPixel, pixel;
+        memcpy(&lastPixel, lastFrame, sizeof(lastPixel));
+        memcpy(&pixel, frame, sizeof(pixel));
+        if((lastPixel ^ pixel) & rgbMask)
         {
-            writeIter[0] = frame[0];
-            writeIter[1] = frame[1];
-            writeIter[2] = frame[2];
+            memcpy(writeIter, &pixel, sizeof(pixel));
             ++numChanged;
             writeIter += 4;
         }
@@ -475,96 +509,92 @@ static void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame,
     GIF_TEMP_FREE(quantPixels);
 }
 
-// The LZW dictionary is a 256-ary tree constructed as the file is encoded,
-// this is one node
-struct GifLzwNode
+// The LZW dictionary, constructed as the file is encoded: an open addressing hash table
+// mapping (code of a run, next value) to the code of the extended run.
+// Small enough to stay in cache and to clear cheaply, unlike a 256-ary tree.
+struct GifLzwDict
 {
-    uint16_t m_next[256];
+    enum { kBits = 12, kSize = 1 << kBits };  // several times the number of codes, for short probes
+    uint32_t key[kSize];    // (code << 8 | value) + 1, 0 for empty slots
+    uint16_t code[kSize];
 };
 
+static void GifClearLzwDict( GifLzwDict* dict )
+{
+    memset(dict->key, 0, sizeof(dict->key));
+}
+
+// Returns the slot for the run, which is either empty or holds its code
+static uint32_t GifFindLzwSlot( const GifLzwDict* dict, uint32_t key )
+{
+    uint32_t slot = (key * 2654435761u) >> (32 - GifLzwDict::kBits);
+    while( dict->key[slot] && (dict->key[slot] != key) )
+        slot = (slot + 1) & (GifLzwDict::kSize - 1);
+    return slot;
+}
+
 // write a 256-color (8-bit) image palette to the file
 static void GifWritePalette( const GifPalette* pPal, FILE* f )
 {
-    fputc(0, f);  // first color: transparency
-    fputc(0, f);
-    fputc(0, f);
+    const int numColors = 1 << pPal->bitDepth;
+    uint8_t colors[256*3];
 
-    for(int ii=1; ii<(1 << pPal->bitDepth); ++ii)
+    colors[0] = colors[1] = colors[2] = 0;  // first color: transparency
+    for(int ii=1; ii<numColors; ++ii)
     {
-        uint32_t r = pPal->r[ii];
-        uint32_t g = pPal->g[ii];
-        uint32_t b = pPal->b[ii];
-
-        fputc((int)r, f);
-        fputc((int)g, f);
-        fputc((int)b, f);
+        colors[ii*3]   = pPal->r[ii];
+        colors[ii*3+1] = pPal->g[ii];
+        colors[ii*3+2] = pPal->b[ii];
     }
+
+    fwrite(colors, 3, (size_t)numColors, f);
 }
 
-// Simple structure to write out the LZW-compressed portion of the image
-// one bit at a time
+// Packs LZW codes into a memory buffer a whole byte at a time;
+// the buffer is written out as data sub-blocks once the image is complete
 struct GifBitStatus
 {
-    uint8_t bitIndex;  // how many bits in the partial byte written so far
-    uint8_t byte;      // current partial byte
-
-    uint32_t chunkIndex;
-    uint8_t chunk[256];   // bytes are written in here until we have 256 of them, then written to the file
+    uint32_t bits;      // pending bits not making up a whole byte yet, LSB first
+    uint32_t bitCount;
+    uint8_t* out;       // next free byte in the buffer
 };
 
-// insert a single bit
-static void GifWriteBit( GifBitStatus& stat, uint32_t bit )
+// Enough for one code per pixel plus dictionary clears, at no more than 12 bits per code
+static size_t GifLzwBufferSize( uint32_t width, uint32_t height )
 {
-    bit = bit & 1;
-    bit = bit << stat.bitIndex;
-    stat.byte |= bit;
-
-    ++stat.bitIndex;
-    if( stat.bitIndex > 7 )
-    {
-        // move the newly-finished byte to the chunk buffer
-        stat.chunk[stat.chunkIndex++] = stat.byte;
-        // and start a new byte
-        stat.bitIndex = 0;
-        stat.byte = 0;
-    }
+    return (size_t)width * height * 2 + 64;
 }
 
-// write all bytes so far to the file
-static void GifWriteChunk( FILE* f, GifBitStatus& stat )
+static void GifWriteCode( GifBitStatus& stat, uint32_t code, uint32_t length )
 {
-    fputc((int)stat.chunkIndex, f);
-    fwrite(stat.chunk, 1, stat.chunkIndex, f);
-    stat.chunkIndex = 0;
+    stat.bits |= code << stat.bitCount;
+    stat.bitCount += length;
+    while( stat.bitCount >= 8 )
+    {
+        *stat.out++ = (uint8_t)stat.bits;
+        stat.bits >>= 8;
+        stat.bitCount -= 8;
+    }
 }
 
-static void GifWriteCode( FILE* f, GifBitStatus& stat, uint32_t code, uint32_t length )
+// write packed image data as sub-blocks of up to 255 bytes, followed by the terminator
+static void GifWriteChunks( FILE* f, const uint8_t* data, size_t size )
 {
-    uint8_t value = code << stat.bitIndex;
-    if (stat.bitIndex + length < 8) {
-        stat.byte |= value;
-    } else {
-        stat.chunk[stat.chunkIndex++] = stat.byte | value;
-
-        uint8_t part = 8-stat.bitIndex;
-        length -= part;
-        code = code >> part;
-        while (length >= 8) {
-            stat.chunk[stat.chunkIndex++] = code;
-
-            code = code >> 8;
-            length -= 8;
-        }
-        stat.byte = code;
-        stat.bitIndex = length;
+    while( size )
+    {
+        size_t chunkSize = (size < 255) ? size : 255;
+        fputc((int)chunkSize, f);
+        fwrite(data, 1, chunkSize, f);
+        data += chunkSize;
+        size -= chunkSize;
     }
 
-    if (stat.chunkIndex >= 250)
-        GifWriteChunk(f, stat);
+    fputc(0, f); // image block terminator
 }
 
-// Picks palette colors for the image using simple thresholding, no dithering
-static void GifThresholdImageAndWrite(FILE* f, const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, uint32_t delay, bool transparent, GifPalette* pPal )
+// Picks palette colors for the image using simple thresholding, no dithering.
+// Without localPalette, the image uses the global color table written by GifBegin.
+static void GifThresholdImageAndWrite(FILE* f, const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, uint32_t delay, bool transparent, GifPalette* pPal, bool localPalette, GifColorCache* cache, uint8_t* lzwBuffer )
 {
     enum {left = 0, top = 0};
     // graphics control extension
@@ -592,11 +622,13 @@ static void GifThresholdImageAndWrite(FILE* f, const uint8_t* lastFrame, const u
     fputc(height & 0xff, f);
     fputc((height >> 8) & 0xff, f);
 
-    //fputc(0, f); // no local color table, no transparency
-    //fputc(0x80, f); // no local color table, but transparency
-
-    fputc(0x80 + pPal->bitDepth-1, f); // local color table present, 2 ^ bitDepth entries
-    GifWritePalette(pPal, f);
+    if(localPalette)
+    {
+        fputc(0x80 + pPal->bitDepth-1, f); // local color table present, 2 ^ bitDepth entries
+        GifWritePalette(pPal, f);
+    }
+    else
+        fputc(0, f); // no local color table
 
     const int minCodeSize = pPal->bitDepth;
     const uint32_t clearCode = 1 << pPal->bitDepth;
@@ -604,19 +636,19 @@ static void GifThresholdImageAndWrite(FILE* f, const uint8_t* lastFrame, const u
     fputc(minCodeSize, f); // min code size 8 bits
 
     enum {DICT_SIZE = 1024};
-    GifLzwNode* codetree = (GifLzwNode*)GIF_TEMP_MALLOC(sizeof(GifLzwNode)*DICT_SIZE);
+    GifLzwDict* dict = (GifLzwDict*)GIF_TEMP_MALLOC(sizeof(GifLzwDict));
 
-    memset(codetree, 0, sizeof(GifLzwNode)*DICT_SIZE);
+    GifClearLzwDict(dict);
     int32_t curCode = -1;
     uint32_t codeSize = (uint32_t)minCodeSize + 1;
     uint32_t maxCode = clearCode+1;
 
     GifBitStatus stat;
-    stat.byte = 0;
-    stat.bitIndex = 0;
-    stat.chunkIndex = 0;
+    stat.bits = 0;
+    stat.bitCount = 0;
+    stat.out = lzwBuffer;
 
-    GifWriteCode(f, stat, clearCode, codeSize);  // start with a fresh LZW dictionary
+    GifWriteCode(stat, clearCode, codeSize);  // start with a fresh LZW dictionary
 
     uint32_t numPixels = width*height;
     for( uint32_t ii=0; ii<numPixels; ++ii )
@@ -645,15 +677,13 @@ static void GifThresholdImageAndWrite(FILE* f, const uint8_t* lastFrame, const u
         else
         {
             // palettize the pixel
-            int32_t bestDiff = 1000000;
-            int32_t bestInd = 1;
-            GifGetClosestPaletteColor(pPal, nextFrame[0], nextFrame[1], nextFrame[2], bestInd, bestDiff);
+            int bestInd = GifLookupPaletteColor(pPal, cache, nextFrame[0], nextFrame[1], nextFrame[2]);
 
             // Write the resulting color to the output buffer
             outFrame[0] = pPal->r[bestInd];
             outFrame[1] = pPal->g[bestInd];
             outFrame[2] = pPal->b[bestInd];
-            nextValue = bestInd;
+            nextValue = (uint8_t)bestInd;
         }
 
         if(lastFrame) lastFrame += 4;
@@ -669,18 +699,23 @@ static void GifThresholdImageAndWrite(FILE* f, const uint8_t* lastFrame, const u
             // first value in a new run
             curCode = nextValue;
         }
-        else if( codetree[curCode].m_next[nextValue] )
-        {
-            // current run already in the dictionary
-            curCode = codetree[curCode].m_next[nextValue];
-        }
         else
         {
+            uint32_t key = ((uint32_t)curCode << 8 | nextValue) + 1;
+            uint32_t slot = GifFindLzwSlot(dict, key);
+            if( dict->key[slot] )
+            {
+                // current run already in the dictionary
+                curCode = dict->code[slot];
+                continue;
+            }
+
             // finish the current run, write a code
-            GifWriteCode(f, stat, (uint32_t)curCode, codeSize);
+            GifWriteCode(stat, (uint32_t)curCode, codeSize);
 
             // insert the new run into the dictionary
-            codetree[curCode].m_next[nextValue] = (uint16_t)++maxCode;
+            dict->key[slot] = key;
+            dict->code[slot] = (uint16_t)++maxCode;
 
             if( maxCode >= (1ul << codeSize) )
             {
@@ -691,9 +726,9 @@ static void GifThresholdImageAndWrite(FILE* f, const uint8_t* lastFrame, const u
             if( maxCode == DICT_SIZE-1 )
             {
                 // the dictionary is full, clear it out and begin anew
-                GifWriteCode(f, stat, clearCode, codeSize); // clear tree
+                GifWriteCode(stat, clearCode, codeSize); // clear dictionary
 
-                memset(codetree, 0, sizeof(GifLzwNode)*DICT_SIZE);
+                GifClearLzwDict(dict);
                 codeSize = (uint32_t)(minCodeSize + 1);
                 maxCode = clearCode+1;
             }
@@ -703,63 +738,66 @@ static void GifThresholdImageAndWrite(FILE* f, const uint8_t* lastFrame, const u
     }
 
     // compression footer
-    GifWriteCode(f, stat, (uint32_t)curCode, codeSize);
-    GifWriteCode(f, stat, clearCode, codeSize);
-    GifWriteCode(f, stat, clearCode + 1, (uint32_t)minCodeSize + 1);
-
-    // write out the last partial chunk
-    while( stat.bitIndex ) GifWriteBit(stat, 0);
-    if( stat.chunkIndex ) GifWriteChunk(f, stat);
+    GifWriteCode(stat, (uint32_t)curCode, codeSize);
+    GifWriteCode(stat, clearCode, codeSize);
+    GifWriteCode(stat, clearCode + 1, (uint32_t)minCodeSize + 1);
 
-    fputc(0, f); // image block terminator
+    // pad out the last partial byte
+    if( stat.bitCount ) *stat.out++ = (uint8_t)stat.bits;
+    GifWriteChunks(f, lzwBuffer, (size_t)(stat.out - lzwBuffer));
 
-    GIF_TEMP_FREE(codetree);
+    GIF_TEMP_FREE(dict);
 }
 
 struct GifWriter
 {
     FILE* f;
     std::unique_ptr<uint8_t[]> oldImage;
+    std::unique_ptr<uint8_t[]> lzwBuffer;
+    std::unique_ptr<GifColorCache> colorCache;
+    GifPalette palette;         // palette shared by all frames, if globalPalette is set
+    uint32_t width, height, delay;
     bool firstFrame;
+    bool globalPalette;
 };
 
-// Creates a gif file.
-// The input GIFWriter is assumed to be uninitialized.
-// The delay value is the time between frames in hundredths of a second - note that not all viewers pay much attention to this value.
-static bool GifBegin( GifWriter* writer, int fd, uint32_t width, uint32_t height, uint32_t delay, int32_t bitDepth = 8, bool dither = false )
+// Writes the file header. pGlobalPal is written as the global color table, otherwise
+// a dummy one is written and every frame carries its own palette.
+static void GifWriteHeader( GifWriter* writer, const GifPalette* pGlobalPal )
 {
-    (void)bitDepth; (void)dither; // Mute "Unused argument" warnings
-    writer->f = fdopen(fd, "wb");
-    if(!writer->f) return false;
-
-    writer->firstFrame = true;
-
-    // allocate
-    writer->oldImage = std::unique_ptr<uint8_t[]>(new uint8_t[width*height*4]);
-
     fputs("GIF89a", writer->f);
 
     // screen descriptor
-    fputc(width & 0xff, writer->f);
-    fputc((width >> 8) & 0xff, writer->f);
-    fputc(height & 0xff, writer->f);
-    fputc((height >> 8) & 0xff, writer->f);
-
-    fputc(0xf0, writer->f);  // there is an unsorted global color table of 2 entries
-    fputc(0, writer->f);     // background color
-    fputc(0, writer->f);     // pixels are square (we need to specify this because it's 1989)
-
-    // now the "global" palette (really just a dummy palette)
-    // color 0: black
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    // color 1: also black
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-
-    if( delay != 0 )
+    fputc(writer->width & 0xff, writer->f);
+    fputc((writer->width >> 8) & 0xff, writer->f);
+    fputc(writer->height & 0xff, writer->f);
+    fputc((writer->height >> 8) & 0xff, writer->f);
+
+    if(pGlobalPal)
+    {
+        fputc(0xf0 + pGlobalPal->bitDepth-1, writer->f);  // global color table of 2 ^ bitDepth entries
+        fputc(0, writer->f);     // background color
+        fputc(0, writer->f);     // pixels are square
+        GifWritePalette(pGlobalPal, writer->f);
+    }
+    else
+    {
+        fputc(0xf0, writer->f);  // there is an unsorted global color table of 2 entries
+        fputc(0, writer->f);     // background color
+        fputc(0, writer->f);     // pixels are square (we need to specify this because it's 1989)
+
+        // now the "global" palette (really just a dummy palette)
+        // color 0: black
+        fputc(0, writer->f);
+        fputc(0, writer->f);
+        fputc(0, writer->f);
+        // color 1: also black
+        fputc(0, writer->f);
+        fputc(0, writer->f);
+        fputc(0, writer->f);
+    }
+
+    if( writer->delay != 0 )
     {
         // animation header
         fputc(0x21, writer->f); // extension
@@ -774,6 +812,33 @@ static bool GifBegin( GifWriter* writer, int fd, uint32_t width, uint32_t height
 
         fputc(0, writer->f); // block terminator
     }
+}
+
+// Creates a gif file.
+// The input GIFWriter is assumed to be uninitialized.
+// The delay value is the time between frames in hundredths of a second - note that not all viewers pay much attention to this value.
+// With globalPalette, the palette built for the first frame is used for all of them: smaller output
+// and faster encoding, at the cost of colors that only show up in later frames.
+static bool GifBegin( GifWriter* writer, int fd, uint32_t width, uint32_t height, uint32_t delay, int32_t bitDepth = 8, bool dither = false, bool globalPalette = false )
+{
+    (void)bitDepth; (void)dither; // Mute "Unused argument" warnings
+    writer->f = fdopen(fd, "wb");
+    if(!writer->f) return false;
+
+    writer->firstFrame = true;
+    writer->width = width;
+    writer->height = height;
+    writer->delay = delay;
+    writer->globalPalette = globalPalette;
+
+    // allocate
+    writer->oldImage = std::unique_ptr<uint8_t[]>(new uint8_t[width*height*4]);
+    writer->lzwBuffer = std::unique_ptr<uint8_t[]>(new uint8_t[GifLzwBufferSize(width, height)]);
+    writer->colorCache = std::unique_ptr<GifColorCache>(new GifColorCache);
+
+    // Global palette is only known once the first frame comes
+    if(!globalPalette)
+        GifWriteHeader(writer, NULL);
 
     return true;
 }
@@ -787,17 +852,35 @@ static bool GifWriteFrame( GifWriter* writer, const uint8_t* image, uint32_t wid
     if(!writer->f) return false;
 
     const uint8_t* oldImage = writer->firstFrame? NULL : writer->oldImage.get();
+    const bool firstFrame = writer->firstFrame;
     writer->firstFrame = false;
 
-    GifPalette pal;
-    GifMakePalette((dither? NULL : oldImage), image, width, height, bitDepth, transparent, dither, &pal);
-
     if(dither) {
         // Broken - no output
+        GifPalette pal;
+        GifMakePalette(NULL, image, width, height, bitDepth, transparent, dither, &pal);
         GifDitherImage(oldImage, image, writer->oldImage.get(), width, height, &pal);
         return false;
-    } else
-        GifThresholdImageAndWrite(writer->f, oldImage, image, writer->oldImage.get(), width, height, delay, transparent, &pal);
+    }
+
+    if(writer->globalPalette)
+    {
+        if(firstFrame)
+        {
+            GifMakePalette(NULL, image, width, height, bitDepth, transparent, false, &writer->palette);
+            GifResetColorCache(writer->colorCache.get());
+            GifWriteHeader(writer, &writer->palette);
+        }
+    }
+    else
+    {
+        GifMakePalette(oldImage, image, width, height, bitDepth, transparent, false, &writer->palette);
+        GifResetColorCache(writer->colorCache.get());
+    }
+
+    GifThresholdImageAndWrite(writer->f, oldImage, image, writer->oldImage.get(), width, height, delay, transparent,
+                              &writer->palette, !writer->globalPalette, writer->colorCache.get(),
+                              writer->lzwBuffer.get());
 
     return true;
 }
@@ -805,17 +888,21 @@ static bool GifWriteFrame( GifWriter* writer, const uint8_t* image, uint32_t wid
 // Writes the EOF code, closes the file handle, and frees temp memory used by a GIF.
 // Many if not most viewers will still display a GIF properly if the EOF code is missing,
 // but it's still a good idea to write it out.
+// Returns false if any write to the file, or closing it, failed.
 static bool GifEnd( GifWriter* writer )
 {
     if(!writer->f) return false;
 
     fputc(0x3b, writer->f); // end of file
-    fclose(writer->f);
+    bool success = !ferror(writer->f);
+    if(fclose(writer->f) != 0) success = false;
 
     writer->f = NULL;
     writer->oldImage.reset();
+    writer->lzwBuffer.reset();
+    writer->colorCache.reset();
 
-    return true;
+    return success;
 }
 
 #endif
@@ -1,4 +1,5 @@
 #include "identifiers.h"
+#include "last-message-store.h"
 #include <glib.h>
 #include <purple.h>
 #include "config.h"
@@ -127,6 +128,11 @@ ChatId getChatId(const td::td_api::updateChatLastMessage &update)
     return ChatId(update.chat_id_);
 }
 
+ChatId getChatId(const LastMessageRecord &record)
+{
+    return ChatId(record.chatId);
+}
+
 BasicGroupId getBasicGroupId(const td::td_api::updateBasicGroupFullInfo &update)
 {
     return BasicGroupId(update.basic_group_id_);
@@ -160,3 +166,8 @@ MessageId getReplyMessageId(const td::td_api::message &message)
         return MessageId(0);
     }
 }
+
+MessageId getMessageId(const LastMessageRecord &record)
+{
+    return MessageId(record.messageId);
+}
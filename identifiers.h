@@ -4,9 +4,12 @@
 #include <stdint.h>
 #include <string>
 #include <limits>
+#include <functional>
 #include <stdlib.h>
 #include <td/telegram/td_api.h>
 
+struct LastMessageRecord;
+
 template<typename IntType>
 class Identifier {
 protected:
@@ -77,6 +80,7 @@ DEFINE_ID_CLASS(ChatId, int64_t)
     friend ChatId getChatId(const td::td_api::message &message);
     friend ChatId getChatId(const td::td_api::updateChatAction &update);
     friend ChatId getChatId(const td::td_api::updateChatLastMessage &update);
+    friend ChatId getChatId(const LastMessageRecord &record);
 };
 
 DEFINE_ID_CLASS(BasicGroupId, int64_t)
@@ -99,10 +103,20 @@ DEFINE_ID_CLASS(SecretChatId, int32_t)
 DEFINE_ID_CLASS(MessageId, int64_t)
     friend MessageId getId(const td::td_api::message &message);
     friend MessageId getReplyMessageId(const td::td_api::message &message);
+    friend MessageId getMessageId(const LastMessageRecord &record);
 };
 
 #undef DEFINE_ID_CLASS
 
+// Allows using identifiers as keys in unordered containers
+struct IdentifierHash {
+    template<typename IdClass>
+    size_t operator()(const IdClass &id) const
+    {
+        return std::hash<decltype(id.value())>()(id.value());
+    }
+};
+
 UserId       getId(const td::td_api::user &user);
 ChatId       getId(const td::td_api::chat &chat);
 BasicGroupId getId(const td::td_api::basicGroup &group);
@@ -128,6 +142,7 @@ ChatId       getChatId(const td::td_api::messageOriginChannel &forwardOrigin);
 ChatId       getChatId(const td::td_api::message &message);
 ChatId       getChatId(const td::td_api::updateChatAction &update);
 ChatId       getChatId(const td::td_api::updateChatLastMessage &update);
+ChatId       getChatId(const LastMessageRecord &record);
 
 BasicGroupId getBasicGroupId(const td::td_api::updateBasicGroupFullInfo &update);
 BasicGroupId getBasicGroupId(const td::td_api::chatTypeBasicGroup &chatType);
@@ -138,6 +153,7 @@ SupergroupId getSupergroupId(const td::td_api::chatTypeSupergroup &chatType);
 SecretChatId getSecretChatId(const td::td_api::chatTypeSecret &update);
 
 MessageId    getReplyMessageId(const td::td_api::message &message);
+MessageId    getMessageId(const LastMessageRecord &record);
 
 namespace std {
     static inline std::string to_string(UserId id) { return to_string(id.value()); }
@@ -0,0 +1,55 @@
+#include "interned-string.h"
+
+InternedString::Pool &InternedString::pool()
+{
+    static Pool strings;
+    return strings;
+}
+
+const std::string &InternedString::emptyString()
+{
+    static const std::string empty;
+    return empty;
+}
+
+size_t InternedString::poolSize()
+{
+    return pool().size();
+}
+
+InternedString::InternedString(const std::string &value)
+{
+    // Empty strings are common enough (no last name etc.) to not take a pool entry
+    if (!value.empty()) {
+        m_entry = &*pool().emplace(value, 0).first;
+        m_entry->second++;
+    }
+}
+
+InternedString::InternedString(const InternedString &other)
+: m_entry(other.m_entry)
+{
+    if (m_entry)
+        m_entry->second++;
+}
+
+InternedString &InternedString::operator=(const InternedString &other)
+{
+    if (other.m_entry)
+        other.m_entry->second++;
+    release();
+    m_entry = other.m_entry;
+    return *this;
+}
+
+InternedString::~InternedString()
+{
+    release();
+}
+
+void InternedString::release()
+{
+    if (m_entry && (--m_entry->second == 0))
+        pool().erase(pool().find(m_entry->first));
+    m_entry = nullptr;
+}
@@ -0,0 +1,39 @@
+#ifndef _INTERNED_STRING_H
+#define _INTERNED_STRING_H
+
+#include <string>
+#include <unordered_map>
+
+// Immutable string of which equal values share a single copy, across all accounts. Names and
+// titles repeat a lot when many accounts see the same users and chats.
+// Only to be used from the main thread.
+class InternedString {
+public:
+    InternedString() = default;
+    explicit InternedString(const std::string &value);
+    InternedString(const InternedString &other);
+    InternedString &operator=(const InternedString &other);
+    ~InternedString();
+
+    const std::string &str() const { return m_entry ? m_entry->first : emptyString(); }
+    const char        *c_str() const { return str().c_str(); }
+    bool               empty() const { return (m_entry == nullptr); }
+
+    bool operator==(const InternedString &other) const { return (m_entry == other.m_entry); }
+    bool operator!=(const InternedString &other) const { return (m_entry != other.m_entry); }
+
+    // Number of distinct strings currently interned
+    static size_t poolSize();
+private:
+    // Value and number of InternedStrings referring to it. Map nodes don't move, so entries can
+    // be referred to by pointer.
+    using Pool  = std::unordered_map<std::string, unsigned>;
+    using Entry = Pool::value_type;
+    Entry *m_entry = nullptr;
+
+    static Pool              &pool();
+    static const std::string &emptyString();
+    void                      release();
+};
+
+#endif
@@ -0,0 +1,170 @@
+#include "last-message-store.h"
+#include "config.h"
+#include <purple.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+static const char     STORE_MAGIC[4] = {'T', 'D', 'L', 'M'};
+static const uint32_t STORE_VERSION  = 1;
+
+enum {
+    // Compact the file when obsolete records outnumber live ones by this factor
+    COMPACTION_FACTOR = 4,
+    // ...but don't bother for small files
+    COMPACTION_MIN_RECORDS = 1024
+};
+
+LastMessageStore::~LastMessageStore()
+{
+    if (isOpen() && hasChanges())
+        flush();
+}
+
+void LastMessageStore::open(const std::string &fileName)
+{
+    m_fileName = fileName;
+    m_lastMessages.clear();
+    m_changedChats.clear();
+    m_recordsInFile = 0;
+
+    gchar  *contents = NULL;
+    gsize   length   = 0;
+    GError *error    = NULL;
+    if (!g_file_get_contents(fileName.c_str(), &contents, &length, &error)) {
+        purple_debug_misc(config::pluginId, "No last message store loaded: %s\n", error->message);
+        g_error_free(error);
+        return;
+    }
+
+    const LastMessageStoreHeader *header = reinterpret_cast<const LastMessageStoreHeader *>(contents);
+    if ((length >= sizeof(LastMessageStoreHeader)) &&
+        !memcmp(header->magic, STORE_MAGIC, sizeof(STORE_MAGIC)) && (header->version == STORE_VERSION))
+    {
+        // A partial record at the end is left over from an interrupted append
+        size_t count = (length - sizeof(LastMessageStoreHeader)) / sizeof(LastMessageRecord);
+        for (size_t i = 0; i < count; i++) {
+            LastMessageRecord record;
+            memcpy(&record, contents + sizeof(LastMessageStoreHeader) + i * sizeof(LastMessageRecord),
+                   sizeof(record));
+            m_lastMessages[getChatId(record)] = getMessageId(record);
+        }
+        m_recordsInFile = count;
+        if (length != sizeof(LastMessageStoreHeader) + count * sizeof(LastMessageRecord))
+            m_recordsInFile = SIZE_MAX; // Force rewrite on next flush
+    } else {
+        purple_debug_warning(config::pluginId, "Ignoring invalid last message store %s\n", fileName.c_str());
+        m_recordsInFile = SIZE_MAX;
+    }
+
+    g_free(contents);
+    purple_debug_misc(config::pluginId, "Last message store: %zu chats\n", m_lastMessages.size());
+}
+
+MessageId LastMessageStore::get(ChatId chatId) const
+{
+    auto it = m_lastMessages.find(chatId);
+    return (it != m_lastMessages.end()) ? it->second : MessageId::invalid;
+}
+
+void LastMessageStore::set(ChatId chatId, MessageId messageId)
+{
+    MessageId &lastMessage = m_lastMessages[chatId];
+    if (lastMessage != messageId) {
+        lastMessage = messageId;
+        m_changedChats.insert(chatId);
+    }
+}
+
+bool LastMessageStore::flush()
+{
+    if (!isOpen())
+        return false;
+
+    bool ok;
+    if ((m_recordsInFile == SIZE_MAX) ||
+        ((m_recordsInFile + m_changedChats.size() > COMPACTION_MIN_RECORDS) &&
+         (m_recordsInFile + m_changedChats.size() > COMPACTION_FACTOR * m_lastMessages.size())))
+    {
+        ok = rewrite();
+    } else
+        ok = append();
+
+    if (ok)
+        m_changedChats.clear();
+    return ok;
+}
+
+bool LastMessageStore::append()
+{
+    if (m_changedChats.empty())
+        return true;
+
+    bool  newFile = (m_recordsInFile == 0);
+    FILE *f       = fopen(m_fileName.c_str(), newFile ? "wb" : "ab");
+    if (!f) {
+        purple_debug_warning(config::pluginId, "Failed to write last message store %s\n", m_fileName.c_str());
+        return false;
+    }
+
+    std::vector<LastMessageRecord> records;
+    records.reserve(m_changedChats.size());
+    for (ChatId chatId: m_changedChats)
+        records.push_back(LastMessageRecord{chatId.value(), m_lastMessages[chatId].value()});
+
+    bool ok = true;
+    if (newFile) {
+        LastMessageStoreHeader header;
+        memcpy(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+        header.version = STORE_VERSION;
+        ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+    }
+    ok = ok && (fwrite(records.data(), sizeof(LastMessageRecord), records.size(), f) == records.size());
+    ok = (fclose(f) == 0) && ok;
+
+    if (ok)
+        m_recordsInFile += records.size();
+    else {
+        purple_debug_warning(config::pluginId, "Failed to write last message store %s\n", m_fileName.c_str());
+        // The file may now end with a partial record
+        m_recordsInFile = SIZE_MAX;
+    }
+    return ok;
+}
+
+// Writes to a temporary file first, so an interrupted write leaves the old file intact
+bool LastMessageStore::rewrite()
+{
+    LastMessageStoreHeader header;
+    memcpy(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+    header.version = STORE_VERSION;
+
+    std::vector<LastMessageRecord> records;
+    records.reserve(m_lastMessages.size());
+    for (const auto &entry: m_lastMessages)
+        records.push_back(LastMessageRecord{entry.first.value(), entry.second.value()});
+
+    std::string tempName = m_fileName + ".tmp";
+    FILE       *f        = fopen(tempName.c_str(), "wb");
+    if (!f) {
+        purple_debug_warning(config::pluginId, "Failed to write last message store %s\n", tempName.c_str());
+        return false;
+    }
+
+    bool ok = (fwrite(&header, sizeof(header), 1, f) == 1) &&
+              (fwrite(records.data(), sizeof(LastMessageRecord), records.size(), f) == records.size());
+    ok = (fclose(f) == 0) && ok;
+
+    if (ok)
+        ok = (g_rename(tempName.c_str(), m_fileName.c_str()) == 0);
+    if (ok)
+        m_recordsInFile = records.size();
+    else {
+        purple_debug_warning(config::pluginId, "Failed to write last message store %s\n", m_fileName.c_str());
+        g_unlink(tempName.c_str());
+    }
+
+    return ok;
+}
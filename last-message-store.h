@@ -0,0 +1,49 @@
+#ifndef _LAST_MESSAGE_STORE_H
+#define _LAST_MESSAGE_STORE_H
+
+#include "identifiers.h"
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// Store file layout, in host byte order: LastMessageStoreHeader, then LastMessageRecords.
+// Records are only ever appended; a later record for the same chat overrides earlier ones.
+struct LastMessageStoreHeader {
+    char     magic[4];
+    uint32_t version;
+};
+
+struct LastMessageRecord {
+    int64_t chatId;
+    int64_t messageId;
+};
+
+// Last seen message of every chat, kept out of account settings because it changes with every
+// incoming message. Changes are collected in memory and written out by flush().
+class LastMessageStore {
+public:
+    LastMessageStore() = default;
+    ~LastMessageStore();
+    LastMessageStore(const LastMessageStore &) = delete;
+    LastMessageStore &operator=(const LastMessageStore &) = delete;
+
+    // Reads existing records, if any. A missing or unreadable file results in an empty store.
+    void      open(const std::string &fileName);
+    bool      isOpen() const { return !m_fileName.empty(); }
+
+    MessageId get(ChatId chatId) const;
+    void      set(ChatId chatId, MessageId messageId);
+    bool      hasChanges() const { return !m_changedChats.empty(); }
+    // Appends changed records, or rewrites the whole file if it has grown too much
+    bool      flush();
+private:
+    std::string                                           m_fileName;
+    std::unordered_map<ChatId, MessageId, IdentifierHash> m_lastMessages;
+    std::unordered_set<ChatId, IdentifierHash>            m_changedChats;
+    size_t                                                m_recordsInFile = 0;
+
+    bool      append();
+    bool      rewrite();
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include "purple-info.h"
 #include "config.h"
 #include "format.h"
+#include "account-data.h"
 #include <algorithm>
 #include <cmath>
 
@@ -53,15 +54,15 @@ GList *getChatJoinInfo()
     return info;
 }
 
-std::string getPurpleChatName(const td::td_api::chat &chat)
+std::string getPurpleChatName(const TgChat &chat)
 {
-    return "chat" + std::to_string(chat.id_);
+    return "chat" + std::to_string(chat.id.value());
 }
 
-GHashTable *getChatComponents(const td::td_api::chat &chat)
+GHashTable *getChatComponents(const TgChat &chat)
 {
     char name[32];
-    snprintf(name, sizeof(name)-1, "chat%" G_GINT64_FORMAT "", chat.id_);
+    snprintf(name, sizeof(name)-1, "chat%" G_GINT64_FORMAT "", chat.id.value());
     name[sizeof(name)-1] = '\0';
 
     GHashTable *table = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
@@ -124,6 +125,55 @@ unsigned getAutoDownloadLimitKb(PurpleAccount *account)
     return floorf(dlLimit*1024);
 }
 
+static unsigned getUnsignedOption(PurpleAccount *account, const char *name, const char *defaultValue)
+{
+    const char *valueStr = purple_account_get_string(account, name, defaultValue);
+    char *endptr;
+    unsigned long value = strtoul(valueStr, &endptr, 10);
+    if ((*endptr != '\0') || (value > UINT_MAX)) {
+        purple_account_set_string(account, name, defaultValue);
+        value = strtoul(defaultValue, NULL, 10);
+    }
+
+    return value;
+}
+
+unsigned getUpdateSliceTimeMs(PurpleAccount *account)
+{
+    return getUnsignedOption(account, AccountOptions::UpdateSliceTime,
+                             AccountOptions::UpdateSliceTimeDefault);
+}
+
+unsigned getReadReceiptsDelay(PurpleAccount *account)
+{
+    return getUnsignedOption(account, AccountOptions::ReadReceiptsDelay,
+                             AccountOptions::ReadReceiptsDelayDefault);
+}
+
+unsigned getPendingQueueLimit(PurpleAccount *account)
+{
+    return getUnsignedOption(account, AccountOptions::PendingQueueLimit,
+                             AccountOptions::PendingQueueLimitDefault);
+}
+
+unsigned getGapRecoveryConcurrency(PurpleAccount *account)
+{
+    return getUnsignedOption(account, AccountOptions::GapRecoveryConcurrency,
+                             AccountOptions::GapRecoveryConcurrencyDefault);
+}
+
+unsigned getWorkerThreadLimit(PurpleAccount *account)
+{
+    return getUnsignedOption(account, AccountOptions::WorkerThreads,
+                             AccountOptions::WorkerThreadsDefault);
+}
+
+unsigned getStickerCacheSizeMb(PurpleAccount *account)
+{
+    return getUnsignedOption(account, AccountOptions::StickerCacheSize,
+                             AccountOptions::StickerCacheSizeDefault);
+}
+
 bool isSizeWithinLimit(unsigned size, unsigned limit)
 {
     return (limit == 0) || (size <= limit);
@@ -136,6 +186,13 @@ bool ignoreBigDownloads(PurpleAccount *account)
                    AccountOptions::BigDownloadHandlingDiscard);
 }
 
+bool useWebpForAnimatedStickers(PurpleAccount *account)
+{
+    return !strcmp(purple_account_get_string(account, AccountOptions::AnimatedStickerFormat,
+                                             AccountOptions::AnimatedStickerFormatDefault),
+                   AccountOptions::AnimatedStickerFormatWebp);
+}
+
 PurpleTdClient *getTdClient(PurpleAccount *account)
 {
     PurpleConnection *connection = purple_account_get_connection(account);
@@ -16,11 +16,12 @@ static constexpr int
     GROUP_TYPE_CHANNEL = 3;
 
 class PurpleTdClient;
+struct TgChat;
 
 const char  *getChatNameComponent();
 GList       *getChatJoinInfo();
-std::string  getPurpleChatName(const td::td_api::chat &chat);
-GHashTable  *getChatComponents(const td::td_api::chat &chat);
+std::string  getPurpleChatName(const TgChat &chat);
+GHashTable  *getChatComponents(const TgChat &chat);
 
 const char  *getChatName(GHashTable *components);
 const char  *getChatJoinString(GHashTable *components);
@@ -40,6 +41,10 @@ namespace AccountOptions {
     constexpr gboolean    EnableSecretChatsDefault   = TRUE;
     constexpr const char *AnimatedStickers           = "animated-stickers";
     constexpr gboolean    AnimatedStickersDefault    = TRUE;
+    constexpr const char *AnimatedStickerFormat      = "animated-sticker-format";
+    constexpr const char *AnimatedStickerFormatGif   = "gif";
+    constexpr const char *AnimatedStickerFormatWebp  = "webp";
+    constexpr const char *AnimatedStickerFormatDefault = AnimatedStickerFormatGif;
     constexpr const char *ShowSelfDestruct           = "show-self-destruct";
     constexpr gboolean    ShowSelfDestructDefault    = FALSE;
     constexpr const char *DownloadBehaviour          = "download-behaviour";
@@ -50,6 +55,22 @@ namespace AccountOptions {
     constexpr gboolean    KeepInlineDownloadsDefault = FALSE;
     constexpr const char *ReadReceipts               = "read-receipts";
     constexpr gboolean    ReadReceiptsDefault        = TRUE;
+    constexpr const char *ReadReceiptsDelay          = "read-receipts-delay";
+    constexpr const char *ReadReceiptsDelayDefault   = "1";
+    constexpr const char *PendingQueueLimit          = "pending-queue-limit";
+    constexpr const char *PendingQueueLimitDefault   = "0";
+    constexpr const char *GapRecoveryConcurrency     = "gap-recovery-concurrency";
+    constexpr const char *GapRecoveryConcurrencyDefault = "2";
+    constexpr const char *WorkerThreads              = "worker-threads";
+    constexpr const char *WorkerThreadsDefault       = "0";
+    constexpr const char *StickerCacheSize           = "sticker-cache-size";
+    constexpr const char *StickerCacheSizeDefault    = "50";
+    constexpr const char *UpdateSliceTime            = "update-slice-time";
+    constexpr const char *UpdateSliceTimeDefault     = "20";
+    constexpr const char *SharedReceiveThread        = "shared-receive-thread";
+    constexpr gboolean    SharedReceiveThreadDefault = FALSE;
+    constexpr const char *LastMessageStore           = "last-message-store";
+    constexpr gboolean    LastMessageStoreDefault    = TRUE;
     constexpr const char *ApiId                      = "api-id";
     constexpr const char *ApiHash                    = "api-hash";
 };
@@ -59,8 +80,15 @@ namespace BuddyOptions {
 };
 
 unsigned getAutoDownloadLimitKb(PurpleAccount *account);
+unsigned getUpdateSliceTimeMs(PurpleAccount *account);
+unsigned getReadReceiptsDelay(PurpleAccount *account);
+unsigned getPendingQueueLimit(PurpleAccount *account);
+unsigned getGapRecoveryConcurrency(PurpleAccount *account);
+unsigned getWorkerThreadLimit(PurpleAccount *account);
+unsigned getStickerCacheSizeMb(PurpleAccount *account);
 bool     isSizeWithinLimit(unsigned size, unsigned limit);
 bool     ignoreBigDownloads(PurpleAccount *account);
+bool     useWebpForAnimatedStickers(PurpleAccount *account);
 PurpleTdClient *getTdClient(PurpleAccount *account);
 const char *getUiName();
 bool        canDisableReadReceipts();
@@ -7,12 +7,18 @@
 #include "config.h"
 #include "call.h"
 #include <algorithm>
+#include <unordered_set>
+#include <memory>
 
 enum {
-    HISTORY_MESSAGES_ABSOLUTE_LIMIT = 80
+    HISTORY_MESSAGES_ABSOLUTE_LIMIT = 80,
+    HISTORY_PAGE_SIZE_INITIAL       = 30,
+    HISTORY_PAGE_SIZE_MAX           = 100,
+    // Give tdlib a chance to deliver new messages, which tell where to start fetching history
+    GAP_RECOVERY_DELAY_SECONDS      = 3
 };
 
-std::string makeNoticeWithSender(const td::td_api::chat &chat, const TgMessageInfo &message,
+std::string makeNoticeWithSender(const TgChat &chat, const TgMessageInfo &message,
                                  const char *noticeText, PurpleAccount *account)
 {
     std::string prefix = getSenderDisplayName(chat, message, account);
@@ -43,6 +49,38 @@ static PurpleMessageFlags getNotificationFlags(PurpleMessageFlags extraFlags)
     return (PurpleMessageFlags)flags;
 }
 
+static void sendPendingReadReceipts(TdAccountData &account, ChatId chatId)
+{
+    std::vector<ReadReceipt> receipts;
+    account.extractPendingReadReceipts(chatId, receipts);
+
+    if (!receipts.empty()) {
+        purple_debug_misc(config::pluginId, "Sending %zu read receipts for chat %" G_GINT64_FORMAT "\n",
+                          receipts.size(), chatId.value());
+        td::td_api::object_ptr<td::td_api::viewMessages> viewMessagesReq = td::td_api::make_object<td::td_api::viewMessages>();
+        viewMessagesReq->chat_id_ = chatId.value();
+        viewMessagesReq->force_read_ = true; // no idea what "closed chats" are at this point
+        viewMessagesReq->message_ids_.resize(receipts.size());
+        for (size_t i = 0; i < receipts.size(); i++)
+            viewMessagesReq->message_ids_[i] = receipts[i].messageId.value();
+        account.transceiver.sendQuery(std::move(viewMessagesReq), nullptr,
+                                      TdTransceiver::Priority::Background);
+    }
+}
+
+static gboolean readReceiptTimerCallback(gpointer data)
+{
+    TdAccountData &account = *static_cast<TdAccountData *>(data);
+    account.readReceiptTimer = 0;
+
+    std::vector<ChatId> chatIds;
+    account.extractReadReceiptFlushQueue(chatIds);
+    for (ChatId chatId: chatIds)
+        sendPendingReadReceipts(account, chatId);
+
+    return G_SOURCE_REMOVE;
+}
+
 void sendConversationReadReceipts(TdAccountData &account, PurpleConversation *conv)
 {
     if (!conversationHasFocus(conv))
@@ -54,7 +92,7 @@ void sendConversationReadReceipts(TdAccountData &account, PurpleConversation *co
     if (convType == PURPLE_CONV_TYPE_IM) {
         UserId       privateChatUserId = purpleBuddyNameToUserId(convName);
         SecretChatId secretChatId      = purpleBuddyNameToSecretChatId(convName);
-        const td::td_api::chat *tdlibChat = nullptr;
+        const TgChat *tdlibChat = nullptr;
 
         if (privateChatUserId.valid())
             tdlibChat = account.getPrivateChatByUserId(privateChatUserId);
@@ -66,20 +104,13 @@ void sendConversationReadReceipts(TdAccountData &account, PurpleConversation *co
     } else if (convType == PURPLE_CONV_TYPE_CHAT)
         chatId = getTdlibChatId(convName);
 
-    std::vector<ReadReceipt> receipts;
-    account.extractPendingReadReceipts(chatId, receipts);
-
-    if (!receipts.empty()) {
-        purple_debug_misc(config::pluginId, "Sending %zu read receipts for chat %" G_GINT64_FORMAT "\n",
-                          receipts.size(), chatId.value());
-        td::td_api::object_ptr<td::td_api::viewMessages> viewMessagesReq = td::td_api::make_object<td::td_api::viewMessages>();
-        viewMessagesReq->chat_id_ = chatId.value();
-        viewMessagesReq->force_read_ = true; // no idea what "closed chats" are at this point
-        viewMessagesReq->message_ids_.resize(receipts.size());
-        for (size_t i = 0; i < receipts.size(); i++)
-            viewMessagesReq->message_ids_[i] = receipts[i].messageId.value();
-        account.transceiver.sendQuery(std::move(viewMessagesReq), nullptr);
-    }
+    // Messages shown in quick succession, e.g. in a busy group chat, are reported together in
+    // one viewMessages per chat
+    unsigned delay = getReadReceiptsDelay(account.purpleAccount);
+    if (delay == 0)
+        sendPendingReadReceipts(account, chatId);
+    else if (account.queueReadReceiptFlush(chatId) && !account.readReceiptTimer)
+        account.readReceiptTimer = account.transceiver.addTimeout(delay, readReceiptTimerCallback, &account);
 }
 
 void showMessageTextIm(TdAccountData &account, const char *purpleUserName, const char *text,
@@ -116,7 +147,7 @@ void showMessageTextIm(TdAccountData &account, const char *purpleUserName, const
         sendConversationReadReceipts(account, conv);
 }
 
-static void showMessageTextChat(TdAccountData &account, const td::td_api::chat &chat,
+static void showMessageTextChat(TdAccountData &account, const TgChat &chat,
                                 const TgMessageInfo &message, const char *text,
                                 const char *notification, PurpleMessageFlags flags)
 {
@@ -155,7 +186,7 @@ static void showMessageTextChat(TdAccountData &account, const td::td_api::chat &
 
 static std::string quoteMessage(const td::td_api::message *message, TdAccountData &account)
 {
-    const td::td_api::user *originalAuthor = nullptr;
+    const TgUser *originalAuthor = nullptr;
     if (message)
         originalAuthor = account.getUser(getSenderUserId(*message));
 
@@ -238,7 +269,7 @@ static std::string quoteMessage(const td::td_api::message *message, TdAccountDat
     return formatMessage(_("<b>&gt; {0} wrote:</b>\n&gt; {1}"), {originalName, text});
 }
 
-void showMessageText(TdAccountData &account, const td::td_api::chat &chat, const TgMessageInfo &message,
+void showMessageText(TdAccountData &account, const TgChat &chat, const TgMessageInfo &message,
                      const char *text, const char *notification, uint32_t extraFlags)
 {
     PurpleMessageFlags directionFlag = message.outgoing ? PURPLE_MESSAGE_SEND : PURPLE_MESSAGE_RECV;
@@ -248,7 +279,9 @@ void showMessageText(TdAccountData &account, const td::td_api::chat &chat, const
 
     std::string newText;
     if (text) {
-        if (message.repliedMessageId.valid())
+        if (!message.repliedMessageQuote.empty())
+            newText = message.repliedMessageQuote;
+        else if (message.repliedMessageId.valid())
             newText = quoteMessage(message.repliedMessage.get(), account);
         if (!message.forwardedFrom.empty()) {
             if (!newText.empty())
@@ -263,7 +296,7 @@ void showMessageText(TdAccountData &account, const td::td_api::chat &chat, const
     if (!newText.empty())
         text = newText.c_str();
 
-    const td::td_api::user *privateUser = account.getUserByPrivateChat(chat);
+    const TgUser *privateUser = account.getUserByPrivateChat(chat);
     if (privateUser) {
         std::string userName = getPurpleBuddyName(*privateUser);
 
@@ -284,7 +317,7 @@ void showMessageText(TdAccountData &account, const td::td_api::chat &chat, const
         showMessageTextChat(account, chat, message, text, notification, flags);
 }
 
-void showChatNotification(TdAccountData &account, const td::td_api::chat &chat,
+void showChatNotification(TdAccountData &account, const TgChat &chat,
                           const char *notification, time_t timestamp, PurpleMessageFlags extraFlags)
 {
     TgMessageInfo messageInfo;
@@ -294,14 +327,14 @@ void showChatNotification(TdAccountData &account, const td::td_api::chat &chat,
     showMessageText(account, chat, messageInfo, NULL, notification, extraFlags);
 }
 
-void showChatNotification(TdAccountData &account, const td::td_api::chat &chat,
+void showChatNotification(TdAccountData &account, const TgChat &chat,
                           const char *notification, PurpleMessageFlags extraFlags)
 {
     showChatNotification(account, chat, notification,
                          (extraFlags & PURPLE_MESSAGE_NO_LOG) ? 0 : time(NULL), extraFlags);
 }
 
-static void showDownloadedImage(const td::td_api::chat &chat, TgMessageInfo &message,
+static void showDownloadedImage(const TgChat &chat, TgMessageInfo &message,
                                 const std::string &filePath, const char *caption,
                                 TdAccountData &account)
 {
@@ -347,7 +380,7 @@ bool shouldConvertAnimatedSticker(const TgMessageInfo &message, const PurpleAcco
 #endif
 }
 
-static void showDownloadedSticker(const td::td_api::chat &chat, TgMessageInfo &message,
+static void showDownloadedSticker(const TgChat &chat, TgMessageInfo &message,
                                   const std::string &filePath,
                                   const std::string &fileDescription,
                                   td::td_api::object_ptr<td::td_api::file> thumbnail,
@@ -362,7 +395,7 @@ static void showDownloadedSticker(const td::td_api::chat &chat, TgMessageInfo &m
             StickerConversionThread *thread;
             thread = new StickerConversionThread(account.purpleAccount, filePath, getId(chat),
                                                  std::move(message));
-            thread->startThread();
+            thread->submit();
         } else if (thumbnail) {
             // Avoid message like "Downloading sticker thumbnail...
             // Also ignore size limits, but only determined testers and crazy people would notice.
@@ -380,7 +413,7 @@ static void showDownloadedSticker(const td::td_api::chat &chat, TgMessageInfo &m
     }
 }
 
-void showGenericFileInline(const td::td_api::chat &chat, const TgMessageInfo &message,
+void showGenericFileInline(const TgChat &chat, const TgMessageInfo &message,
                            const std::string &filePath, const char *caption,
                            const std::string &fileDescription, TdAccountData &account)
 {
@@ -404,7 +437,7 @@ void showDownloadedFileInline(ChatId chatId, TgMessageInfo &message,
                               td::td_api::object_ptr<td::td_api::file> thumbnail,
                               TdTransceiver &transceiver, TdAccountData &account)
 {
-    const td::td_api::chat *chat = account.getChat(chatId);
+    const TgChat *chat = account.getChat(chatId);
     if (!chat) return;
 
     switch (message.type) {
@@ -421,7 +454,7 @@ void showDownloadedFileInline(ChatId chatId, TgMessageInfo &message,
     }
 }
 
-static void showTextMessage(const td::td_api::chat &chat, const TgMessageInfo &message,
+static void showTextMessage(const TgChat &chat, const TgMessageInfo &message,
                             const td::td_api::messageText &text, TdAccountData &account)
 {
     if (text.text_) {
@@ -452,7 +485,7 @@ static void ignoreInlineDownload(InlineDownloadInfo *info)
 }
 
 static void requestInlineDownload(const char *sender, const td::td_api::file &file,
-                                  const std::string &fileDesc, const td::td_api::chat &chat,
+                                  const std::string &fileDesc, const TgChat &chat,
                                   TgMessageInfo &message, TdTransceiver &transceiver, TdAccountData &account)
 {
     // TRANSLATOR: Download dialog, primary content, argument will be a username.
@@ -462,7 +495,7 @@ static void requestInlineDownload(const char *sender, const td::td_api::file &fi
     // This dialog is used for files larger than the limit, so size should be non-zero
     char *      sizeStr  = purple_str_size_to_units(size);
     // TRANSLATOR: Download dialog, placeholder chat title, in the sentence "posted in a private chat".
-    std::string chatName = isPrivateChat(chat) ? _("a private chat") : chat.title_;
+    std::string chatName = isPrivateChat(chat) ? _("a private chat") : chat.title.str();
     // TRANSLATOR: Download dialog, secondary content. Arguments will be file description (text), chat name (text), and a file size (text!)
     std::string fileInfo = formatMessage(_("{0} posted in {1}, size: {2}"), {fileDesc,
                                          chatName, std::string(sizeStr)});
@@ -485,7 +518,7 @@ static void requestInlineDownload(const char *sender, const td::td_api::file &fi
                           _("_No"), ignoreInlineDownload);
 }
 
-static void showFileInline(const td::td_api::chat &chat, IncomingMessage &fullMessage,
+static void showFileInline(const TgChat &chat, IncomingMessage &fullMessage,
                            const td::td_api::file &file, const char *caption,
                            const std::string &fileDesc,
                            TdTransceiver &transceiver, TdAccountData &account)
@@ -562,7 +595,7 @@ static void showFileInline(const td::td_api::chat &chat, IncomingMessage &fullMe
 
 }
 
-static void showPhotoMessage(const td::td_api::chat &chat, IncomingMessage &fullMessage,
+static void showPhotoMessage(const TgChat &chat, IncomingMessage &fullMessage,
                              const td::td_api::file *photoSize, const std::string &caption,
                              TdTransceiver &transceiver, TdAccountData &account)
 {
@@ -580,7 +613,7 @@ static void showPhotoMessage(const td::td_api::chat &chat, IncomingMessage &full
     }
 }
 
-static void showFileMessage(const td::td_api::chat &chat, IncomingMessage &fullMessage,
+static void showFileMessage(const TgChat &chat, IncomingMessage &fullMessage,
                             const td::td_api::file* file,
                             const std::string &caption,
                             const std::string &fileDescription,
@@ -595,9 +628,9 @@ static void showFileMessage(const td::td_api::chat &chat, IncomingMessage &fullM
                                       account.purpleAccount);
         showMessageText(account, chat, fullMessage.messageInfo, captionStr, notice.c_str());
     } else {
-        if ( !fullMessage.standardDownloadConfigured || !chat.type_ ||
-             ((chat.type_->get_id() != td::td_api::chatTypePrivate::ID) &&
-              (chat.type_->get_id() != td::td_api::chatTypeSecret::ID)) )
+        if ( !fullMessage.standardDownloadConfigured || !chat.type ||
+             ((chat.type->get_id() != td::td_api::chatTypePrivate::ID) &&
+              (chat.type->get_id() != td::td_api::chatTypeSecret::ID)) )
         {
             showFileInline(chat, fullMessage, *file, captionStr, fileDescription,
                            transceiver, account);
@@ -607,7 +640,7 @@ static void showFileMessage(const td::td_api::chat &chat, IncomingMessage &fullM
     }
 }
 
-static void showStickerMessage(const td::td_api::chat &chat, IncomingMessage &fullMessage,
+static void showStickerMessage(const TgChat &chat, IncomingMessage &fullMessage,
                                td::td_api::messageSticker &stickerContent,
                                TdTransceiver &transceiver, TdAccountData &account)
 {
@@ -620,7 +653,7 @@ static void showStickerMessage(const td::td_api::chat &chat, IncomingMessage &fu
                        transceiver, account);
 }
 
-void showMessage(const td::td_api::chat &chat, IncomingMessage &fullMessage,
+void showMessage(const TgChat &chat, IncomingMessage &fullMessage,
                 TdTransceiver &transceiver, TdAccountData &account)
 {
     if (!fullMessage.message) return;
@@ -722,7 +755,7 @@ void showMessages(std::vector<IncomingMessage>& messages, TdAccountData &account
 {
     for (IncomingMessage &readyMessage: messages) {
         if (!readyMessage.message) continue;
-        const td::td_api::chat *chat = account.getChat(getChatId(*readyMessage.message));
+        const TgChat *chat = account.getChat(getChatId(*readyMessage.message));
         if (chat)
             showMessage(*chat, readyMessage, account.transceiver, account);
     }
@@ -757,7 +790,7 @@ const td::td_api::file *selectPhotoSize(PurpleAccount *account, const td::td_api
     return selectedSize ? selectedSize->photo_.get() : nullptr;
 }
 
-void makeFullMessage(const td::td_api::chat &chat, td::td_api::object_ptr<td::td_api::message> message,
+void makeFullMessage(const TgChat &chat, td::td_api::object_ptr<td::td_api::message> message,
                      IncomingMessage &fullMessage, const TdAccountData &account)
 {
     if (!message) {
@@ -823,13 +856,13 @@ static const td::td_api::file *getSelectedPhotoSize(const IncomingMessage &fullM
 
 static bool isInlineDownload(const IncomingMessage &fullMessage,
                              const td::td_api::MessageContent &content,
-                             const td::td_api::chat &chat)
+                             const TgChat &chat)
 {
     return (content.get_id() == td::td_api::messagePhoto::ID) ||
            (content.get_id() == td::td_api::messageSticker::ID) ||
-           !fullMessage.standardDownloadConfigured || !chat.type_ ||
-           ((chat.type_->get_id() != td::td_api::chatTypePrivate::ID) &&
-            (chat.type_->get_id() != td::td_api::chatTypeSecret::ID));
+           !fullMessage.standardDownloadConfigured || !chat.type ||
+           ((chat.type->get_id() != td::td_api::chatTypePrivate::ID) &&
+            (chat.type->get_id() != td::td_api::chatTypeSecret::ID));
 }
 
 static bool inlineDownloadNeedAutoDl(const IncomingMessage &fullMessage,
@@ -845,7 +878,7 @@ static bool isFileMessageReady(const IncomingMessage &fullMessage, ChatId chatId
                                const td::td_api::MessageContent &content,
                                const td::td_api::file &file, const TdAccountData &account)
 {
-    const td::td_api::chat *chat = account.getChat(chatId);
+    const TgChat *chat = account.getChat(chatId);
 
     if (chat && isInlineDownload(fullMessage, content, *chat)) {
         // File will be shown inline
@@ -979,22 +1012,23 @@ bool isMessageReady(const IncomingMessage &fullMessage, const TdAccountData &acc
 }
 
 void fetchExtras(IncomingMessage &fullMessage, TdTransceiver &transceiver, TdAccountData &account,
-                 TdTransceiver::ResponseCb2 onFetchReply)
+                 ReplyBatch *replyBatch)
 {
     if (!fullMessage.message) return;
     const td::td_api::message &message = *fullMessage.message;
     MessageId messageId      = getId(message);
     MessageId replyMessageId = getReplyMessageId(message);
     ChatId    chatId         = getChatId(message);
-    const td::td_api::chat *chat = account.getChat(chatId);
-
-    if (replyMessageId.valid()) {
-        purple_debug_misc(config::pluginId, "Fetching message %" G_GINT64_FORMAT " which message %" G_GINT64_FORMAT " replies to\n",
+    const TgChat *chat = account.getChat(chatId);
+
+    if (replyMessageId.valid() && replyBatch)
+        replyBatch->replies.emplace_back(messageId, replyMessageId);
+    else if (replyMessageId.valid()) {
+        // A burst of updates may have many replies in the same chat, so they are fetched together
+        // once the update slice is processed
+        purple_debug_misc(config::pluginId, "Queueing fetch of message %" G_GINT64_FORMAT " which message %" G_GINT64_FORMAT " replies to\n",
                         replyMessageId.value(), messageId.value());
-        auto getMessageReq = td::td_api::make_object<td::td_api::getMessage>();
-        getMessageReq->chat_id_    = chatId.value();
-        getMessageReq->message_id_ = replyMessageId.value();
-        transceiver.sendQueryWithTimeout(std::move(getMessageReq), onFetchReply, 1);
+        account.queueReplyFetch(chatId, messageId, replyMessageId);
     }
 
     FileInfo fileInfo;
@@ -1008,7 +1042,8 @@ void fetchExtras(IncomingMessage &fullMessage, TdTransceiver &transceiver, TdAcc
                 StickerConversionThread *thread;
                 thread = new StickerConversionThread(account.purpleAccount, fileInfo.file->local_->path_,
                                                      chatId, &fullMessage.messageInfo);
-                thread->startThread();
+                // Later messages in the chat are waiting for this one
+                thread->submit(AccountThread::Priority::High);
             }
             // TODO: if animated stickers are disabled, fetch thumbnail instead
         } else if (inlineDownloadNeedAutoDl(fullMessage, *fileInfo.file)) {
@@ -1036,25 +1071,9 @@ void checkMessageReady(const IncomingMessage *message, TdTransceiver &transceive
     }
 }
 
-static void findMessageResponse(TdAccountData &account, ChatId chatId, MessageId pendingMessageId,
-                                td::td_api::object_ptr<td::td_api::Object> object)
-{
-    IncomingMessage *pendingMessage = account.pendingMessages.findPendingMessage(chatId, pendingMessageId);
-    if (!pendingMessage) return;
-
-    pendingMessage->repliedMessageFetchDoneOrFailed = true;
-    if (object && (object->get_id() == td::td_api::message::ID))
-        pendingMessage->repliedMessage = td::move_tl_object_as<td::td_api::message>(object);
-    else
-        purple_debug_misc(config::pluginId, "Failed to fetch reply source for message %" G_GINT64_FORMAT "\n",
-                          pendingMessageId.value());
-
-    checkMessageReady(pendingMessage, account.transceiver, account);
-}
-
-void handleIncomingMessage(TdAccountData &account, const td::td_api::chat &chat,
+void handleIncomingMessage(TdAccountData &account, const TgChat &chat,
     td::td_api::object_ptr<td::td_api::message> message,
-    PendingMessageQueue::MessageAction action)
+    PendingMessageQueue::MessageAction action, ReplyBatch *replyBatch)
 {
     if (!message) return;
     ChatId chatId = getId(chat);
@@ -1070,30 +1089,146 @@ void handleIncomingMessage(TdAccountData &account, const td::td_api::chat &chat,
         if (readyMessage.message)
             showMessage(chat, readyMessage, account.transceiver, account);
     } else {
-        MessageId messageId = getId(*fullMessage.message);
         IncomingMessage &addedMessage = account.pendingMessages.addPendingMessage(std::move(fullMessage), action);
-        fetchExtras(addedMessage, account.transceiver, account,
-            [&account, chatId, messageId](uint64_t, td::td_api::object_ptr<td::td_api::Object> object) {
-                findMessageResponse(account, chatId, messageId, std::move(object));
+        fetchExtras(addedMessage, account.transceiver, account, replyBatch);
+    }
+
+    std::vector<IncomingMessage> overflowMessages;
+    account.pendingMessages.extractOverflowMessages(chatId, overflowMessages);
+    showMessages(overflowMessages, account);
+}
+
+static void setRepliedMessage(TdAccountData &account, ChatId chatId, MessageId messageId,
+                              const td::td_api::message *repliedMessage)
+{
+    IncomingMessage *pendingMessage = account.pendingMessages.findPendingMessage(chatId, messageId);
+    if (!pendingMessage) return;
+
+    pendingMessage->repliedMessageFetchDoneOrFailed = true;
+    if (repliedMessage)
+        pendingMessage->messageInfo.repliedMessageQuote = quoteMessage(repliedMessage, account);
+    checkMessageReady(pendingMessage, account.transceiver, account);
+}
+
+static void replyBatchResponse(TdAccountData &account, ChatId chatId,
+                               const std::vector<std::pair<MessageId, MessageId>> &replies,
+                               td::td_api::object_ptr<td::td_api::Object> object)
+{
+    std::vector<const td::td_api::message *> repliedMessages;
+    if (object && (object->get_id() == td::td_api::messages::ID)) {
+        for (const auto &message: static_cast<const td::td_api::messages &>(*object).messages_)
+            if (message)
+                repliedMessages.push_back(message.get());
+    } else
+        purple_debug_misc(config::pluginId, "Failed to fetch reply sources for chat %" G_GINT64_FORMAT "\n",
+                          chatId.value());
+
+    for (const auto &reply: replies) {
+        MessageId repliedMessageId = reply.second;
+        auto it = std::find_if(repliedMessages.begin(), repliedMessages.end(),
+                               [repliedMessageId](const td::td_api::message *message) {
+                                   return (getId(*message) == repliedMessageId);
+                               });
+        setRepliedMessage(account, chatId, reply.first, (it != repliedMessages.end()) ? *it : nullptr);
+    }
+}
+
+// Replies to messages that are still queued (typically fetched with the same history) are quoted from
+// there, the rest are fetched with one getMessages
+static void resolveReplyBatch(TdAccountData &account, ChatId chatId, const ReplyBatch &batch)
+{
+    std::vector<std::pair<MessageId, MessageId>> remoteReplies;
+    std::vector<int64_t>                         remoteMessageIds;
+
+    for (const auto &reply: batch.replies) {
+        IncomingMessage *repliedMessage = account.pendingMessages.findPendingMessage(chatId, reply.second);
+        if (repliedMessage && repliedMessage->message) {
+            purple_debug_misc(config::pluginId, "Message %" G_GINT64_FORMAT " replies to queued message %"
+                              G_GINT64_FORMAT "\n", reply.first.value(), reply.second.value());
+            setRepliedMessage(account, chatId, reply.first, repliedMessage->message.get());
+        } else {
+            remoteReplies.push_back(reply);
+            if (std::find(remoteMessageIds.begin(), remoteMessageIds.end(), reply.second.value()) ==
+                remoteMessageIds.end())
+            {
+                remoteMessageIds.push_back(reply.second.value());
             }
-        );
+        }
+    }
+
+    if (!remoteMessageIds.empty()) {
+        purple_debug_misc(config::pluginId, "Fetching %zu reply sources for chat %" G_GINT64_FORMAT "\n",
+                          remoteMessageIds.size(), chatId.value());
+        auto getMessagesReq = td::td_api::make_object<td::td_api::getMessages>();
+        getMessagesReq->chat_id_     = chatId.value();
+        getMessagesReq->message_ids_ = std::move(remoteMessageIds);
+        account.transceiver.sendQueryWithTimeout(std::move(getMessagesReq),
+            [&account, chatId, remoteReplies](uint64_t, td::td_api::object_ptr<td::td_api::Object> object) {
+                replyBatchResponse(account, chatId, remoteReplies, std::move(object));
+            }, 1);
     }
 }
 
-static void fetchHistoryRequest(TdAccountData &account, ChatId chatId, unsigned messagesFetched,
-                                MessageId fetchBackFrom, MessageId lastReceivedMessage);
+void flushReplyFetches(TdAccountData &account)
+{
+    std::vector<std::pair<ChatId, ReplyBatch>> batches;
+    account.extractReplyFetches(batches);
+    for (const auto &batch: batches)
+        resolveReplyBatch(account, batch.first, batch.second);
+}
 
-static void fetchHistoryResponse(TdAccountData &account, ChatId chatId, MessageId stopAt,
-                                 unsigned messagesFetched,
+// History is first read from tdlib message database and shown as soon as that is done. Then the
+// same range is fetched from the server, because the database may lack messages in the middle of
+// it (e.g. ones sent while this account was offline), and only messages missing from the first
+// pass are added. Page size grows with every non-empty page.
+struct HistoryFetch {
+    ChatId     chatId;
+    MessageId  fetchFrom; // Where both passes start, invalid meaning the latest message
+    MessageId  stopAt;
+    MessageId  fetchBackFrom;
+    MessageId  oldestLocal;
+    unsigned   messagesFetched = 0;
+    unsigned   localMessages   = 0;
+    unsigned   pageSize        = HISTORY_PAGE_SIZE_INITIAL;
+    bool       onlyLocal       = true;
+    // Set when the server pass queued messages ahead of ones from the database pass which were
+    // still waiting for something
+    bool       outOfOrder      = false;
+    std::unordered_set<MessageId, IdentifierHash> fetchedIds;
+    ReplyBatch replyBatch;
+};
+
+static void fetchHistoryRequest(TdAccountData &account, std::shared_ptr<HistoryFetch> fetch);
+
+static void showFetchedHistory(TdAccountData &account, HistoryFetch &fetch)
+{
+    if (fetch.outOfOrder)
+        account.pendingMessages.sortChat(fetch.chatId);
+    // Replied messages are older, so by now they are likely among fetched ones
+    resolveReplyBatch(account, fetch.chatId, fetch.replyBatch);
+    fetch.replyBatch = ReplyBatch();
+    std::vector<IncomingMessage> readyMessages;
+    account.pendingMessages.setChatReady(fetch.chatId, readyMessages);
+    showMessages(readyMessages, account);
+}
+
+static void fetchHistoryResponse(TdAccountData &account, std::shared_ptr<HistoryFetch> pFetch,
                                  td::td_api::object_ptr<td::td_api::Object> response)
 {
-    MessageId requestMoreFrom = MessageId::invalid;
-    const td::td_api::chat *chat = account.getChat(chatId);
+    HistoryFetch &fetch       = *pFetch;
+    ChatId        chatId      = fetch.chatId;
+    bool          requestMore = false;
+    const TgChat *chat = account.getChat(chatId);
+
+    // Without a known stop point, server pass only needs to cover what the database had
+    MessageId stopAt = fetch.stopAt;
+    if (!stopAt.valid() && !fetch.onlyLocal)
+        stopAt = fetch.oldestLocal;
 
     if (response && (response->get_id() == td::td_api::messages::ID)) {
         td::td_api::messages &messages = static_cast<td::td_api::messages &>(*response);
-        purple_debug_misc(config::pluginId, "Fetched %zu messages for chat %" G_GINT64_FORMAT "\n",
-                          messages.messages_.size(), chatId.value());
+        purple_debug_misc(config::pluginId, "Fetched %zu %s messages for chat %" G_GINT64_FORMAT "\n",
+                          messages.messages_.size(), fetch.onlyLocal ? "local" : "remote", chatId.value());
         auto stop = messages.messages_.begin();
         MessageId lastMessageId = MessageId::invalid;
         for (; stop != messages.messages_.end(); ++stop) {
@@ -1102,25 +1237,45 @@ static void fetchHistoryResponse(TdAccountData &account, ChatId chatId, MessageI
                 purple_debug_warning(config::pluginId, "Erroneous message in history, stopping\n");
                 break;
             }
-            if (stopAt.valid() && (getId(*message) == stopAt)) {
-                purple_debug_misc(config::pluginId, "Found message %" G_GINT64_FORMAT ", stopping\n",
+            MessageId messageId = getId(*message);
+            if (stopAt.valid() && (messageId.value() <= stopAt.value())) {
+                purple_debug_misc(config::pluginId, "Reached message %" G_GINT64_FORMAT ", stopping\n",
                                   stopAt.value());
                 break;
             }
-            if ((!stopAt.valid() && (messagesFetched >= 100)) ||
-                (messagesFetched >= HISTORY_MESSAGES_ABSOLUTE_LIMIT))
+            lastMessageId = messageId;
+            // Already fetched from the database, or received while history was being fetched
+            if (fetch.fetchedIds.count(messageId) ||
+                account.pendingMessages.findPendingMessage(chatId, messageId))
+            {
+                continue;
+            }
+            if ((!stopAt.valid() && (fetch.messagesFetched >= 100)) ||
+                (fetch.messagesFetched >= HISTORY_MESSAGES_ABSOLUTE_LIMIT))
             {
                 purple_debug_misc(config::pluginId, "Reached history limit, stopping\n");
                 break;
             }
-            messagesFetched++;
-            lastMessageId = getId(*message);
+            fetch.fetchedIds.insert(messageId);
+            fetch.messagesFetched++;
+            if (fetch.onlyLocal) {
+                fetch.oldestLocal = messageId;
+                fetch.localMessages++;
+            } else if (fetch.localMessages != 0)
+                fetch.outOfOrder = true;
             if (chat)
-                handleIncomingMessage(account, *chat, std::move(message), PendingMessageQueue::Prepend);
+                handleIncomingMessage(account, *chat, std::move(message), PendingMessageQueue::Prepend,
+                                      &fetch.replyBatch);
         }
 
-        if (stop == messages.messages_.end())
-            requestMoreFrom = lastMessageId;
+        if ((stop == messages.messages_.end()) && lastMessageId.valid()) {
+            requestMore         = true;
+            fetch.fetchBackFrom = lastMessageId;
+            fetch.pageSize      = std::min<unsigned>(2 * fetch.pageSize, HISTORY_PAGE_SIZE_MAX);
+        }
+    } else if (fetch.onlyLocal) {
+        purple_debug_misc(config::pluginId, "Failed to read local history for chat %" G_GINT64_FORMAT ": %s\n",
+                          chatId.value(), getDisplayedError(response).c_str());
     } else {
         std::string message = formatMessage(_("Failed to fetch earlier messages: {}"),
                                             getDisplayedError(response));
@@ -1129,39 +1284,116 @@ static void fetchHistoryResponse(TdAccountData &account, ChatId chatId, MessageI
             showChatNotification(account, *chat, message.c_str(), PURPLE_MESSAGE_ERROR);
     }
 
-    if (requestMoreFrom.valid() && messagesFetched < HISTORY_MESSAGES_ABSOLUTE_LIMIT)
-        fetchHistoryRequest(account, chatId, messagesFetched, requestMoreFrom, stopAt);
-    else {
+    if (!requestMore && fetch.onlyLocal && (fetch.messagesFetched < HISTORY_MESSAGES_ABSOLUTE_LIMIT)) {
+        if (fetch.localMessages != 0) {
+            purple_debug_misc(config::pluginId, "Showing %u local messages for chat %" G_GINT64_FORMAT "\n",
+                              fetch.localMessages, chatId.value());
+            // Messages arriving during the server pass are held until it ends
+            showFetchedHistory(account, fetch);
+            account.pendingMessages.setChatNotReady(chatId);
+        }
+        requestMore         = true;
+        fetch.onlyLocal     = false;
+        fetch.fetchBackFrom = fetch.fetchFrom;
+        // Enough to cover the database pass in one round trip if nothing was missing from it
+        fetch.pageSize      = std::max<unsigned>(HISTORY_PAGE_SIZE_INITIAL,
+                                                 std::min<unsigned>(fetch.localMessages + 1, HISTORY_PAGE_SIZE_MAX));
+    }
+
+    if (requestMore && fetch.messagesFetched < HISTORY_MESSAGES_ABSOLUTE_LIMIT) {
+        fetchHistoryRequest(account, std::move(pFetch));
+    } else {
         purple_debug_misc(config::pluginId, "Done fetching history for chat %" G_GINT64_FORMAT " (%u msgs)\n",
-                          chatId.value(), messagesFetched);
+                          chatId.value(), fetch.messagesFetched);
+        showFetchedHistory(account, fetch);
+        // Queue limit was not applied while history was being fetched
         std::vector<IncomingMessage> readyMessages;
-        account.pendingMessages.setChatReady(chatId, readyMessages);
+        account.pendingMessages.extractOverflowMessages(chatId, readyMessages);
         showMessages(readyMessages, account);
+
+        if (account.finishChatGapRecovery(chatId)) {
+            unsigned finished = account.getFinishedGapRecoveryCount();
+            unsigned total    = account.getTotalGapRecoveryCount();
+            purple_debug_info(config::pluginId, "Recovered skipped messages in %u of %u chats\n",
+                              finished, total);
+            if (finished == total)
+                purple_debug_info(config::pluginId, "Skipped messages recovery took %" G_GINT64_FORMAT " ms\n",
+                                  (g_get_monotonic_time() - account.getGapRecoveryStartTime()) / 1000);
+            recoverChatGaps(account);
+        }
     }
 }
 
-static void fetchHistoryRequest(TdAccountData &account, ChatId chatId, unsigned messagesFetched,
-                                MessageId fetchBackFrom, MessageId stopAt)
+static void fetchHistoryRequest(TdAccountData &account, std::shared_ptr<HistoryFetch> fetch)
 {
     auto request = td::td_api::make_object<td::td_api::getChatHistory>();
-    request->chat_id_ = chatId.value();
-    request->from_message_id_ = fetchBackFrom.valid() ? fetchBackFrom.value() : 0;
-    request->limit_ = 30;
+    request->chat_id_ = fetch->chatId.value();
+    request->from_message_id_ = fetch->fetchBackFrom.valid() ? fetch->fetchBackFrom.value() : 0;
+    request->limit_ = fetch->pageSize;
     request->offset_ = 0;
-    request->only_local_ = false;
-    purple_debug_misc(config::pluginId, "Requesting history for chat %" G_GINT64_FORMAT
-                      " starting from %" G_GINT64_FORMAT "\n", chatId.value(), fetchBackFrom.value());
+    request->only_local_ = fetch->onlyLocal;
+    purple_debug_misc(config::pluginId, "Requesting %s history for chat %" G_GINT64_FORMAT
+                      " starting from %" G_GINT64_FORMAT "\n", fetch->onlyLocal ? "local" : "remote",
+                      fetch->chatId.value(), fetch->fetchBackFrom.value());
+    // Fetch state is shared rather than copied along with the response handler
     account.transceiver.sendQuery(std::move(request),
-        [&account, chatId, messagesFetched, stopAt](uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> response) {
-            fetchHistoryResponse(account, chatId, stopAt, messagesFetched, std::move(response));
-        });
+        [&account, fetch](uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> response) {
+            fetchHistoryResponse(account, fetch, std::move(response));
+        }, TdTransceiver::Priority::Background);
 }
 
-void fetchHistory(TdAccountData &account, ChatId chatId, MessageId fetchFrom, MessageId stopAt)
+static void fetchHistory(TdAccountData &account, ChatId chatId, MessageId fetchFrom, MessageId stopAt)
 {
-    if (!account.pendingMessages.isChatReady(chatId))
-        return;
-
     account.pendingMessages.setChatNotReady(chatId);
-    fetchHistoryRequest(account, chatId, 0, fetchFrom, stopAt);
+    auto fetch = std::make_shared<HistoryFetch>();
+    fetch->chatId        = chatId;
+    fetch->fetchFrom     = fetchFrom;
+    fetch->stopAt        = stopAt;
+    fetch->fetchBackFrom = fetchFrom;
+    fetchHistoryRequest(account, std::move(fetch));
+}
+
+void recoverChatGaps(TdAccountData &account)
+{
+    ChatGap gap;
+    while (account.startChatGapRecovery(gap)) {
+        if (gap.firstNewMessage.valid()) {
+            purple_debug_misc(config::pluginId,
+                "Fetching skipped messages for chat %" G_GINT64_FORMAT
+                " between %" G_GINT64_FORMAT " and %" G_GINT64_FORMAT "\n",
+                gap.chatId.value(), gap.lastMessage.value(), gap.firstNewMessage.value());
+            fetchHistory(account, gap.chatId, gap.firstNewMessage, gap.lastMessage);
+        } else if (account.pendingMessages.isChatReady(gap.chatId)) {
+            purple_debug_misc(config::pluginId,
+                "Fetching skipped messages for chat %" G_GINT64_FORMAT " since %" G_GINT64_FORMAT "\n",
+                gap.chatId.value(), gap.lastMessage.value());
+            fetchHistory(account, gap.chatId, MessageId::invalid, gap.lastMessage);
+        } else
+            account.finishChatGapRecovery(gap.chatId);
+    }
+}
+
+static gboolean gapRecoveryTimerCallback(gpointer data)
+{
+    TdAccountData &account = *static_cast<TdAccountData *>(data);
+    account.gapRecoveryTimer = 0;
+    recoverChatGaps(account);
+
+    return G_SOURCE_REMOVE;
+}
+
+void scheduleChatGapRecovery(TdAccountData &account)
+{
+    if (account.hasQueuedChatGaps() && !account.gapRecoveryTimer)
+        account.gapRecoveryTimer = account.transceiver.addTimeout(GAP_RECOVERY_DELAY_SECONDS,
+                                                                  gapRecoveryTimerCallback, &account);
+}
+
+void onChatGapMessage(TdAccountData &account, ChatId chatId, MessageId messageId)
+{
+    // This and later messages are held back until history before them is fetched
+    if (account.setChatGapNewMessage(chatId, messageId)) {
+        account.pendingMessages.setChatNotReady(chatId);
+        recoverChatGaps(account);
+    }
 }
@@ -4,20 +4,20 @@
 #include "account-data.h"
 #include <purple.h>
 
-std::string makeNoticeWithSender(const td::td_api::chat &chat, const TgMessageInfo &message,
+std::string makeNoticeWithSender(const TgChat &chat, const TgMessageInfo &message,
                                  const char *noticeText, PurpleAccount *account);
 std::string getMessageText(const td::td_api::formattedText &text);
 std::string makeInlineImageText(int imgstoreId);
 void sendConversationReadReceipts(TdAccountData &account, PurpleConversation *conv);
-void showMessageText(TdAccountData &account, const td::td_api::chat &chat, const TgMessageInfo &message,
+void showMessageText(TdAccountData &account, const TgChat &chat, const TgMessageInfo &message,
                      const char *text, const char *notification, uint32_t extraFlags = 0);
 void showMessageTextIm(TdAccountData &account, const char *purpleUserName, const char *text,
                        const char *notification, time_t timestamp, PurpleMessageFlags flags);
-void showChatNotification(TdAccountData &account, const td::td_api::chat &chat,
+void showChatNotification(TdAccountData &account, const TgChat &chat,
                           const char *notification, PurpleMessageFlags extraFlags = (PurpleMessageFlags)0);
-void showChatNotification(TdAccountData &account, const td::td_api::chat &chat,
+void showChatNotification(TdAccountData &account, const TgChat &chat,
                           const char *notification, time_t timestamp, PurpleMessageFlags extraFlags);
-void showGenericFileInline(const td::td_api::chat &chat, const TgMessageInfo &message,
+void showGenericFileInline(const TgChat &chat, const TgMessageInfo &message,
                            const std::string &filePath, const char *caption,
                            const std::string &fileDescription,TdAccountData &account);
 void showDownloadedFileInline(ChatId chatId, TgMessageInfo &message,
@@ -27,7 +27,7 @@ void showDownloadedFileInline(ChatId chatId, TgMessageInfo &message,
                               TdTransceiver &transceiver, TdAccountData &account);
 bool isStickerAnimated(const std::string &filePath);
 bool shouldConvertAnimatedSticker(const TgMessageInfo &message, const PurpleAccount *purpleAccount);
-void showMessage(const td::td_api::chat &chat, IncomingMessage &fullMessage,
+void showMessage(const TgChat &chat, IncomingMessage &fullMessage,
                  TdTransceiver &transceiver, TdAccountData &account);
 void showMessages(std::vector<IncomingMessage>& messages, TdAccountData &account);
 
@@ -42,18 +42,27 @@ struct FileInfo {
 const td::td_api::file *selectPhotoSize(PurpleAccount *account, const td::td_api::messagePhoto &photo);
 void getFileFromMessage(const IncomingMessage &fullMessage, FileInfo &result);
 
-void makeFullMessage(const td::td_api::chat &chat, td::td_api::object_ptr<td::td_api::message> message,
+void makeFullMessage(const TgChat &chat, td::td_api::object_ptr<td::td_api::message> message,
                      IncomingMessage &fullMessage, const TdAccountData &account);
 bool isMessageReady(const IncomingMessage &fullMessage, const TdAccountData &account);
+// If replyBatch is given, replied message is added to it instead of being fetched right away.
+// Otherwise it is queued with TdAccountData::queueReplyFetch, see flushReplyFetches.
 void fetchExtras(IncomingMessage &fullMessage, TdTransceiver &transceiver, TdAccountData &account,
-                 TdTransceiver::ResponseCb2 onFetchReply);
+                 ReplyBatch *replyBatch = nullptr);
 void checkMessageReady(const IncomingMessage *message, TdTransceiver &transceiver,
                        TdAccountData &account, std::vector<IncomingMessage> *rvReadyMessages = nullptr);
 
-void handleIncomingMessage(TdAccountData &account, const td::td_api::chat &chat,
+void handleIncomingMessage(TdAccountData &account, const TgChat &chat,
                            td::td_api::object_ptr<td::td_api::message> message,
-                           PendingMessageQueue::MessageAction action);
-void fetchHistory(TdAccountData &account, ChatId chatId, MessageId fetchFrom, MessageId stopAt);
+                           PendingMessageQueue::MessageAction action,
+                           ReplyBatch *replyBatch = nullptr);
+// Skipped messages (see TdAccountData::addChatGap) are recovered after a short delay, or as soon
+// as a new message arrives in the chat
+void scheduleChatGapRecovery(TdAccountData &account);
+void recoverChatGaps(TdAccountData &account);
+// Replied messages queued while processing live updates are fetched with one getMessages per chat
+void flushReplyFetches(TdAccountData &account);
+void onChatGapMessage(TdAccountData &account, ChatId chatId, MessageId messageId);
 
 #endif
 
@@ -10,24 +10,24 @@ void updateKnownSecretChat(SecretChatId secretChatId, TdTransceiver &transceiver
 {
     const td::td_api::secretChat *secretChat = account.getSecretChat(secretChatId);
 
-    const td::td_api::chat *chat = account.getChatBySecretChat(secretChatId);
+    const TgChat *chat = account.getChatBySecretChat(secretChatId);
     if (! chat) return;
 
     int state = (secretChat && secretChat->state_) ? secretChat->state_->get_id() :
                                                      td::td_api::secretChatStateClosed::ID;
     std::string purpleBuddyName = getSecretChatBuddyName(secretChatId);
     // TRANSLATOR: Default buddy-alias for a new secret chat. Argument is the Telegram nick, I think.
-    std::string alias = formatMessage(_("Secret chat: {}"), chat->title_);
+    std::string alias = formatMessage(_("Secret chat: {}"), chat->title.str());
 
     PurpleBuddy *buddy = purple_find_buddy(account.purpleAccount, purpleBuddyName.c_str());
     if (buddy == NULL) {
         purple_debug_misc(config::pluginId, "Adding buddy '%s' for secret chat %d with %s\n",
-                          alias.c_str(), secretChatId.value(), chat->title_.c_str());
+                          alias.c_str(), secretChatId.value(), chat->title.c_str());
         buddy = purple_buddy_new(account.purpleAccount, purpleBuddyName.c_str(), alias.c_str());
         purple_blist_add_buddy(buddy, NULL, NULL, NULL);
 
         // Don't bother updating the photo - only set it when creating secret chat
-        const td::td_api::file *photo = chat->photo_ ? chat->photo_->small_.get() : nullptr;
+        const td::td_api::file *photo = chat->smallPhoto.get();
         if (photo && photo->local_ && photo->local_->is_downloading_completed_) {
             gchar  *img = NULL;
             size_t  len;
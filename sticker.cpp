@@ -13,12 +13,41 @@
 #include "gif.h"
 #include <zlib.h>
 #include <rlottie.h>
+#ifndef NoWebp
+#include <webp/encode.h>
+#include <webp/mux.h>
+#endif
 #endif
 
+#include <glib/gstdio.h>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <map>
+#include <cstring>
+#include <ctime>
+
 constexpr int MAX_W = 256;
 constexpr int MAX_H = 256;
 constexpr unsigned ANIMATED_WIDTH  = 200;
 constexpr unsigned ANIMATED_HEIGHT = 200;
+constexpr uint32_t ANIMATED_BG_COLOR    = UINT32_MAX;
+constexpr uint32_t ANIMATED_FRAME_DELAY = 2; // 1/100 s
+constexpr unsigned STICKER_CACHE_VERSION = 1;
+constexpr unsigned STICKER_TEMP_FILE_MAX_AGE = 3600; // s
+constexpr float    WEBP_QUALITY = 80;
+constexpr int      WEBP_METHOD  = 2; // 0 fastest .. 6 smallest
+
+static struct {
+    std::mutex  mutex;
+    std::string directory;
+    uint64_t    budget = 0;
+    std::map<PurpleAccount *, uint64_t> accountBudgets;
+    // Cache files given out as conversion results which the main thread has not read yet
+    std::map<std::string, unsigned> pinned;
+} g_stickerCache;
 
 #ifndef NoWebp
 
@@ -157,7 +186,7 @@ int p2tgl_imgstore_add_with_id_webp (const char *filename)
 
 #endif
 
-void showWebpSticker(const td::td_api::chat &chat, const TgMessageInfo &message,
+void showWebpSticker(const TgChat &chat, const TgMessageInfo &message,
                      const std::string &filePath, const std::string &fileDescription,
                      TdAccountData &account)
 {
@@ -171,6 +200,9 @@ void showWebpSticker(const td::td_api::chat &chat, const TgMessageInfo &message,
 
 #ifndef NoLottie
 
+// Animated sticker conversions currently rendering, which share CPU cores between them
+static std::atomic<unsigned> g_activeConversions{0};
+
 static bool gunzip(gchar *compressedData, gsize compressedSize, std::string &output,
                    std::string &errorMessage)
 {
@@ -216,10 +248,21 @@ static bool gunzip(gchar *compressedData, gsize compressedSize, std::string &out
     return true;
 }
 
-class GifBuilder {
+// Encodes rendered frames into an animated image file
+class AnimationBuilder {
+public:
+    virtual ~AnimationBuilder() {}
+    // Surface contents may be modified
+    virtual void addFrame(rlottie::Surface &s) = 0;
+    // Completes and closes the file; returns false on failure
+    virtual bool finish() = 0;
+};
+
+class GifBuilder: public AnimationBuilder {
 public:
     explicit GifBuilder(int fd, const uint32_t width,
                         const uint32_t height, const uint32_t bgColor=0xffffffff, const uint32_t delay = 2)
+    : delay(delay)
     {
         GifBegin(&handle, fd, width, height, delay);
         bgColorR = (uint8_t) ((bgColor & 0xff0000) >> 16);
@@ -229,9 +272,9 @@ public:
     }
     ~GifBuilder()
     {
-        GifEnd(&handle);
+        finish();
     }
-    void addFrame(rlottie::Surface &s, uint32_t delay = 2)
+    void addFrame(rlottie::Surface &s) override
     {
         argbTorgba(s);
         GifWriteFrame(&handle,
@@ -241,6 +284,10 @@ public:
                       delay,
                       transparent);
     }
+    bool finish() override
+    {
+        return GifEnd(&handle);
+    }
     void argbTorgba(rlottie::Surface &s)
     {
         uint8_t *buffer = reinterpret_cast<uint8_t *>(s.buffer());
@@ -277,10 +324,307 @@ public:
 
 private:
     GifWriter      handle;
+    uint32_t delay;
     uint8_t bgColorR, bgColorG, bgColorB;
     bool    transparent;
 };
 
+#ifndef NoWebp
+
+// Animated WebP with real alpha channel, unlike GIF
+class WebpBuilder: public AnimationBuilder {
+public:
+    explicit WebpBuilder(int fd, const uint32_t width, const uint32_t height, const uint32_t frameDurationMs)
+    : m_fd(fd), m_frameDuration(frameDurationMs)
+    {
+        WebPAnimEncoderOptions options;
+        WebPAnimEncoderOptionsInit(&options);
+        m_encoder = WebPAnimEncoderNew(width, height, &options);
+
+        WebPConfigInit(&m_config);
+        m_config.quality = WEBP_QUALITY;
+        m_config.method  = WEBP_METHOD;
+
+        WebPPictureInit(&m_picture);
+        m_picture.use_argb = 1;
+        m_picture.width    = width;
+        m_picture.height   = height;
+        m_ok = m_encoder && WebPPictureAlloc(&m_picture);
+    }
+    ~WebpBuilder()
+    {
+        finish();
+        WebPPictureFree(&m_picture);
+        if (m_encoder)
+            WebPAnimEncoderDelete(m_encoder);
+    }
+    void addFrame(rlottie::Surface &s) override
+    {
+        if (!m_ok)
+            return;
+
+        // rlottie renders premultiplied ARGB, WebP wants it straight
+        for (size_t y = 0; y < s.height(); y++) {
+            const uint32_t *src = s.buffer() + y * s.bytesPerLine() / 4;
+            uint32_t       *dst = m_picture.argb + y * m_picture.argb_stride;
+            for (size_t x = 0; x < s.width(); x++) {
+                uint32_t pixel = src[x];
+                uint32_t a = pixel >> 24;
+                if ((a != 0) && (a != 255)) {
+                    uint32_t r = std::min(((pixel >> 16) & 0xff) * 255 / a, 255U);
+                    uint32_t g = std::min(((pixel >> 8) & 0xff) * 255 / a, 255U);
+                    uint32_t b = std::min((pixel & 0xff) * 255 / a, 255U);
+                    pixel = (a << 24) | (r << 16) | (g << 8) | b;
+                }
+                dst[x] = pixel;
+            }
+        }
+
+        m_ok = WebPAnimEncoderAdd(m_encoder, &m_picture, m_timestamp, &m_config);
+        m_timestamp += m_frameDuration;
+    }
+    bool finish() override
+    {
+        if (m_fd < 0)
+            return m_ok;
+
+        FILE *f = fdopen(m_fd, "wb");
+        m_fd = -1;
+        if (!f)
+            return (m_ok = false);
+
+        WebPData data;
+        WebPDataInit(&data);
+        m_ok = m_ok && WebPAnimEncoderAdd(m_encoder, NULL, m_timestamp, NULL) &&
+               WebPAnimEncoderAssemble(m_encoder, &data) &&
+               (fwrite(data.bytes, 1, data.size, f) == data.size);
+        m_ok = (fclose(f) == 0) && m_ok;
+        WebPDataClear(&data);
+
+        return m_ok;
+    }
+private:
+    int               m_fd;
+    int               m_frameDuration;
+    int               m_timestamp = 0;
+    WebPAnimEncoder  *m_encoder;
+    WebPConfig        m_config;
+    WebPPicture       m_picture;
+    bool              m_ok;
+};
+
+#endif
+
+// Renders animation frames on up to maxThreads threads into a ring of buffers, handing them out in
+// order. rlottie::Animation is not safe to use from several threads, so every thread gets its own
+// copy. With maxThreads = 1, frames are rendered on the calling thread.
+class FrameRenderer {
+public:
+    FrameRenderer(std::unique_ptr<rlottie::Animation> player, const std::string &lottieData,
+                  unsigned width, unsigned height, unsigned maxThreads);
+    ~FrameRenderer();
+    FrameRenderer(const FrameRenderer &) = delete;
+    FrameRenderer &operator=(const FrameRenderer &) = delete;
+
+    size_t frameCount() const { return m_frameCount; }
+    // Frames must be requested in order; surface stays valid until releaseFrame
+    rlottie::Surface waitFrame(size_t frame);
+    void             releaseFrame();
+private:
+    unsigned                                         m_width, m_height;
+    size_t                                           m_frameCount;
+    std::vector<std::unique_ptr<rlottie::Animation>> m_players;
+    std::vector<std::unique_ptr<uint32_t[]>>         m_ring;
+    std::vector<size_t>                              m_renderedFrames;
+    std::vector<std::thread>                         m_threads;
+    std::mutex                                       m_mutex;
+    std::condition_variable                          m_frameReady;
+    std::condition_variable                          m_slotFree;
+    size_t                                           m_releasedFrames = 0;
+    bool                                             m_stopped = false;
+
+    rlottie::Surface getSurface(size_t slot);
+    void             renderFrames(rlottie::Animation &player, size_t firstFrame, size_t step);
+};
+
+FrameRenderer::FrameRenderer(std::unique_ptr<rlottie::Animation> player, const std::string &lottieData,
+                             unsigned width, unsigned height, unsigned maxThreads)
+: m_width(width), m_height(height), m_frameCount(player->totalFrame())
+{
+    size_t threadCount = std::min<size_t>(std::max(1U, maxThreads), m_frameCount);
+    m_players.push_back(std::move(player));
+    while (m_players.size() < threadCount) {
+        std::unique_ptr<rlottie::Animation> copy = rlottie::Animation::loadFromData(lottieData, "");
+        if (!copy)
+            break;
+        m_players.push_back(std::move(copy));
+    }
+
+    // Two buffers per thread let renderers run ahead while the encoder is busy with a frame
+    size_t ringSize = (m_players.size() > 1) ? 2 * m_players.size() : 1;
+    for (size_t i = 0; i < ringSize; i++)
+        m_ring.emplace_back(new uint32_t[width * height]);
+    m_renderedFrames.assign(ringSize, SIZE_MAX);
+
+    if (m_players.size() > 1)
+        for (size_t i = 0; i < m_players.size(); i++)
+            m_threads.emplace_back(&FrameRenderer::renderFrames, this, std::ref(*m_players[i]),
+                                   i, m_players.size());
+}
+
+FrameRenderer::~FrameRenderer()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopped = true;
+    }
+    m_slotFree.notify_all();
+    for (std::thread &thread: m_threads)
+        thread.join();
+}
+
+rlottie::Surface FrameRenderer::getSurface(size_t slot)
+{
+    return rlottie::Surface(m_ring[slot].get(), m_width, m_height, m_width * 4);
+}
+
+void FrameRenderer::renderFrames(rlottie::Animation &player, size_t firstFrame, size_t step)
+{
+    for (size_t frame = firstFrame; frame < m_frameCount; frame += step) {
+        size_t slot = frame % m_ring.size();
+        {
+            // Slot is free once the frame using it before is released
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_slotFree.wait(lock, [&]() {
+                return m_stopped || (frame < m_releasedFrames + m_ring.size());
+            });
+            if (m_stopped)
+                return;
+        }
+
+        player.renderSync(frame, getSurface(slot));
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_renderedFrames[slot] = frame;
+        }
+        m_frameReady.notify_all();
+    }
+}
+
+rlottie::Surface FrameRenderer::waitFrame(size_t frame)
+{
+    size_t slot = frame % m_ring.size();
+    if (m_threads.empty()) {
+        m_players[0]->renderSync(frame, getSurface(slot));
+        return getSurface(slot);
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_frameReady.wait(lock, [&]() { return m_renderedFrames[slot] == frame; });
+    return getSurface(slot);
+}
+
+void FrameRenderer::releaseFrame()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_releasedFrames++;
+    }
+    m_slotFree.notify_all();
+}
+
+// Anything affecting the output must be part of the key
+static std::string getStickerCacheKey(const gchar *compressedData, gsize compressedSize,
+                                      const char *extension)
+{
+    std::string renderParams = std::to_string(STICKER_CACHE_VERSION) + ":" + extension + ":" +
+                               std::to_string(ANIMATED_WIDTH) + "x" + std::to_string(ANIMATED_HEIGHT) + ":" +
+                               std::to_string(ANIMATED_BG_COLOR) + ":" + std::to_string(ANIMATED_FRAME_DELAY);
+
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_checksum_update(checksum, reinterpret_cast<const guchar *>(compressedData), compressedSize);
+    g_checksum_update(checksum, reinterpret_cast<const guchar *>(renderParams.data()), renderParams.size());
+    std::string key = g_checksum_get_string(checksum);
+    g_checksum_free(checksum);
+
+    return key;
+}
+
+// Temporary files are named like cache entries plus .XXXXXX, see StickerConversionThread::run
+static bool isStickerCacheTempFile(const char *name)
+{
+    const char *suffix = strrchr(name, '.');
+    if (!suffix || (strlen(suffix) != strlen(".XXXXXX")))
+        return false;
+    std::string entryName(name, suffix);
+    return g_str_has_suffix(entryName.c_str(), ".gif") || g_str_has_suffix(entryName.c_str(), ".webp");
+}
+
+// Deletes least recently used entries (by modification time, see StickerConversionThread::run)
+// until the cache fits into budget, except for pinned ones, as well as temporary files left
+// behind by interrupted conversions. Must be called with g_stickerCache.mutex held.
+// Returns the number of deleted files.
+static unsigned trimStickerCache(const std::string &cacheDir, uint64_t budget)
+{
+    GDir *dir = g_dir_open(cacheDir.c_str(), 0, NULL);
+    if (!dir)
+        return 0;
+
+    struct CacheEntry {
+        std::string path;
+        uint64_t    size;
+        time_t      lastUsed;
+    };
+    std::vector<CacheEntry> entries;
+    uint64_t                totalSize = 0;
+    unsigned                removed   = 0;
+    time_t                  now       = time(NULL);
+
+    while (const char *name = g_dir_read_name(dir)) {
+        bool tempFile = isStickerCacheTempFile(name);
+        if (!tempFile && !g_str_has_suffix(name, ".gif") && !g_str_has_suffix(name, ".webp"))
+            continue;
+        std::string path = cacheDir + G_DIR_SEPARATOR_S + name;
+        GStatBuf    st;
+        if (g_stat(path.c_str(), &st) != 0)
+            continue;
+        if (tempFile) {
+            // Temporary files of running conversions keep getting written to
+            if ((now - st.st_mtime > STICKER_TEMP_FILE_MAX_AGE) && (g_unlink(path.c_str()) == 0))
+                removed++;
+        } else {
+            entries.push_back(CacheEntry{path, uint64_t(st.st_size), st.st_mtime});
+            totalSize += st.st_size;
+        }
+    }
+    g_dir_close(dir);
+
+    if (totalSize <= budget)
+        return removed;
+
+    std::sort(entries.begin(), entries.end(), [](const CacheEntry &a, const CacheEntry &b) {
+        return (a.lastUsed < b.lastUsed);
+    });
+    for (const CacheEntry &entry: entries) {
+        if (totalSize <= budget)
+            break;
+        if (g_stickerCache.pinned.count(entry.path))
+            continue;
+        if (g_unlink(entry.path.c_str()) == 0) {
+            totalSize -= entry.size;
+            removed++;
+        }
+    }
+    return removed;
+}
+
+// Must be called with g_stickerCache.mutex held
+static void pinStickerCacheFile(const std::string &path)
+{
+    g_stickerCache.pinned[path]++;
+}
+
 void StickerConversionThread::run()
 {
     gchar  *compressedData = NULL;
@@ -294,6 +638,37 @@ void StickerConversionThread::run()
         return;
     }
 
+    std::string cacheDir;
+    uint64_t    cacheBudget;
+    {
+        std::lock_guard<std::mutex> lock(g_stickerCache.mutex);
+        cacheDir    = g_stickerCache.directory;
+        cacheBudget = g_stickerCache.budget;
+    }
+
+#ifndef NoWebp
+    const bool webp = m_webpOutput;
+#else
+    const bool webp = false;
+#endif
+    const char *extension = webp ? ".webp" : ".gif";
+
+    std::string cacheFileName;
+    if (!cacheDir.empty() && (cacheBudget != 0)) {
+        cacheFileName = cacheDir + G_DIR_SEPARATOR_S +
+                        getStickerCacheKey(compressedData, compressedSize, extension) + extension;
+        std::lock_guard<std::mutex> lock(g_stickerCache.mutex);
+        if (g_file_test(cacheFileName.c_str(), G_FILE_TEST_IS_REGULAR)) {
+            // Mark as recently used
+            g_utime(cacheFileName.c_str(), NULL);
+            pinStickerCacheFile(cacheFileName);
+            g_free(compressedData);
+            m_outputFileName = cacheFileName;
+            m_outputCached   = true;
+            return;
+        }
+    }
+
     std::string lottieData;
     bool gunzipSuccess = gunzip(compressedData, compressedSize, lottieData, m_errorMessage);
     g_free(compressedData);
@@ -307,26 +682,70 @@ void StickerConversionThread::run()
         return;
     }
 
-    char *tempFileName = NULL;
-    int fd = g_file_open_tmp("tdlib_sticker_XXXXXX", &tempFileName, NULL);
+    // Render straight into the cache directory if possible, then rename when complete
+    int fd = -1;
+    if (!cacheFileName.empty() && (g_mkdir_with_parents(cacheDir.c_str(), 0700) == 0)) {
+        std::vector<char> tempName(cacheFileName.begin(), cacheFileName.end());
+        const char suffix[] = ".XXXXXX";
+        tempName.insert(tempName.end(), suffix, suffix + sizeof(suffix));
+        fd = g_mkstemp(tempName.data());
+        if (fd >= 0)
+            m_outputFileName = tempName.data();
+    }
     if (fd < 0) {
+        char *tempFileName = NULL;
+        fd = g_file_open_tmp("tdlib_sticker_XXXXXX", &tempFileName, NULL);
+        if (fd < 0) {
+            // Unlikely error message not worth translating
+            m_errorMessage = "Could not create temporary file";
+            return;
+        }
+        m_outputFileName = tempFileName;
+        g_free(tempFileName);
+        cacheFileName.clear();
+    }
+
+    // Conversions themselves run on worker pool threads, so render threads are only added while
+    // there are fewer conversions than CPU cores
+    unsigned cores         = std::max(1U, std::thread::hardware_concurrency());
+    unsigned renderThreads = std::max(1U, cores / ++g_activeConversions);
+    bool     encoded;
+    {
+        FrameRenderer renderer(std::move(player), lottieData, ANIMATED_WIDTH, ANIMATED_HEIGHT,
+                               renderThreads);
+        std::unique_ptr<AnimationBuilder> builder;
+#ifndef NoWebp
+        if (webp)
+            builder.reset(new WebpBuilder(fd, ANIMATED_WIDTH, ANIMATED_HEIGHT, ANIMATED_FRAME_DELAY * 10));
+        else
+#endif
+            builder.reset(new GifBuilder(fd, ANIMATED_WIDTH, ANIMATED_HEIGHT, ANIMATED_BG_COLOR,
+                                         ANIMATED_FRAME_DELAY));
+        for (size_t i = 0; i < renderer.frameCount(); i++) {
+            rlottie::Surface surface = renderer.waitFrame(i);
+            builder->addFrame(surface);
+            renderer.releaseFrame();
+        }
+        encoded = builder->finish();
+    }
+    g_activeConversions--;
+
+    if (!encoded) {
         // Unlikely error message not worth translating
-        m_errorMessage = "Could not create temporary file";
+        m_errorMessage = "Could not encode animation";
+        g_unlink(m_outputFileName.c_str());
         return;
     }
-    m_outputFileName = tempFileName;
-    g_free(tempFileName);
 
-    unsigned w = ANIMATED_WIDTH;
-    unsigned h = ANIMATED_HEIGHT;
-    auto buffer = std::unique_ptr<uint32_t[]>(new uint32_t[w * h]);
-    size_t frameCount = player->totalFrame();
-
-    GifBuilder builder(fd, w, h, UINT32_MAX);
-    for (size_t i = 0; i < frameCount ; i++) {
-        rlottie::Surface surface(buffer.get(), w, h, w * 4);
-        player->renderSync(i, surface);
-        builder.addFrame(surface);
+    if (!cacheFileName.empty()) {
+        std::lock_guard<std::mutex> lock(g_stickerCache.mutex);
+        if (g_rename(m_outputFileName.c_str(), cacheFileName.c_str()) == 0) {
+            pinStickerCacheFile(cacheFileName);
+            m_outputFileName = cacheFileName;
+            m_outputCached   = true;
+            m_removedFromCache = trimStickerCache(cacheDir, cacheBudget);
+        } else
+            m_cacheAddFailed = true;
     }
 }
 
@@ -341,6 +760,40 @@ void StickerConversionThread::run()
 
 StickerConversionThread::Callback StickerConversionThread::g_callback = nullptr;
 
+StickerConversionThread::~StickerConversionThread()
+{
+    if (m_outputCached) {
+        std::lock_guard<std::mutex> lock(g_stickerCache.mutex);
+        auto it = g_stickerCache.pinned.find(m_outputFileName);
+        if ((it != g_stickerCache.pinned.end()) && (--it->second == 0))
+            g_stickerCache.pinned.erase(it);
+    }
+}
+
+static void updateStickerCacheBudget()
+{
+    uint64_t budget = 0;
+    for (const auto &entry: g_stickerCache.accountBudgets)
+        budget = std::max(budget, entry.second);
+    g_stickerCache.budget = budget;
+}
+
+void StickerConversionThread::setCache(PurpleAccount *purpleAccount, const std::string &cacheDir,
+                                       uint64_t budget)
+{
+    std::lock_guard<std::mutex> lock(g_stickerCache.mutex);
+    g_stickerCache.directory = cacheDir;
+    g_stickerCache.accountBudgets[purpleAccount] = budget;
+    updateStickerCacheBudget();
+}
+
+void StickerConversionThread::removeCacheAccount(PurpleAccount *purpleAccount)
+{
+    std::lock_guard<std::mutex> lock(g_stickerCache.mutex);
+    g_stickerCache.accountBudgets.erase(purpleAccount);
+    updateStickerCacheBudget();
+}
+
 void StickerConversionThread::setCallback(AccountThread::Callback callback)
 {
     g_callback = callback;
@@ -348,6 +801,11 @@ void StickerConversionThread::setCallback(AccountThread::Callback callback)
 
 void StickerConversionThread::callback(PurpleTdClient* tdClient)
 {
+    // Logged here rather than from run() because libpurple is not thread-safe
+    if (m_cacheAddFailed)
+        purple_debug_warning(config::pluginId, "Failed to add %s to sticker cache\n", m_outputFileName.c_str());
+    if (m_removedFromCache)
+        purple_debug_misc(config::pluginId, "Removed %u files from sticker cache\n", m_removedFromCache);
     if (g_callback)
         (tdClient->*g_callback)(this);
 }
@@ -2,8 +2,9 @@
 #define _STICKER_H
 
 #include "client-utils.h"
+#include "purple-info.h"
 
-void showWebpSticker(const td::td_api::chat &chat, const TgMessageInfo &message,
+void showWebpSticker(const TgChat &chat, const TgMessageInfo &message,
                      const std::string &filePath, const std::string &fileDescription,
                      TdAccountData &account);
 
@@ -11,6 +12,10 @@ class StickerConversionThread: public AccountThread {
 private:
     std::string   m_errorMessage;
     std::string   m_outputFileName;
+    bool          m_outputCached = false;
+    bool          m_cacheAddFailed   = false;
+    unsigned      m_removedFromCache = 0;
+    const bool    m_webpOutput;
     void run() override;
 
     static Callback g_callback;
@@ -21,21 +26,32 @@ public:
     const ChatId chatId;
     StickerConversionThread(PurpleAccount *purpleAccount, const std::string &filename,
                             ChatId chatId, TgMessageInfo &&message)
-    : AccountThread(purpleAccount), m_message(std::move(message)), inputFileName(filename),
-        chatId(chatId) {}
+    : AccountThread(purpleAccount), m_webpOutput(useWebpForAnimatedStickers(purpleAccount)),
+        m_message(std::move(message)), inputFileName(filename), chatId(chatId) {}
     StickerConversionThread(PurpleAccount *purpleAccount, const std::string &filename,
                             ChatId chatId, const TgMessageInfo *message)
-    : AccountThread(purpleAccount), inputFileName(filename), chatId(chatId)
+    : AccountThread(purpleAccount), m_webpOutput(useWebpForAnimatedStickers(purpleAccount)),
+        inputFileName(filename), chatId(chatId)
     {
         if (message)
             m_message.assign(*message);
     }
 
+    // Releases the output file for sticker cache trimming
+    ~StickerConversionThread();
+
     const std::string &getOutputFileName() const { return m_outputFileName; }
     const std::string &getErrorMessage()   const { return m_errorMessage; }
+    // Output file belongs to sticker cache and must not be removed
+    bool isOutputCached()                  const { return m_outputCached; }
     const TgMessageInfo &message()         const { return m_message; }
 
     static void setCallback(Callback callback);
+    // Converted stickers are kept in cacheDir, using up to budget bytes; 0 disables the cache.
+    // The cache is shared by all accounts, so it is as large as the highest budget of any account.
+    static void setCache(PurpleAccount *purpleAccount, const std::string &cacheDir, uint64_t budget);
+    // Drops the account's cache budget
+    static void removeCacheAccount(PurpleAccount *purpleAccount);
 };
 
 #endif
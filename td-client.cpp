@@ -18,17 +18,68 @@ enum {
     SUPERGROUP_MEMBER_LIMIT      = 200,
 };
 
+static UpdateFilterRule::CoalesceKey userStatusKey(const td::td_api::Object &update)
+{
+    auto &statusUpdate = static_cast<const td::td_api::updateUserStatus &>(update);
+    return {getUserId(statusUpdate).value(), 0};
+}
+
+static UpdateFilterRule::CoalesceKey chatActionKey(const td::td_api::Object &update)
+{
+    auto &actionUpdate = static_cast<const td::td_api::updateChatAction &>(update);
+    return {getChatId(actionUpdate).value(), getUserId(actionUpdate).value()};
+}
+
+static UpdateFilterRule::CoalesceKey fileKey(const td::td_api::Object &update)
+{
+    auto &fileUpdate = static_cast<const td::td_api::updateFile &>(update);
+    return {fileUpdate.file_ ? fileUpdate.file_->id_ : 0, 0};
+}
+
+// Update types handled by processUpdate - must be kept in sync with it, other updates are dropped
+// before they reach main thread
+static const std::vector<UpdateFilterRule> g_updateFilter = {
+    {td::td_api::updateAuthorizationState::ID,   nullptr},
+    {td::td_api::updateUser::ID,                 nullptr},
+    {td::td_api::updateNewChat::ID,              nullptr},
+    {td::td_api::updateNewMessage::ID,           nullptr},
+    {td::td_api::updateUserStatus::ID,           userStatusKey},
+    {td::td_api::updateChatAction::ID,           chatActionKey},
+    {td::td_api::updateBasicGroup::ID,           nullptr},
+    {td::td_api::updateSupergroup::ID,           nullptr},
+    {td::td_api::updateBasicGroupFullInfo::ID,   nullptr},
+    {td::td_api::updateSupergroupFullInfo::ID,   nullptr},
+    {td::td_api::updateMessageSendSucceeded::ID, nullptr},
+    {td::td_api::updateMessageSendFailed::ID,    nullptr},
+    {td::td_api::updateChatPosition::ID,         nullptr},
+    {td::td_api::updateChatTitle::ID,            nullptr},
+    {td::td_api::updateChatLastMessage::ID,      nullptr},
+    {td::td_api::updateOption::ID,               nullptr},
+    {td::td_api::updateFile::ID,                 fileKey},
+    {td::td_api::updateSecretChat::ID,           nullptr},
+    {td::td_api::updateCall::ID,                 nullptr},
+};
+
 PurpleTdClient::PurpleTdClient(PurpleAccount *acct, ITransceiverBackend *testBackend)
-:   m_transceiver(this, acct, &PurpleTdClient::processUpdate, testBackend),
+:   m_transceiver(this, acct, &PurpleTdClient::processUpdate, testBackend, g_updateFilter),
     m_data(acct, m_transceiver)
 {
     StickerConversionThread::setCallback(&PurpleTdClient::onAnimatedStickerConverted);
+    m_transceiver.setSliceDoneCallback(&PurpleTdClient::onUpdateSliceDone);
     m_account = acct;
+    m_data.pendingMessages.setMaxDepth(getPendingQueueLimit(acct));
+    m_data.setMaxActiveGapRecoveries(getGapRecoveryConcurrency(acct));
+    AccountThread::setMaxThreads(acct, getWorkerThreadLimit(acct));
+    StickerConversionThread::setCache(acct, getBaseDatabasePath() + G_DIR_SEPARATOR_S + "sticker-cache",
+                                      uint64_t(getStickerCacheSizeMb(acct)) * 1024 * 1024);
     setPurpleConnectionInProgress();
 }
 
 PurpleTdClient::~PurpleTdClient()
 {
+    AccountThread::removeAccount(m_account);
+    StickerConversionThread::removeCacheAccount(m_account);
+
     std::vector<PurpleXfer *> transfers;
     m_data.removeAllFileTransfers(transfers);
     for (PurpleXfer *xfer: transfers) {
@@ -65,6 +116,12 @@ void PurpleTdClient::setTdlibFatalErrorCallback(td::Log::FatalErrorCallbackPtr c
     td::Log::set_fatal_error_callback(callback);
 }
 
+void PurpleTdClient::onUpdateSliceDone()
+{
+    flushReplyFetches(m_data);
+}
+
+// When adding update types here, also add them to g_updateFilter
 void PurpleTdClient::processUpdate(td::td_api::Object &update)
 {
     purple_debug_misc(config::pluginId, "Incoming update\n");
@@ -408,6 +465,11 @@ void PurpleTdClient::sendTdlibParameters()
     parameters->database_directory_ = getBaseDatabasePath() + G_DIR_SEPARATOR_S + username;
     purple_debug_misc(config::pluginId, "Account %s using database directory %s\n",
                       username, parameters->database_directory_.c_str());
+    if (purple_account_get_bool(m_account, AccountOptions::LastMessageStore,
+                                AccountOptions::LastMessageStoreDefault))
+    {
+        m_data.lastMessages.open(parameters->database_directory_ + G_DIR_SEPARATOR_S + "purple-last-messages");
+    }
     parameters->use_chat_info_database_ = true;
     parameters->use_message_database_ = true;
     parameters->use_secret_chats_ = (purple_account_get_bool(m_account, AccountOptions::EnableSecretChats,
@@ -774,7 +836,8 @@ void PurpleTdClient::requestMissingPrivateChats()
         purpleDebug("Requesting private chat for user id {}", userId.value());
         td::td_api::object_ptr<td::td_api::createPrivateChat> createChat =
             td::td_api::make_object<td::td_api::createPrivateChat>(userId.value(), false);
-        m_transceiver.sendQuery(std::move(createChat), &PurpleTdClient::loginCreatePrivateChatResponse);
+        m_transceiver.sendQuery(std::move(createChat), &PurpleTdClient::loginCreatePrivateChatResponse,
+                                TdTransceiver::Priority::Background);
     }
 }
 
@@ -797,7 +860,8 @@ void PurpleTdClient::requestBasicGroupFullInfo(BasicGroupId groupId)
     if (!m_data.isBasicGroupInfoRequested(groupId)) {
         m_data.setBasicGroupInfoRequested(groupId);
         uint64_t requestId = m_transceiver.sendQuery(td::td_api::make_object<td::td_api::getBasicGroupFullInfo>(groupId.value()),
-                                                     &PurpleTdClient::groupInfoResponse);
+                                                     &PurpleTdClient::groupInfoResponse,
+                                                     TdTransceiver::Priority::Background);
         m_data.addPendingRequest<GroupInfoRequest>(requestId, groupId);
     }
 }
@@ -807,14 +871,16 @@ void PurpleTdClient::requestSupergroupFullInfo(SupergroupId groupId)
     if (!m_data.isSupergroupInfoRequested(groupId)) {
         m_data.setSupergroupInfoRequested(groupId);
         uint64_t requestId = m_transceiver.sendQuery(td::td_api::make_object<td::td_api::getSupergroupFullInfo>(groupId.value()),
-                                                     &PurpleTdClient::supergroupInfoResponse);
+                                                     &PurpleTdClient::supergroupInfoResponse,
+                                                     TdTransceiver::Priority::Background);
         m_data.addPendingRequest<SupergroupInfoRequest>(requestId, groupId);
 
         auto getMembersReq = td::td_api::make_object<td::td_api::getSupergroupMembers>();
         getMembersReq->supergroup_id_ = groupId.value();
         getMembersReq->filter_ = td::td_api::make_object<td::td_api::supergroupMembersFilterRecent>();
         getMembersReq->limit_ = SUPERGROUP_MEMBER_LIMIT;
-        requestId = m_transceiver.sendQuery(std::move(getMembersReq), &PurpleTdClient::supergroupMembersResponse);
+        requestId = m_transceiver.sendQuery(std::move(getMembersReq), &PurpleTdClient::supergroupMembersResponse,
+                                            TdTransceiver::Priority::Background);
         m_data.addPendingRequest<SupergroupInfoRequest>(requestId, groupId);
     }
 }
@@ -883,7 +949,7 @@ void PurpleTdClient::supergroupAdministratorsResponse(uint64_t requestId, td::td
             }
         }
 
-        const td::td_api::chat *chat = m_data.getSupergroupChatByGroup(request->groupId);
+        const TgChat *chat = m_data.getSupergroupChatByGroup(request->groupId);
         if (chat) {
             PurpleConvChat *purpleChat = findChatConversation(m_account, *chat);
             if (purpleChat)
@@ -896,7 +962,7 @@ void PurpleTdClient::supergroupAdministratorsResponse(uint64_t requestId, td::td
 
 void PurpleTdClient::updateGroupFull(BasicGroupId groupId, td::td_api::object_ptr<td::td_api::basicGroupFullInfo> groupInfo)
 {
-    const td::td_api::chat *chat = m_data.getBasicGroupChatByGroup(groupId);
+    const TgChat *chat = m_data.getBasicGroupChatByGroup(groupId);
 
     if (chat) {
         PurpleConvChat *purpleChat = findChatConversation(m_account, *chat);
@@ -909,7 +975,7 @@ void PurpleTdClient::updateGroupFull(BasicGroupId groupId, td::td_api::object_pt
 
 void PurpleTdClient::updateSupergroupFull(SupergroupId groupId, td::td_api::object_ptr<td::td_api::supergroupFullInfo> groupInfo)
 {
-    const td::td_api::chat *chat = m_data.getSupergroupChatByGroup(groupId);
+    const TgChat *chat = m_data.getSupergroupChatByGroup(groupId);
 
     if (chat) {
         PurpleConvChat *purpleChat = findChatConversation(m_account, *chat);
@@ -923,15 +989,15 @@ void PurpleTdClient::updateSupergroupFull(SupergroupId groupId, td::td_api::obje
 void PurpleTdClient::onChatListReady()
 {
     m_chatListReady = true;
-    std::vector<const td::td_api::chat *> chats;
+    std::vector<const TgChat *> chats;
     m_data.getChats(chats);
 
-    for (const td::td_api::chat *chat: chats) {
-        const td::td_api::user *user = m_data.getUserByPrivateChat(*chat);
+    for (const TgChat *chat: chats) {
+        const TgUser *user = m_data.getUserByPrivateChat(*chat);
         if (user && isChatInContactList(*chat, user)) {
             std::string userName = getPurpleBuddyName(*user);
             purple_prpl_got_user_status(m_account, userName.c_str(),
-                                        getPurpleStatusId(*user->status_), NULL);
+                                        getPurpleStatusId(*user->status), NULL);
         }
     }
 
@@ -944,7 +1010,7 @@ void PurpleTdClient::onChatListReady()
     // Here we could remove buddies for which no private chat exists, meaning they have been remove
     // from the contact list perhaps in another client
 
-    const td::td_api::user *selfInfo = m_data.getUserByPhone(purple_account_get_username(m_account));
+    const TgUser *selfInfo = m_data.getUserByPhone(purple_account_get_username(m_account));
     if (selfInfo != nullptr) {
         std::string alias = makeBasicDisplayName(*selfInfo);
         purple_debug_misc(config::pluginId, "Setting own alias to '%s'\n", alias.c_str());
@@ -954,13 +1020,14 @@ void PurpleTdClient::onChatListReady()
             purple_account_get_username(m_account));
 
     purple_blist_add_account(m_account);
+    scheduleChatGapRecovery(m_data);
 }
 
 void PurpleTdClient::onAnimatedStickerConverted(AccountThread *arg)
 {
     std::unique_ptr<AccountThread> baseThread(arg);
     StickerConversionThread *thread = dynamic_cast<StickerConversionThread *>(arg);
-    const td::td_api::chat  *chat   = thread ? m_data.getChat(thread->chatId) : nullptr;
+    const TgChat            *chat   = thread ? m_data.getChat(thread->chatId) : nullptr;
     if (!chat || !thread)
         return;
     IncomingMessage *pendingMessage = m_data.pendingMessages.findPendingMessage(getId(*chat), thread->message().id);
@@ -980,7 +1047,8 @@ void PurpleTdClient::onAnimatedStickerConverted(AccountThread *arg)
             g_error_free(error);
         } else
             success = true;
-        remove(thread->getOutputFileName().c_str());
+        if (!thread->isOutputCached())
+            remove(thread->getOutputFileName().c_str());
     }
 
     if (success) {
@@ -1024,19 +1092,9 @@ void PurpleTdClient::onIncomingMessage(td::td_api::object_ptr<td::td_api::messag
         return;
     ChatId chatId = getChatId(*message);
 
-    auto pGap = std::find_if(m_chatGaps.begin(), m_chatGaps.end(),
-                             [chatId](const ChatGap &gap) { return (gap.chatId == chatId); });
-    if (pGap != m_chatGaps.end()) {
-        MessageId lastMessageId = pGap->lastMessage;
-        m_chatGaps.erase(pGap);
-        purple_debug_misc(config::pluginId,
-            "Fetching skipped messages for chat %" G_GINT64_FORMAT
-            " between %" G_GINT64_FORMAT " and %" G_GINT64_FORMAT "\n",
-            chatId.value(), lastMessageId.value(), getId(*message).value());
-        fetchHistory(m_data, chatId, getId(*message), lastMessageId);
-    }
+    onChatGapMessage(m_data, chatId, getId(*message));
 
-    const td::td_api::chat *chat = m_data.getChat(chatId);
+    const TgChat *chat = m_data.getChat(chatId);
     if (!chat) {
         purple_debug_warning(config::pluginId, "Received message with unknown chat id %" G_GINT64_FORMAT "\n",
                             message->chat_id_);
@@ -1060,14 +1118,8 @@ void PurpleTdClient::updateChatLastMessage(td::td_api::updateChatLastMessage &la
                 "Skipped messages detected for chat %" G_GINT64_FORMAT
                 ", last seen message %" G_GINT64_FORMAT "\n",
                 chatId.value(), lastMessageId.value());
-            if (std::find_if(m_chatGaps.begin(), m_chatGaps.end(),
-                             [chatId](const ChatGap &gap) {
-                                 return (gap.chatId == chatId);
-                             }) == m_chatGaps.end()) {
-                m_chatGaps.emplace_back();
-                m_chatGaps.back().chatId = chatId;
-                m_chatGaps.back().lastMessage = lastMessageId;
-            }
+            if (m_data.addChatGap(chatId, lastMessageId) && m_chatListReady)
+                scheduleChatGapRecovery(m_data);
         }
     }
 }
@@ -1075,8 +1127,8 @@ void PurpleTdClient::updateChatLastMessage(td::td_api::updateChatLastMessage &la
 int PurpleTdClient::sendMessage(const char *buddyName, const char *message)
 {
     SecretChatId secretChatId           = purpleBuddyNameToSecretChatId(buddyName);
-    const td::td_api::user *privateUser = nullptr;
-    const td::td_api::chat *chat        = nullptr;
+    const TgUser *privateUser = nullptr;
+    const TgChat *chat        = nullptr;
 
     if (secretChatId.valid()) {
         chat = m_data.getChatBySecretChat(secretChatId);
@@ -1085,7 +1137,7 @@ int PurpleTdClient::sendMessage(const char *buddyName, const char *message)
             return -1;
         }
     } else {
-        std::vector<const td::td_api::user *> users = getUsersByPurpleName(buddyName, m_data, "send message");
+        std::vector<const TgUser *> users = getUsersByPurpleName(buddyName, m_data, "send message");
         if (users.size() != 1) {
             // Unlikely error messages not worth translating
             std::string errorMessage;
@@ -1107,9 +1159,9 @@ int PurpleTdClient::sendMessage(const char *buddyName, const char *message)
         // Message shall not be echoed: tdlib will shortly present it as a new message and it will be displayed then
         return 0;
     } else if (privateUser) {
-        purpleDebug("Requesting private chat for user id {}", privateUser->id_);
+        purpleDebug("Requesting private chat for user id {}", privateUser->id.value());
         td::td_api::object_ptr<td::td_api::createPrivateChat> createChat =
-            td::td_api::make_object<td::td_api::createPrivateChat>(privateUser->id_, false);
+            td::td_api::make_object<td::td_api::createPrivateChat>(privateUser->id.value(), false);
         uint64_t requestId = m_transceiver.sendQuery(std::move(createChat), &PurpleTdClient::sendMessageCreatePrivateChatResponse);
         m_data.addPendingRequest<NewPrivateChatForMessage>(requestId, buddyName, message);
         return 0;
@@ -1131,7 +1183,7 @@ void PurpleTdClient::sendMessageResponse(uint64_t requestId, td::td_api::object_
     } else {
         // TRANSLATOR: In-chat error message, argument will be a user-sent message
         std::string errorMessage = formatMessage(_("Failed to send message: {}"), getDisplayedError(object));
-        const td::td_api::chat *chat = m_data.getChat(request->chatId);
+        const TgChat *chat = m_data.getChat(request->chatId);
         if (chat)
             showChatNotification(m_data, *chat, errorMessage.c_str());
     }
@@ -1139,19 +1191,19 @@ void PurpleTdClient::sendMessageResponse(uint64_t requestId, td::td_api::object_
 
 void PurpleTdClient::sendTyping(const char *buddyName, bool isTyping)
 {
-    const td::td_api::chat *chat = nullptr;
+    const TgChat *chat = nullptr;
     SecretChatId secretChatId = purpleBuddyNameToSecretChatId(buddyName);
     if (secretChatId.valid())
         chat = m_data.getChatBySecretChat(secretChatId);
     else {
-        std::vector<const td::td_api::user *> users = getUsersByPurpleName(buddyName, m_data, "send typing notification");
+        std::vector<const TgUser *> users = getUsersByPurpleName(buddyName, m_data, "send typing notification");
         if (users.size() == 1)
             chat = m_data.getPrivateChatByUserId(getId(*users[0]));
     }
 
     if (chat) {
         auto sendAction = td::td_api::make_object<td::td_api::sendChatAction>();
-        sendAction->chat_id_ = chat->id_;
+        sendAction->chat_id_ = chat->id.value();
         if (isTyping)
             sendAction->action_ = td::td_api::make_object<td::td_api::chatActionTyping>();
         else
@@ -1162,7 +1214,7 @@ void PurpleTdClient::sendTyping(const char *buddyName, bool isTyping)
 
 void PurpleTdClient::updateUserStatus(UserId userId, td::td_api::object_ptr<td::td_api::UserStatus> status)
 {
-    const td::td_api::user *user = m_data.getUser(userId);
+    const TgUser *user = m_data.getUser(userId);
     if (user) {
         std::string userName = getPurpleBuddyName(*user);
         purple_prpl_got_user_status(m_account, userName.c_str(), getPurpleStatusId(*status), NULL);
@@ -1185,8 +1237,8 @@ void PurpleTdClient::updateUser(td::td_api::object_ptr<td::td_api::user> userInf
     // Updates are only supposed to come after authorizationStateReady which sets account to connected.
     // But check purple_account_is_connected just in case.
     if (purple_account_is_connected(m_account)) {
-        const td::td_api::user *user = m_data.getUser(userId);
-        const td::td_api::chat *chat = m_data.getPrivateChatByUserId(userId);
+        const TgUser *user = m_data.getUser(userId);
+        const TgChat *chat = m_data.getPrivateChatByUserId(userId);
 
         if (user)
             updateUserInfo(*user, chat);
@@ -1200,16 +1252,16 @@ static bool shouldDownloadAvatar(const td::td_api::file &file)
             file.local_->can_be_downloaded_);
 }
 
-void PurpleTdClient::downloadProfilePhoto(const td::td_api::user &user)
+void PurpleTdClient::downloadProfilePhoto(const TgUser &user)
 {
-    if (user.profile_photo_ && user.profile_photo_->small_ &&
-        shouldDownloadAvatar(*user.profile_photo_->small_))
+    if (user.smallPhoto && shouldDownloadAvatar(*user.smallPhoto))
     {
         auto downloadReq = td::td_api::make_object<td::td_api::downloadFile>();
-        downloadReq->file_id_ = user.profile_photo_->small_->id_;
+        downloadReq->file_id_ = user.smallPhoto->id_;
         downloadReq->priority_ = FILE_DOWNLOAD_PRIORITY;
         downloadReq->synchronous_ = true;
-        uint64_t queryId = m_transceiver.sendQuery(std::move(downloadReq), &PurpleTdClient::avatarDownloadResponse);
+        uint64_t queryId = m_transceiver.sendQuery(std::move(downloadReq), &PurpleTdClient::avatarDownloadResponse,
+                                                   TdTransceiver::Priority::Download);
         m_data.addPendingRequest<AvatarDownloadRequest>(queryId, &user);
     }
 }
@@ -1222,13 +1274,13 @@ void PurpleTdClient::avatarDownloadResponse(uint64_t requestId, td::td_api::obje
         if (file->local_ && file->local_->is_downloading_completed_) {
             if (request->userId.valid()) {
                 m_data.updateSmallProfilePhoto(request->userId, std::move(file));
-                const td::td_api::user *user = m_data.getUser(request->userId);
-                const td::td_api::chat *chat = m_data.getPrivateChatByUserId(request->userId);
+                const TgUser *user = m_data.getUser(request->userId);
+                const TgChat *chat = m_data.getPrivateChatByUserId(request->userId);
                 if (user && chat && isChatInContactList(*chat, user))
                     updatePrivateChat(m_data, chat, *user);
             } else if (request->chatId.valid()) {
                 m_data.updateSmallChatPhoto(request->chatId, std::move(file));
-                const td::td_api::chat *chat = m_data.getPrivateChatByUserId(request->userId);
+                const TgChat *chat = m_data.getPrivateChatByUserId(request->userId);
                 if (chat && isChatInContactList(*chat, nullptr)) {
                     BasicGroupId basicGroupId = getBasicGroupId(*chat);
                     SupergroupId supergroupId = getSupergroupId(*chat);
@@ -1276,16 +1328,16 @@ void PurpleTdClient::updateSupergroup(td::td_api::object_ptr<td::td_api::supergr
         updateSupergroupChat(m_data, id);
 }
 
-void PurpleTdClient::updateChat(const td::td_api::chat *chat)
+void PurpleTdClient::updateChat(const TgChat *chat)
 {
     if (!chat) return;
 
-    const td::td_api::user *privateChatUser = m_data.getUserByPrivateChat(*chat);
+    const TgUser *privateChatUser = m_data.getUserByPrivateChat(*chat);
     BasicGroupId            basicGroupId    = getBasicGroupId(*chat);
     SupergroupId            supergroupId    = getSupergroupId(*chat);
     SecretChatId            secretChatId    = getSecretChatId(*chat);
     purpleDebug("Update chat: {} private user={} basic group={} supergroup={}", {
-        std::to_string(chat->id_), std::to_string(privateChatUser ? privateChatUser->id_ : 0),
+        std::to_string(chat->id.value()), std::to_string(privateChatUser ? privateChatUser->id.value() : 0),
         std::to_string(basicGroupId.value()), std::to_string(supergroupId.value())
     });
 
@@ -1324,7 +1376,7 @@ void PurpleTdClient::updateChat(const td::td_api::chat *chat)
         updateKnownSecretChat(secretChatId, m_transceiver, m_data);
 }
 
-void PurpleTdClient::updateUserInfo(const td::td_api::user &user, const td::td_api::chat *privateChat)
+void PurpleTdClient::updateUserInfo(const TgUser &user, const TgChat *privateChat)
 {
     if (privateChat) {
         if (isChatInContactList(*privateChat, &user)) {
@@ -1339,21 +1391,22 @@ void PurpleTdClient::updateUserInfo(const td::td_api::user &user, const td::td_a
     std::vector<std::pair<BasicGroupId, const td::td_api::basicGroupFullInfo *>> groups;
     groups = m_data.getBasicGroupsWithMember(getId(user));
     for (const auto &groupInfo: groups) {
-        const td::td_api::chat *groupChat = m_data.getBasicGroupChatByGroup(groupInfo.first);
+        const TgChat *groupChat = m_data.getBasicGroupChatByGroup(groupInfo.first);
         PurpleConvChat *purpleChat = groupChat ? findChatConversation(m_account, *groupChat) : nullptr;
         if (purpleChat)
             updateChatConversation(purpleChat, *groupInfo.second, m_data);
     }
 }
 
-void PurpleTdClient::downloadChatPhoto(const td::td_api::chat &chat)
+void PurpleTdClient::downloadChatPhoto(const TgChat &chat)
 {
-    if (chat.photo_ && chat.photo_->small_ && shouldDownloadAvatar(*chat.photo_->small_)) {
+    if (chat.smallPhoto && shouldDownloadAvatar(*chat.smallPhoto)) {
         auto downloadReq = td::td_api::make_object<td::td_api::downloadFile>();
-        downloadReq->file_id_ = chat.photo_->small_->id_;
+        downloadReq->file_id_ = chat.smallPhoto->id_;
         downloadReq->priority_ = FILE_DOWNLOAD_PRIORITY;
         downloadReq->synchronous_ = true;
-        uint64_t queryId = m_transceiver.sendQuery(std::move(downloadReq), &PurpleTdClient::avatarDownloadResponse);
+        uint64_t queryId = m_transceiver.sendQuery(std::move(downloadReq), &PurpleTdClient::avatarDownloadResponse,
+                                                   TdTransceiver::Priority::Download);
         m_data.addPendingRequest<AvatarDownloadRequest>(queryId, &chat);
     }
 }
@@ -1373,7 +1426,7 @@ void PurpleTdClient::addChat(td::td_api::object_ptr<td::td_api::chat> chat)
 
 void PurpleTdClient::handleUserChatAction(const td::td_api::updateChatAction &updateChatAction)
 {
-    const td::td_api::chat *chat = m_data.getChat(getChatId(updateChatAction));
+    const TgChat *chat = m_data.getChat(getChatId(updateChatAction));
     if (!chat) {
         purple_debug_warning(config::pluginId, "Got user chat action for unknown chat %" G_GINT64_FORMAT "\n",
                              updateChatAction.chat_id_);
@@ -1410,7 +1463,7 @@ void PurpleTdClient::handleUserChatAction(const td::td_api::updateChatAction &up
 
 void PurpleTdClient::showUserChatAction(UserId userId, bool isTyping)
 {
-    const td::td_api::user *user = m_data.getUser(userId);
+    const TgUser *user = m_data.getUser(userId);
     if (user) {
         std::string userName = getPurpleBuddyName(*user);
         if (isTyping)
@@ -1452,7 +1505,7 @@ void PurpleTdClient::addContact(const std::string &purpleName, const std::string
         return;
     }
 
-    std::vector<const td::td_api::user *> users;
+    std::vector<const TgUser *> users;
     m_data.getUsersByDisplayName(purpleName.c_str(), users);
     if (users.size() > 1) {
         notifyFailedContactDeferred(formatMessage("More than one user known with name '{}'", purpleName));
@@ -1562,9 +1615,10 @@ void PurpleTdClient::addContactCreatePrivateChatResponse(uint64_t requestId, td:
         return;
 
     if (object && (object->get_id() == td::td_api::chat::ID)) {
-        const td::td_api::chat &chat = static_cast<const td::td_api::chat &>(*object);
-        const td::td_api::user *user = m_data.getUserByPrivateChat(chat);
-        if (user && !isChatInContactList(chat, user)) {
+        // updateNewChat about it has come before the response
+        const TgChat *chat = m_data.getChat(getId(static_cast<const td::td_api::chat &>(*object)));
+        const TgUser *user = chat ? m_data.getUserByPrivateChat(*chat) : nullptr;
+        if (user && !isChatInContactList(*chat, user)) {
             // Normally, the user will become a contact and this won't happen. But it does happen
             // when adding BotFather, for example. Nothing will be added to buddy list, so open chat
             // window just to make something happen.
@@ -1602,7 +1656,7 @@ void PurpleTdClient::renameContact(const char *buddyName, const char *newAlias)
 
 void PurpleTdClient::removeContactAndPrivateChat(const std::string &buddyName)
 {
-    const td::td_api::chat *chat         = nullptr;
+    const TgChat           *chat         = nullptr;
     UserId                  userId       = purpleBuddyNameToUserId(buddyName.c_str());
     SecretChatId            secretChatId = purpleBuddyNameToSecretChatId(buddyName.c_str());
 
@@ -1636,7 +1690,7 @@ void PurpleTdClient::removeContactAndPrivateChat(const std::string &buddyName)
     }
 }
 
-void PurpleTdClient::getUsers(const char *username, std::vector<const td::td_api::user *> &users)
+void PurpleTdClient::getUsers(const char *username, std::vector<const TgUser *> &users)
 {
     users = getUsersByPurpleName(username, m_data, NULL);
 }
@@ -1644,7 +1698,7 @@ void PurpleTdClient::getUsers(const char *username, std::vector<const td::td_api
 bool PurpleTdClient::joinChat(const char *chatName)
 {
     ChatId                  id       = getTdlibChatId(chatName);
-    const td::td_api::chat *chat     = m_data.getChat(id);
+    const TgChat           *chat     = m_data.getChat(id);
     int32_t                 purpleId = m_data.getPurpleChatId(id);
     PurpleConvChat         *conv     = NULL;
 
@@ -1663,7 +1717,7 @@ bool PurpleTdClient::joinChat(const char *chatName)
             purple_debug_warning(config::pluginId, "No telegram chat found for purple name %s\n", chatName);
     } else if (!m_data.isGroupChatWithMembership(*chat))
         purple_debug_warning(config::pluginId, "Chat %s (%s) is not a group we a member of\n",
-                             chatName, chat->title_.c_str());
+                             chatName, chat->title.c_str());
     else if (purpleId) {
         conv = getChatConversation(m_data, *chat, purpleId);
         if (conv)
@@ -1675,13 +1729,13 @@ bool PurpleTdClient::joinChat(const char *chatName)
 
 int PurpleTdClient::sendGroupMessage(int purpleChatId, const char *message)
 {
-    const td::td_api::chat *chat = m_data.getChatByPurpleId(purpleChatId);
+    const TgChat *chat = m_data.getChatByPurpleId(purpleChatId);
 
     if (!chat)
         purple_debug_warning(config::pluginId, "No chat found for purple id %d\n", purpleChatId);
     else if (!m_data.isGroupChatWithMembership(*chat))
         purple_debug_misc(config::pluginId, "purple id %d (chat %s) is not a group we a member of\n",
-                             purpleChatId, chat->title_.c_str());
+                             purpleChatId, chat->title.c_str());
     else {
         int ret = transmitMessage(getId(*chat), message, m_transceiver, m_data, &PurpleTdClient::sendMessageResponse);
         if (ret < 0)
@@ -1725,7 +1779,7 @@ void PurpleTdClient::joinChatResponse(uint64_t requestId, td::td_api::object_ptr
             // will happen automatically due to messageChatJoinByLink message. If joining a public
             // group, conversation window needs to be created explicitly instead
             if (request->type != GroupJoinRequest::Type::InviteLink) {
-                const td::td_api::chat *chat     = m_data.getChat(request->chatId);
+                const TgChat           *chat     = m_data.getChat(request->chatId);
                 int32_t                 purpleId = m_data.getPurpleChatId(request->chatId);
                 if (chat)
                     getChatConversation(m_data, *chat, purpleId);
@@ -1792,7 +1846,7 @@ void PurpleTdClient::createGroup(const char *name, int type,
                     errorMessage = formatMessage(_("No known user with id {}"), userId);
                 }
             } else {
-                std::vector<const td::td_api::user*> users;
+                std::vector<const TgUser*> users;
                 m_data.getUsersByDisplayName(memberName.c_str(), users);
                 if (users.size() == 1)
                     userId = getId(*users[0]);
@@ -1838,7 +1892,7 @@ void PurpleTdClient::createGroup(const char *name, int type,
 BasicGroupMembership PurpleTdClient::getBasicGroupMembership(const char *purpleChatName)
 {
     ChatId                        chatId     = getTdlibChatId(purpleChatName);
-    const td::td_api::chat       *chat       = chatId.valid() ? m_data.getChat(chatId) : nullptr;
+    const TgChat                 *chat       = chatId.valid() ? m_data.getChat(chatId) : nullptr;
     BasicGroupId                  groupId    = chat ? getBasicGroupId(*chat) : BasicGroupId::invalid;
     const td::td_api::basicGroup *basicGroup = groupId.valid() ? m_data.getBasicGroup(groupId) : nullptr;
 
@@ -1854,7 +1908,7 @@ BasicGroupMembership PurpleTdClient::getBasicGroupMembership(const char *purpleC
 void PurpleTdClient::leaveGroup(const std::string &purpleChatName, bool deleteSupergroup)
 {
     ChatId                  chatId = getTdlibChatId(purpleChatName.c_str());
-    const td::td_api::chat *chat   = chatId.valid() ? m_data.getChat(chatId) : nullptr;
+    const TgChat           *chat   = chatId.valid() ? m_data.getChat(chatId) : nullptr;
     if (!chat) return;
 
     SupergroupId supergroupId = getSupergroupId(*chat);
@@ -1884,7 +1938,7 @@ void PurpleTdClient::deleteSupergroupResponse(uint64_t requestId, td::td_api::ob
 
 void PurpleTdClient::setGroupDescription(int purpleChatId, const char *description)
 {
-    const td::td_api::chat *chat = m_data.getChatByPurpleId(purpleChatId);
+    const TgChat *chat = m_data.getChatByPurpleId(purpleChatId);
     if (!chat) {
         purple_debug_warning(config::pluginId, "Unknown libpurple chat id %d\n", purpleChatId);
         return;
@@ -1892,7 +1946,7 @@ void PurpleTdClient::setGroupDescription(int purpleChatId, const char *descripti
 
     if (getBasicGroupId(*chat).valid() || getSupergroupId(*chat).valid()) {
         auto request = td::td_api::make_object<td::td_api::setChatDescription>();
-        request->chat_id_ = chat->id_;
+        request->chat_id_ = chat->id.value();
         request->description_ =  description ? description : "";
         m_transceiver.sendQuery(std::move(request), &PurpleTdClient::setGroupDescriptionResponse);
     }
@@ -1912,7 +1966,7 @@ void PurpleTdClient::setGroupDescriptionResponse(uint64_t requestId, td::td_api:
 void PurpleTdClient::kickUserFromChat(PurpleConversation *conv, const char *name)
 {
     int purpleChatId = purple_conv_chat_get_id(PURPLE_CONV_CHAT(conv));
-    const td::td_api::chat *chat = m_data.getChatByPurpleId(purpleChatId);
+    const TgChat *chat = m_data.getChatByPurpleId(purpleChatId);
 
     if (!chat) {
         // Unlikely error message not worth translating
@@ -1920,7 +1974,7 @@ void PurpleTdClient::kickUserFromChat(PurpleConversation *conv, const char *name
         return;
     }
 
-    std::vector<const td::td_api::user *> users = getUsersByPurpleName(name, m_data, "kick user");
+    std::vector<const TgUser *> users = getUsersByPurpleName(name, m_data, "kick user");
     if (users.size() != 1) {
         // TRANSLATOR: In-chat error message, appears after a colon (':')
         const char *reason = users.empty() ? _("User not found") :
@@ -1933,8 +1987,8 @@ void PurpleTdClient::kickUserFromChat(PurpleConversation *conv, const char *name
     }
 
     auto setStatusRequest = td::td_api::make_object<td::td_api::setChatMemberStatus>();
-    setStatusRequest->chat_id_ = chat->id_;
-    setStatusRequest->member_id_ = td::td_api::make_object<td::td_api::messageSenderUser>(users[0]->id_);
+    setStatusRequest->chat_id_ = chat->id.value();
+    setStatusRequest->member_id_ = td::td_api::make_object<td::td_api::messageSenderUser>(users[0]->id.value());
     setStatusRequest->status_ = td::td_api::make_object<td::td_api::chatMemberStatusLeft>();
 
     uint64_t requestId = m_transceiver.sendQuery(std::move(setStatusRequest), &PurpleTdClient::chatActionResponse);
@@ -1958,7 +2012,7 @@ void PurpleTdClient::chatActionResponse(uint64_t requestId, td::td_api::object_p
     }
 
     if (!object || (object->get_id() != expectedId)) {
-        const td::td_api::chat *chat = request ? m_data.getChat(request->chatId) : nullptr;
+        const TgChat *chat = request ? m_data.getChat(request->chatId) : nullptr;
         if (chat) {
             std::string message = getDisplayedError(object);
             switch (request->type) {
@@ -1980,7 +2034,7 @@ void PurpleTdClient::chatActionResponse(uint64_t requestId, td::td_api::object_p
     } else {
         if (request->type == ChatActionRequest::Type::GenerateInviteLink) {
             const td::td_api::chatInviteLink &inviteLink = static_cast<const td::td_api::chatInviteLink &>(*object);
-            const td::td_api::chat *chat = request ? m_data.getChat(request->chatId) : nullptr;
+            const TgChat *chat = request ? m_data.getChat(request->chatId) : nullptr;
             if (chat)
                 showChatNotification(m_data, *chat, inviteLink.invite_link_.c_str());
         }
@@ -1989,13 +2043,13 @@ void PurpleTdClient::chatActionResponse(uint64_t requestId, td::td_api::object_p
 
 void PurpleTdClient::addUserToChat(int purpleChatId, const char *name)
 {
-    const td::td_api::chat *chat = m_data.getChatByPurpleId(purpleChatId);
+    const TgChat *chat = m_data.getChatByPurpleId(purpleChatId);
     if (!chat) {
         purple_debug_warning(config::pluginId, "Unknown libpurple chat id %d\n", purpleChatId);
         return;
     }
 
-    std::vector<const td::td_api::user *> users = getUsersByPurpleName(name, m_data, "kick user");
+    std::vector<const TgUser *> users = getUsersByPurpleName(name, m_data, "kick user");
     if (users.size() != 1) {
         // TRANSLATOR: In-chat error message, appears after a colon (':')
         const char *reason = users.empty() ? _("User not found") :
@@ -2009,8 +2063,8 @@ void PurpleTdClient::addUserToChat(int purpleChatId, const char *name)
 
     if (getBasicGroupId(*chat).valid() || getSupergroupId(*chat).valid()) {
         auto request = td::td_api::make_object<td::td_api::addChatMember>();
-        request->chat_id_ = chat->id_;
-        request->user_id_ = users[0]->id_;
+        request->chat_id_ = chat->id.value();
+        request->user_id_ = users[0]->id.value();
         uint64_t requestId = m_transceiver.sendQuery(std::move(request), &PurpleTdClient::chatActionResponse);
         m_data.addPendingRequest<ChatActionRequest>(requestId, ChatActionRequest::Type::Invite, getId(*chat));
     }
@@ -2019,7 +2073,7 @@ void PurpleTdClient::addUserToChat(int purpleChatId, const char *name)
 void PurpleTdClient::showInviteLink(const std::string& purpleChatName)
 {
     ChatId                  chatId = getTdlibChatId(purpleChatName.c_str());
-    const td::td_api::chat *chat   = chatId.valid() ? m_data.getChat(chatId) : nullptr;
+    const TgChat           *chat   = chatId.valid() ? m_data.getChat(chatId) : nullptr;
     if (!chat) {
         purple_debug_warning(config::pluginId, "chat %s not found\n", purpleChatName.c_str());
         return;
@@ -2046,7 +2100,7 @@ void PurpleTdClient::showInviteLink(const std::string& purpleChatName)
         showChatNotification(m_data, *chat, inviteLink.c_str());
     else if (fullInfoKnown) {
         auto linkRequest = td::td_api::make_object<td::td_api::createChatInviteLink>();
-        linkRequest->chat_id_ = chat->id_;
+        linkRequest->chat_id_ = chat->id.value();
         uint64_t requestId = m_transceiver.sendQuery(std::move(linkRequest), &PurpleTdClient::chatActionResponse);
         m_data.addPendingRequest<ChatActionRequest>(requestId, ChatActionRequest::Type::GenerateInviteLink, getId(*chat));
     } else
@@ -2069,7 +2123,7 @@ void PurpleTdClient::getGroupChatList(PurpleRoomlist *roomlist)
 
     purple_roomlist_set_in_progress(roomlist, TRUE);
     if (m_chatListReady) {
-        std::vector<const td::td_api::chat *> chats;
+        std::vector<const TgChat *> chats;
         m_data.getChats(chats);
         populateGroupChatList(roomlist, chats, m_data);
     } else {
@@ -2087,6 +2141,16 @@ void PurpleTdClient::removeTempFile(int64_t messageId)
     }
 }
 
+void PurpleTdClient::showStatistics()
+{
+    std::string statistics = m_transceiver.getStatistics();
+    // TRANSLATOR: Performance statistics dialog, title
+    purple_notify_info(m_account, _("Performance statistics"),
+                       // TRANSLATOR: Performance statistics dialog, primary content
+                       _("Request latency and update processing time"),
+                       statistics.c_str());
+}
+
 void PurpleTdClient::setTwoFactorAuth(const char *oldPassword, const char *newPassword,
                                     const char *hint, const char *email)
 {
@@ -2205,15 +2269,15 @@ void PurpleTdClient::sendFileToChat(PurpleXfer *xfer, const char *purpleName,
                                     PurpleConversationType type, int purpleChatId)
 {
     const char *filename = purple_xfer_get_local_filename(xfer);
-    const td::td_api::user *privateUser = nullptr;
-    const td::td_api::chat *chat        = nullptr;
+    const TgUser *privateUser = nullptr;
+    const TgChat *chat        = nullptr;
 
     if (type == PURPLE_CONV_TYPE_IM) {
         SecretChatId secretChatId = purpleBuddyNameToSecretChatId(purpleName);
         if (secretChatId.valid())
             chat = m_data.getChatBySecretChat(secretChatId);
         else {
-            std::vector<const td::td_api::user *> users = getUsersByPurpleName(purpleName, m_data, "send message");
+            std::vector<const TgUser *> users = getUsersByPurpleName(purpleName, m_data, "send message");
             if (users.size() == 1) {
                 privateUser = users[0];
                 chat = m_data.getPrivateChatByUserId(getId(*privateUser));
@@ -2225,9 +2289,9 @@ void PurpleTdClient::sendFileToChat(PurpleXfer *xfer, const char *purpleName,
     if (filename && chat)
         startDocumentUpload(getId(*chat), filename, xfer, m_transceiver, m_data, &PurpleTdClient::uploadResponse);
     else if (filename && privateUser) {
-        purple_debug_misc(config::pluginId, "Requesting private chat for user id %d\n", (int)privateUser->id_);
+        purple_debug_misc(config::pluginId, "Requesting private chat for user id %d\n", (int)privateUser->id.value());
         td::td_api::object_ptr<td::td_api::createPrivateChat> createChat =
-            td::td_api::make_object<td::td_api::createPrivateChat>(privateUser->id_, false);
+            td::td_api::make_object<td::td_api::createPrivateChat>(privateUser->id.value(), false);
         uint64_t requestId = m_transceiver.sendQuery(std::move(createChat), &PurpleTdClient::sendMessageCreatePrivateChatResponse);
         purple_xfer_ref(xfer);
         m_data.addPendingRequest<NewPrivateChatForMessage>(requestId, purpleName, xfer);
@@ -2327,7 +2391,7 @@ void PurpleTdClient::cancelUpload(PurpleXfer *xfer)
 
 bool PurpleTdClient::startVoiceCall(const char *buddyName)
 {
-    std::vector<const td::td_api::user *> users = getUsersByPurpleName(buddyName, m_data, "start voice call");
+    std::vector<const TgUser *> users = getUsersByPurpleName(buddyName, m_data, "start voice call");
     if (users.size() != 1) {
         // Unlikely error messages not worth translating
         std::string errorMessage;
@@ -2339,7 +2403,7 @@ bool PurpleTdClient::startVoiceCall(const char *buddyName)
         return false;
     }
 
-    return initiateCall(users.front()->id_, m_data, m_transceiver);
+    return initiateCall(users.front()->id.value(), m_data, m_transceiver);
 }
 
 bool PurpleTdClient::terminateCall(PurpleConversation *conv)
@@ -2353,7 +2417,7 @@ bool PurpleTdClient::terminateCall(PurpleConversation *conv)
 
 void PurpleTdClient::createSecretChat(const char* buddyName)
 {
-    std::vector<const td::td_api::user *> users = getUsersByPurpleName(buddyName, m_data, "create secret chat");
+    std::vector<const TgUser *> users = getUsersByPurpleName(buddyName, m_data, "create secret chat");
     if (users.size() != 1) {
         // Unlikely error messages not worth translating
         const char *reason = users.empty() ? "User not found" :
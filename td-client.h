@@ -27,7 +27,7 @@ public:
     void addContact(const std::string &purpleName, const std::string &alias, const std::string &groupName);
     void renameContact(const char *buddyName, const char *newAlias);
     void removeContactAndPrivateChat(const std::string &buddyName);
-    void getUsers(const char *username, std::vector<const td::td_api::user *> &users);
+    void getUsers(const char *username, std::vector<const TgUser *> &users);
 
     bool joinChat(const char *chatName);
     void joinChatByInviteLink(const char *inviteLink);
@@ -53,11 +53,13 @@ public:
     bool terminateCall(PurpleConversation *conv);
 
     void createSecretChat(const char *buddyName);
+    void showStatistics();
 private:
     using TdObjectPtr   = td::td_api::object_ptr<td::td_api::Object>;
     using ResponseCb    = void (PurpleTdClient::*)(uint64_t requestId, TdObjectPtr object);
 
     void       processUpdate(td::td_api::Object &object);
+    void       onUpdateSliceDone();
     void       processAuthorizationState(td::td_api::AuthorizationState &authState);
 
     // Login sequence start
@@ -100,13 +102,13 @@ private:
 
     void       updateUserStatus(UserId userId, td::td_api::object_ptr<td::td_api::UserStatus> status);
     void       updateUser(td::td_api::object_ptr<td::td_api::user> user);
-    void       downloadProfilePhoto(const td::td_api::user &user);
+    void       downloadProfilePhoto(const TgUser &user);
     void       avatarDownloadResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
     void       updateGroup(td::td_api::object_ptr<td::td_api::basicGroup> group);
     void       updateSupergroup(td::td_api::object_ptr<td::td_api::supergroup> group);
-    void       updateChat(const td::td_api::chat *chat);
-    void       updateUserInfo(const td::td_api::user &user, const td::td_api::chat *privateChat);
-    void       downloadChatPhoto(const td::td_api::chat &chat);
+    void       updateChat(const TgChat *chat);
+    void       updateUserInfo(const TgUser &user, const TgChat *privateChat);
+    void       downloadChatPhoto(const TgChat &chat);
     void       requestBasicGroupFullInfo(BasicGroupId groupId);
     void       requestSupergroupFullInfo(SupergroupId groupId);
     void       groupInfoResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
@@ -154,12 +156,6 @@ private:
     std::vector<PurpleRoomlist *>               m_pendingRoomLists;
     td::td_api::object_ptr<td::td_api::proxy>   m_addedProxy;
     td::td_api::object_ptr<td::td_api::proxies> m_proxies;
-
-    struct ChatGap {
-        ChatId    chatId;
-        MessageId lastMessage;
-    };
-    std::vector<ChatGap> m_chatGaps;
 };
 
 #endif
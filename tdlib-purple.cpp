@@ -58,11 +58,11 @@ static void tgprpl_tooltip_text (PurpleBuddy *buddy, PurpleNotifyUserInfo *info,
     PurpleTdClient *tdClient = getTdClient(purple_buddy_get_account(buddy));
     if (!tdClient) return;
 
-    std::vector<const td::td_api::user *> users;
+    std::vector<const TgUser *> users;
     tdClient->getUsers(purple_buddy_get_name(buddy), users);
 
-    if ((users.size() == 1) && users[0]->status_) {
-        const char *lastOnline = getLastOnline(*users[0]->status_);
+    if ((users.size() == 1) && users[0]->status) {
+        const char *lastOnline = getLastOnline(*users[0]->status);
         if (lastOnline && *lastOnline) {
             // TRANSLATOR: Buddy infobox, key
             purple_notify_user_info_add_pair(info, _("Last online"), lastOnline);
@@ -357,7 +357,7 @@ static unsigned int tgprpl_send_typing (PurpleConnection *gc, const char *who, P
 static void tgprpl_info_show (PurpleConnection *gc, const char *who)
 {
     PurpleTdClient *tdClient = static_cast<PurpleTdClient *>(purple_connection_get_protocol_data(gc));
-    std::vector<const td::td_api::user *> users;
+    std::vector<const TgUser *> users;
     tdClient->getUsers(who, users);
 
     PurpleNotifyUserInfo *info = purple_notify_user_info_new();
@@ -366,29 +366,27 @@ static void tgprpl_info_show (PurpleConnection *gc, const char *who)
         purple_notify_user_info_add_pair(info, _("User not found"), NULL);
     }
 
-    for (const td::td_api::user *user: users) {
+    for (const TgUser *user: users) {
         if (purple_notify_user_info_get_entries(info))
             purple_notify_user_info_add_section_break(info);
 
         // TRANSLATOR: Buddy infobox, key
-        purple_notify_user_info_add_pair(info, _("First name"), user->first_name_.c_str());
+        purple_notify_user_info_add_pair(info, _("First name"), user->firstName.c_str());
         // TRANSLATOR: Buddy infobox, key
-        purple_notify_user_info_add_pair(info, _("Last name"), user->last_name_.c_str());
-        if (user->usernames_ != nullptr) {
-            for (auto &username : user->usernames_->active_usernames_) {
-                if (!username.empty()) {
-                    // TRANSLATOR: Buddy infobox, key
-                    purple_notify_user_info_add_pair(info, _("Username"), username.c_str());
-                }
+        purple_notify_user_info_add_pair(info, _("Last name"), user->lastName.c_str());
+        for (const InternedString &username : user->usernames) {
+            if (!username.empty()) {
+                // TRANSLATOR: Buddy infobox, key
+                purple_notify_user_info_add_pair(info, _("Username"), username.c_str());
             }
         }
 
-        if (!user->phone_number_.empty()) {
+        if (!user->phoneNumber.empty()) {
             // TRANSLATOR: Buddy infobox, key
-            purple_notify_user_info_add_pair(info, _("Phone number"), user->phone_number_.c_str());
+            purple_notify_user_info_add_pair(info, _("Phone number"), user->phoneNumber.c_str());
         }
-        if (user->status_) {
-            const char *lastOnline = getLastOnline(*user->status_);
+        if (user->status) {
+            const char *lastOnline = getLastOnline(*user->status);
             if (lastOnline && *lastOnline) {
                 // TRANSLATOR: Buddy infobox, key
                 purple_notify_user_info_add_pair(info, _("Last online"), lastOnline);
@@ -907,6 +905,12 @@ static gboolean tgprpl_load (PurplePlugin *plugin)
     return TRUE;
 }
 
+static void tgprpl_destroy (PurplePlugin *plugin)
+{
+    // Worker threads must not outlive the plugin, or the static data they use
+    AccountThread::shutdown();
+}
+
 static void addChoice(GList *&choices, const char *description, const char *value)
 {
     PurpleKeyValuePair *kvp = g_new0(PurpleKeyValuePair, 1);
@@ -1023,6 +1027,20 @@ static void tgprpl_init (PurplePlugin *plugin)
     opt = purple_account_option_bool_new(_("Show animated stickers"), AccountOptions::AnimatedStickers,
                                          AccountOptions::AnimatedStickersDefault);
     prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+
+#ifndef NoWebp
+    static_assert(AccountOptions::AnimatedStickerFormatDefault == AccountOptions::AnimatedStickerFormatGif,
+                  "default choice must be first");
+    choices = NULL;
+    // TRANSLATOR: Account settings, value for animated sticker format
+    addChoice(choices, _("GIF"), AccountOptions::AnimatedStickerFormatGif);
+    // TRANSLATOR: Account settings, value for animated sticker format. Smaller, but not all clients can show it.
+    addChoice(choices, _("Animated WebP"), AccountOptions::AnimatedStickerFormatWebp);
+
+    // TRANSLATOR: Account settings, key (choice)
+    opt = purple_account_option_list_new (_("Animated sticker format"), AccountOptions::AnimatedStickerFormat, choices);
+    prpl_info.protocol_options = g_list_append (prpl_info.protocol_options, opt);
+#endif
 #endif
 
     // TRANSLATOR: Account settings, key (boolean)
@@ -1037,6 +1055,54 @@ static void tgprpl_init (PurplePlugin *plugin)
         prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
     }
 
+    // TRANSLATOR: Account settings, key (number)
+    opt = purple_account_option_string_new (_("Collect read receipts for this long before sending, seconds"),
+                                            AccountOptions::ReadReceiptsDelay,
+                                            AccountOptions::ReadReceiptsDelayDefault);
+    prpl_info.protocol_options = g_list_append (prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (number)
+    opt = purple_account_option_string_new (_("Maximum messages held back per chat while waiting for downloads or history (0 for unlimited)"),
+                                            AccountOptions::PendingQueueLimit,
+                                            AccountOptions::PendingQueueLimitDefault);
+    prpl_info.protocol_options = g_list_append (prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (number)
+    opt = purple_account_option_string_new (_("Chats to fetch missed messages for at the same time after reconnect"),
+                                            AccountOptions::GapRecoveryConcurrency,
+                                            AccountOptions::GapRecoveryConcurrencyDefault);
+    prpl_info.protocol_options = g_list_append (prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (number)
+    opt = purple_account_option_string_new (_("Threads for converting animated stickers, shared by all accounts using the highest setting (0 for number of CPU cores)"),
+                                            AccountOptions::WorkerThreads,
+                                            AccountOptions::WorkerThreadsDefault);
+    prpl_info.protocol_options = g_list_append (prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (number)
+    opt = purple_account_option_string_new (_("Disk space for converted animated stickers, shared by all accounts using the highest setting, MB (0 to disable)"),
+                                            AccountOptions::StickerCacheSize,
+                                            AccountOptions::StickerCacheSizeDefault);
+    prpl_info.protocol_options = g_list_append (prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (number)
+    opt = purple_account_option_string_new (_("Maximum time to process updates without yielding, ms (0 for unlimited)"),
+                                            AccountOptions::UpdateSliceTime,
+                                            AccountOptions::UpdateSliceTimeDefault);
+    prpl_info.protocol_options = g_list_append (prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (boolean)
+    opt = purple_account_option_bool_new(_("Share tdlib receive thread with other accounts (takes effect at reconnect)"),
+                                         AccountOptions::SharedReceiveThread,
+                                         AccountOptions::SharedReceiveThreadDefault);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (boolean)
+    opt = purple_account_option_bool_new(_("Remember last seen messages in a separate file instead of account settings"),
+                                         AccountOptions::LastMessageStore,
+                                         AccountOptions::LastMessageStoreDefault);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+
     opt = purple_account_option_string_new (_("API ID"),
                                             AccountOptions::ApiId, "");
     prpl_info.protocol_options = g_list_append (prpl_info.protocol_options, opt);
@@ -1128,6 +1194,14 @@ static void configureTwoFactorAuth(PurplePluginAction *action)
     requestTwoFactorAuth(gc, _("Enter new password and recovery e-mail address"), NULL);
 }
 
+static void showStatistics(PurplePluginAction *action)
+{
+    PurpleConnection *gc       = static_cast<PurpleConnection *>(action->context);
+    PurpleTdClient   *tdClient = getTdClient(purple_connection_get_account(gc));
+    if (tdClient)
+        tdClient->showStatistics();
+}
+
 static GList *tgprpl_actions (PurplePlugin *plugin, gpointer context)
 {
     GList *actionsList = NULL;
@@ -1138,6 +1212,10 @@ static GList *tgprpl_actions (PurplePlugin *plugin, gpointer context)
                                       configureTwoFactorAuth);
     actionsList = g_list_append(actionsList, action);
 
+    // TRANSLATOR: Account menu action item
+    action = purple_plugin_action_new(_("Show performance statistics"), showStatistics);
+    actionsList = g_list_append(actionsList, action);
+
     return actionsList;
 }
 
@@ -1159,7 +1237,7 @@ static PurplePluginInfo plugin_info = {
     .homepage          = config::projectUrl,
     .load              = tgprpl_load,
     .unload            = NULL,
-    .destroy           = NULL,
+    .destroy           = tgprpl_destroy,
     .ui_info           = NULL,
     .extra_info        = &prpl_info,
     .prefs_info        = NULL,
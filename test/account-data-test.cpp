@@ -0,0 +1,87 @@
+#include "account-data.h"
+#include "test-transceiver.h"
+#include "libpurple-mock.h"
+#include <gtest/gtest.h>
+
+using namespace td::td_api;
+
+class AccountDataTest: public testing::Test {
+protected:
+    AccountDataTest()
+    : m_account(purple_account_new("+12345", NULL)),
+      m_transceiver(nullptr, m_account, nullptr, &m_backend),
+      m_data(m_account, m_transceiver)
+    {
+    }
+
+    ~AccountDataTest() { purple_account_destroy(m_account); }
+
+    void setUserName(int32_t userId, const std::string &firstName)
+    {
+        m_data.updateUser(makeUser(userId, firstName, "", "", make_object<userStatusOffline>()));
+    }
+
+    std::string getDisplayName(int32_t userId)
+    {
+        return m_data.getDisplayName(UserId::fromString(std::to_string(userId).c_str()));
+    }
+
+    PurpleAccount  *m_account;
+    TestTransceiver m_backend;
+    TdTransceiver   m_transceiver;
+    TdAccountData   m_data;
+};
+
+TEST_F(AccountDataTest, DisplayNameSuffixReuse)
+{
+    setUserName(1, "Alice");
+    setUserName(2, "Alice");
+    setUserName(3, "Alice");
+    setUserName(4, "Alice #3"); // Looks like a suffixed name
+    EXPECT_EQ("Alice", getDisplayName(1));
+    EXPECT_EQ("Alice #1", getDisplayName(2));
+    EXPECT_EQ("Alice #2", getDisplayName(3));
+
+    // Unchanged name keeps its suffix
+    setUserName(3, "Alice");
+    EXPECT_EQ("Alice #2", getDisplayName(3));
+
+    // Lowest released suffix is reused, and a name owned by another user is skipped
+    setUserName(2, "Bob");
+    setUserName(5, "Alice");
+    EXPECT_EQ("Alice #1", getDisplayName(5));
+    setUserName(6, "Alice");
+    EXPECT_EQ("Alice #4", getDisplayName(6));
+
+    // Renaming back and forth doesn't keep allocating higher suffixes
+    for (int i = 0; i < 3; i++) {
+        setUserName(6, "Carol");
+        setUserName(6, "Alice");
+    }
+    EXPECT_EQ("Alice #4", getDisplayName(6));
+
+    // Skipped suffix is free once the other user's name changes
+    setUserName(4, "Dave");
+    setUserName(7, "Alice");
+    EXPECT_EQ("Alice #3", getDisplayName(7));
+}
+
+TEST_F(AccountDataTest, UserNamesShared)
+{
+    size_t poolSize = InternedString::poolSize();
+    setUserName(1, "Alice");
+    setUserName(2, "Alice");
+    const TgUser *user1 = m_data.getUser(UserId::fromString("1"));
+    const TgUser *user2 = m_data.getUser(UserId::fromString("2"));
+    ASSERT_NE(nullptr, user1);
+    ASSERT_NE(nullptr, user2);
+    EXPECT_EQ("Alice", user1->firstName.str());
+    EXPECT_EQ(user1->firstName.c_str(), user2->firstName.c_str());
+    EXPECT_EQ(poolSize + 1, InternedString::poolSize());
+
+    // Name no longer used by anyone is dropped
+    setUserName(1, "Bob");
+    setUserName(2, "Bob");
+    EXPECT_EQ("Bob", user1->firstName.str());
+    EXPECT_EQ(poolSize + 1, InternedString::poolSize());
+}
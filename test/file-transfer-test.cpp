@@ -1,6 +1,10 @@
 #include "fixture.h"
 #include "libpurple-mock.h"
 #include "buildopt.h"
+#include "td-client.h"
+#include <glib/gstdio.h>
+#include <utime.h>
+#include <algorithm>
 
 class FileTransferTest: public CommTest {};
 
@@ -426,6 +430,98 @@ TEST_F(FileTransferTest, DISABLED_AnimatedStickerDecode)
     );
 }
 
+static void writeCacheFile(const std::string &path, size_t size, time_t age)
+{
+    std::string contents(size, '\0');
+    ASSERT_TRUE(g_file_set_contents(path.c_str(), contents.data(), contents.size(), NULL));
+    struct utimbuf times;
+    times.actime = times.modtime = time(NULL) - age;
+    ASSERT_EQ(0, g_utime(path.c_str(), &times));
+}
+
+static std::vector<std::string> listCacheEntries(const std::string &cacheDir)
+{
+    std::vector<std::string> entries;
+    GDir *dir = g_dir_open(cacheDir.c_str(), 0, NULL);
+    if (dir) {
+        while (const char *name = g_dir_read_name(dir))
+            entries.push_back(name);
+        g_dir_close(dir);
+    }
+    std::sort(entries.begin(), entries.end());
+    return entries;
+}
+
+#ifndef NoLottie
+TEST_F(FileTransferTest, AnimatedStickerDecode_Cache)
+#else
+TEST_F(FileTransferTest, DISABLED_AnimatedStickerDecode_Cache)
+#endif
+{
+    const int32_t date   = 10001;
+    const int32_t fileId = 1234;
+    const std::string cacheDir = PurpleTdClient::getBaseDatabasePath() + G_DIR_SEPARATOR_S + "sticker-cache";
+    const std::string oldEntry      = "0-old-entry.gif";
+    const std::string staleTempFile = "0-stale.gif.ABCDEF";
+    const std::string liveTempFile  = "0-live.webp.GHIJKL";
+    purple_account_set_string(account, "sticker-cache-size", "1");
+
+    ASSERT_EQ(0, g_mkdir_with_parents(cacheDir.c_str(), 0700));
+    // Over the whole budget and least recently used
+    writeCacheFile(cacheDir + G_DIR_SEPARATOR_S + oldEntry, 2*1024*1024, 2*3600);
+    // Left behind by a conversion which did not finish
+    writeCacheFile(cacheDir + G_DIR_SEPARATOR_S + staleTempFile, 100, 2*3600);
+    // Conversion still running
+    writeCacheFile(cacheDir + G_DIR_SEPARATOR_S + liveTempFile, 100, 0);
+
+    loginWithOneContact();
+
+    for (int64_t messageId = 1; messageId <= 2; messageId++) {
+        tgl.update(make_object<updateNewMessage>(makeMessage(
+            messageId,
+            userIds[0],
+            chatIds[0],
+            false,
+            date,
+            make_object<messageSticker>(make_object<sticker>(
+                0, 320, 200, "", true, false, nullptr,
+                nullptr,
+                make_object<file>(
+                    fileId, 10000, 10000,
+                    make_object<localFile>(TEST_SOURCE_DIR "/test.tgs", true, true, false, true, 0, 10000, 10000),
+                    make_object<remoteFile>("beh", "bleh", false, true, 10000)
+                )
+            ))
+        )));
+        tgl.verifyRequests({
+            make_object<viewMessages>(chatIds[0], std::vector<int64_t>(1, messageId), true),
+        });
+        tgl.reply(make_object<ok>()); // reply to viewMessages
+
+        // Second time the sticker comes from cache
+        prpl.verifyEvents(
+            ServGotImEvent(
+                connection,
+                purpleUserName(0),
+                "\n<img id=\"" + std::to_string(getLastImgstoreId()) + "\">",
+                (PurpleMessageFlags)(PURPLE_MESSAGE_RECV | PURPLE_MESSAGE_IMAGES),
+                date
+            )
+        );
+
+        // Converted sticker stays in cache, unlike the old entry and the stale temporary file
+        std::vector<std::string> entries = listCacheEntries(cacheDir);
+        ASSERT_EQ(2u, entries.size());
+        EXPECT_EQ(liveTempFile, entries[0]);
+        EXPECT_TRUE(g_str_has_suffix(entries[1].c_str(), ".gif") ||
+                    g_str_has_suffix(entries[1].c_str(), ".webp")) << entries[1];
+    }
+
+    for (const std::string &name: listCacheEntries(cacheDir))
+        g_unlink((cacheDir + G_DIR_SEPARATOR_S + name).c_str());
+    g_rmdir(cacheDir.c_str());
+}
+
 TEST_F(FileTransferTest, Sticker_AnimatedDisabled_AlreadyDownloaded)
 {
     const int32_t date      = 10001;
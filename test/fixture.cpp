@@ -14,6 +14,11 @@ CommTest::CommTest()
 void CommTest::SetUp()
 {
     account = purple_account_new(("+" + selfPhoneNumber).c_str(), NULL);
+    // Most tests expect read receipts right away
+    purple_account_set_string(account, "read-receipts-delay", "0");
+    // Tests check last seen messages in account settings, without files left between tests
+    purple_account_set_bool(account, "last-message-store", FALSE);
+    purple_account_set_string(account, "sticker-cache-size", "0");
     connection = new PurpleConnection;
     connection->state = PURPLE_DISCONNECTED;
     connection->account = account;
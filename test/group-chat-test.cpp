@@ -114,10 +114,11 @@ TEST_F(GroupChatTest, BasicGroupReceiveTextAndReply)
                                             makeTextMessage("Reply"));
     reply->reply_to_message_id_ = messageId[0];
     tgl.update(make_object<updateNewMessage>(std::move(reply)));
-    tgl.verifyRequest(getMessage(groupChatId, messageId[0]));
+    tgl.verifyRequest(getMessages(groupChatId, {messageId[0]}));
     prpl.verifyNoEvents();
 
-    tgl.reply(makeMessage(messageId[0], userIds[0], groupChatId, false, date[0], makeTextMessage("Hello")));
+    tgl.reply(makeMessages(makeMessage(messageId[0], userIds[0], groupChatId, false, date[0],
+                                       makeTextMessage("Hello"))));
     prpl.verifyEvents(ConversationWriteEvent(
         groupChatPurpleName, selfFirstName + " " + selfLastName,
         fmt::format(replyPattern, userFirstNames[0] + " " + userLastNames[0], "Hello", "Reply"),
@@ -0,0 +1,54 @@
+#include "last-message-store.h"
+#include <gtest/gtest.h>
+#include <stdio.h>
+
+TEST(LastMessageStoreTest, RoundTrip)
+{
+    const std::string fileName = "last-message-store-test.store";
+    remove(fileName.c_str());
+    {
+        LastMessageStore store;
+        store.open(fileName);
+        ASSERT_TRUE(store.isOpen());
+        ASSERT_FALSE(store.get(ChatId::fromString("700")).valid());
+
+        store.set(ChatId::fromString("700"), MessageId::fromString("1"));
+        store.set(ChatId::fromString("-1000800"), MessageId::fromString("5"));
+        ASSERT_TRUE(store.flush());
+        ASSERT_FALSE(store.hasChanges());
+
+        // Only the latest value is kept for a chat; the rest is flushed by destructor
+        store.set(ChatId::fromString("700"), MessageId::fromString("2"));
+        store.set(ChatId::fromString("700"), MessageId::fromString("3"));
+        ASSERT_EQ(MessageId::fromString("3"), store.get(ChatId::fromString("700")));
+    }
+
+    LastMessageStore store;
+    store.open(fileName);
+    remove(fileName.c_str());
+    ASSERT_EQ(MessageId::fromString("3"), store.get(ChatId::fromString("700")));
+    ASSERT_EQ(MessageId::fromString("5"), store.get(ChatId::fromString("-1000800")));
+    ASSERT_FALSE(store.hasChanges());
+}
+
+TEST(LastMessageStoreTest, BadFile)
+{
+    const std::string fileName = "last-message-store-test-bad.store";
+    FILE *f = fopen(fileName.c_str(), "wb");
+    ASSERT_NE(nullptr, f);
+    fputs("TDLM but not really a store", f);
+    fclose(f);
+
+    {
+        LastMessageStore store;
+        store.open(fileName);
+        ASSERT_FALSE(store.get(ChatId::fromString("700")).valid());
+        store.set(ChatId::fromString("700"), MessageId::fromString("1"));
+        ASSERT_TRUE(store.flush());
+    }
+
+    LastMessageStore store;
+    store.open(fileName);
+    remove(fileName.c_str());
+    ASSERT_EQ(MessageId::fromString("1"), store.get(ChatId::fromString("700")));
+}
@@ -3,6 +3,8 @@
 #include <purple.h>
 #include <stdarg.h>
 #include <vector>
+#include <thread>
+#include <atomic>
 #include <gtest/gtest.h>
 
 struct AccountInfo {
@@ -16,12 +18,27 @@ struct AccountInfo {
 std::vector<AccountInfo>  g_accounts;
 PurplePlugin             *g_plugin;
 
+static const std::thread::id g_mainThread = std::this_thread::get_id();
+static std::atomic<unsigned> g_offThreadDebugCount{0};
+
+static void checkDebugThread()
+{
+    if (std::this_thread::get_id() != g_mainThread)
+        g_offThreadDebugCount++;
+}
+
+unsigned getOffThreadDebugCount()
+{
+    return g_offThreadDebugCount;
+}
+
 extern "C" {
 
 #define EVENT(type, ...) g_purpleEvents.addEvent(std::make_unique<type>(__VA_ARGS__))
 
 void purple_debug_misc(const char *category, const char *format, ...)
 {
+    checkDebugThread();
     va_list va;
     va_start(va, format);
     printf("%s: ", category);
@@ -31,6 +48,7 @@ void purple_debug_misc(const char *category, const char *format, ...)
 
 void purple_debug_info(const char *category, const char *format, ...)
 {
+    checkDebugThread();
     va_list va;
     va_start(va, format);
     printf("Info: %s: ", category);
@@ -40,6 +58,7 @@ void purple_debug_info(const char *category, const char *format, ...)
 
 void purple_debug_warning(const char *category, const char *format, ...)
 {
+    checkDebugThread();
     va_list va;
     va_start(va, format);
     printf("Warning: %s: ", category);
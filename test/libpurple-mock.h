@@ -16,6 +16,9 @@ void setUiName(const char *name);
 
 };
 
+// Number of purple_debug_* calls made outside the thread running the tests
+unsigned getOffThreadDebugCount();
+
 using RoomlistData = std::vector<std::pair<PurpleRoomlistFieldType, std::string>>;
 
 #if !GLIB_CHECK_VERSION(2, 34, 0)
@@ -1,4 +1,5 @@
 #include "supergroup-test.h"
+#include <fmt/format.h>
 
 class MessageHistoryTest: public SupergroupTest {
 protected:
@@ -28,7 +29,7 @@ TEST_F(MessageHistoryTest, TdlibSkipMessages)
     tgl.update(make_object<updateNewMessage>(
         makeMessage(6, userIds[0], groupChatId, false, 6, makeTextMessage("6"))
     ));
-    tgl.verifyRequest(getChatHistory(groupChatId, 6, 0, 30, false));
+    tgl.verifyRequest(getChatHistory(groupChatId, 6, 0, 30, true));
     tgl.update(make_object<updateChatLastMessage>(
         groupChatId,
         makeMessage(6, userIds[0], groupChatId, false, 6, makeTextMessage("6")),
@@ -51,26 +52,38 @@ TEST_F(MessageHistoryTest, TdlibSkipMessages)
     history.push_back(makeMessage(4, userIds[0], groupChatId, false, 4, makeTextMessage("4")));
     tgl.reply(make_object<messages>(history.size(), std::move(history)));
     prpl.verifyNoEvents();
-    tgl.verifyRequest(getChatHistory(groupChatId, 4, 0, 30, false));
-
-    history.clear();
-    history.push_back(makeMessage(3, userIds[0], groupChatId, false, 3, makeTextMessage("3")));
-    history.push_back(makeMessage(2, userIds[0], groupChatId, false, 2, makeTextMessage("2")));
-    history.push_back(makeMessage(1, userIds[0], groupChatId, false, 1, makeTextMessage("1")));
-    tgl.reply(make_object<messages>(history.size(), std::move(history)));
+    tgl.verifyRequest(getChatHistory(groupChatId, 4, 0, 60, true));
 
+    // Nothing more in local database, so what it had is shown and the server is asked from the start
+    tgl.reply(make_object<messages>());
     prpl.verifyEvents(
         ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
         ChatSetTopicEvent(groupChatPurpleName, "", ""),
         ChatClearUsersEvent(groupChatPurpleName),
-        ServGotChatEvent(connection, purpleChatId, userNameInChat, "2", PURPLE_MESSAGE_RECV, 2),
-        ServGotChatEvent(connection, purpleChatId, userNameInChat, "3", PURPLE_MESSAGE_RECV, 3),
         ServGotChatEvent(connection, purpleChatId, userNameInChat, "4", PURPLE_MESSAGE_RECV, 4),
         ServGotChatEvent(connection, purpleChatId, userNameInChat, "5", PURPLE_MESSAGE_RECV, 5),
         ServGotChatEvent(connection, purpleChatId, userNameInChat, "6", PURPLE_MESSAGE_RECV, 6),
         ServGotChatEvent(connection, purpleChatId, userNameInChat, "7", PURPLE_MESSAGE_RECV, 7)
     );
-    tgl.verifyRequest(viewMessages(groupChatId, {6, 7, 5, 4, 3, 2}, true));
+    auto requestIds = tgl.verifyRequests({
+        make_object<viewMessages>(groupChatId, std::vector<int64_t>{6, 7, 5, 4}, true),
+        make_object<getChatHistory>(groupChatId, 6, 0, 30, false)
+    });
+
+    history.clear();
+    history.push_back(makeMessage(5, userIds[0], groupChatId, false, 5, makeTextMessage("5")));
+    history.push_back(makeMessage(4, userIds[0], groupChatId, false, 4, makeTextMessage("4")));
+    history.push_back(makeMessage(3, userIds[0], groupChatId, false, 3, makeTextMessage("3")));
+    history.push_back(makeMessage(2, userIds[0], groupChatId, false, 2, makeTextMessage("2")));
+    history.push_back(makeMessage(1, userIds[0], groupChatId, false, 1, makeTextMessage("1")));
+    tgl.reply(requestIds.at(1), make_object<messages>(history.size(), std::move(history)));
+
+    // Only messages missing from the database are added
+    prpl.verifyEvents(
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "2", PURPLE_MESSAGE_RECV, 2),
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "3", PURPLE_MESSAGE_RECV, 3)
+    );
+    tgl.verifyRequest(viewMessages(groupChatId, {3, 2}, true));
 
     tgl.update(make_object<updateNewMessage>(
         makeMessage(8, userIds[0], groupChatId, false, 8, makeTextMessage("8"))
@@ -102,7 +115,7 @@ TEST_F(MessageHistoryTest, TdlibSkipMessages_FlushAtLogout)
     tgl.update(make_object<updateNewMessage>(
         makeMessage(6, userIds[0], groupChatId, false, 6, makeTextMessage("6"))
     ));
-    tgl.verifyRequest(getChatHistory(groupChatId, 6, 0, 30, false));
+    tgl.verifyRequest(getChatHistory(groupChatId, 6, 0, 30, true));
     tgl.update(make_object<updateChatLastMessage>(
         groupChatId,
         makeMessage(6, userIds[0], groupChatId, false, 6, makeTextMessage("6")),
@@ -111,19 +124,23 @@ TEST_F(MessageHistoryTest, TdlibSkipMessages_FlushAtLogout)
     prpl.verifyNoEvents();
     tgl.verifyNoRequests();
 
+    tgl.reply(make_object<messages>());
+    prpl.verifyNoEvents();
+    tgl.verifyRequest(getChatHistory(groupChatId, 6, 0, 30, false));
+
     std::vector<object_ptr<message>> history;
     history.push_back(makeMessage(5, userIds[0], groupChatId, false, 5, makeTextMessage("5")));
     history.push_back(makeMessage(4, userIds[0], groupChatId, false, 4, makeTextMessage("4")));
     tgl.reply(make_object<messages>(history.size(), std::move(history)));
     prpl.verifyNoEvents();
-    tgl.verifyRequest(getChatHistory(groupChatId, 4, 0, 30, false));
+    tgl.verifyRequest(getChatHistory(groupChatId, 4, 0, 60, false));
 
     history.clear();
     history.push_back(makeMessage(3, userIds[0], groupChatId, false, 3, makeTextMessage("3")));
     history.push_back(makeMessage(2, userIds[0], groupChatId, false, 2, makeTextMessage("2")));
     tgl.reply(make_object<messages>(history.size(), std::move(history)));
     prpl.verifyNoEvents();
-    tgl.verifyRequest(getChatHistory(groupChatId, 2, 0, 30, false));
+    tgl.verifyRequest(getChatHistory(groupChatId, 2, 0, 100, false));
 
     pluginInfo().close(connection);
     prpl.verifyEvents(
@@ -141,3 +158,194 @@ TEST_F(MessageHistoryTest, TdlibSkipMessages_FlushAtLogout)
     ASSERT_EQ(std::string("6"), std::string(purple_account_get_string(
         account, ("last-message-chat" + std::to_string(groupChatId)).c_str(), "")));
 }
+
+TEST_F(MessageHistoryTest, TdlibSkipMessages_QueueLimit)
+{
+    const int purpleChatId = 1;
+    purple_account_set_string(account, ("last-message-chat" + std::to_string(groupChatId)).c_str(), "1");
+    purple_account_set_string(account, "pending-queue-limit", "1");
+    loginWithSupergroup();
+
+    tgl.update(make_object<updateChatLastMessage>(
+        groupChatId, nullptr, 0
+    ));
+
+    tgl.update(make_object<updateNewMessage>(
+        makeMessage(6, userIds[0], groupChatId, false, 6, makeTextMessage("6"))
+    ));
+    tgl.verifyRequest(getChatHistory(groupChatId, 6, 0, 30, true));
+
+    // Over the limit, but history being fetched has to go in front of it
+    tgl.update(make_object<updateNewMessage>(
+        makeMessage(7, userIds[0], groupChatId, false, 7, makeTextMessage("7"))
+    ));
+    prpl.verifyNoEvents();
+    tgl.verifyNoRequests();
+
+    tgl.reply(make_object<messages>());
+    prpl.verifyNoEvents();
+    tgl.verifyRequest(getChatHistory(groupChatId, 6, 0, 30, false));
+
+    std::vector<object_ptr<message>> history;
+    history.push_back(makeMessage(3, userIds[0], groupChatId, false, 3, makeTextMessage("3")));
+    history.push_back(makeMessage(2, userIds[0], groupChatId, false, 2, makeTextMessage("2")));
+    history.push_back(makeMessage(1, userIds[0], groupChatId, false, 1, makeTextMessage("1")));
+    tgl.reply(make_object<messages>(history.size(), std::move(history)));
+
+    prpl.verifyEvents(
+        ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
+        ChatSetTopicEvent(groupChatPurpleName, "", ""),
+        ChatClearUsersEvent(groupChatPurpleName),
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "2", PURPLE_MESSAGE_RECV, 2),
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "3", PURPLE_MESSAGE_RECV, 3),
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "6", PURPLE_MESSAGE_RECV, 6),
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "7", PURPLE_MESSAGE_RECV, 7)
+    );
+    tgl.verifyRequest(viewMessages(groupChatId, {6, 7, 3, 2}, true));
+}
+
+TEST_F(MessageHistoryTest, RepliesInHistory)
+{
+    const int purpleChatId = 1;
+    purple_account_set_string(account, ("last-message-chat" + std::to_string(groupChatId)).c_str(), "1");
+    loginWithSupergroup();
+
+    tgl.update(make_object<updateChatLastMessage>(
+        groupChatId, nullptr, 0
+    ));
+
+    tgl.update(make_object<updateNewMessage>(
+        makeMessage(5, userIds[0], groupChatId, false, 5, makeTextMessage("5"))
+    ));
+    tgl.verifyRequest(getChatHistory(groupChatId, 5, 0, 30, true));
+
+    // 4 replies to a message from the same history, 3 replies to one already seen before
+    std::vector<object_ptr<message>> history;
+    history.push_back(makeMessage(4, userIds[0], groupChatId, false, 4, makeTextMessage("4")));
+    history.back()->reply_to_message_id_ = 2;
+    history.push_back(makeMessage(3, userIds[0], groupChatId, false, 3, makeTextMessage("3")));
+    history.back()->reply_to_message_id_ = 1;
+    history.push_back(makeMessage(2, userIds[0], groupChatId, false, 2, makeTextMessage("2")));
+    history.push_back(makeMessage(1, userIds[0], groupChatId, false, 1, makeTextMessage("1")));
+    tgl.reply(make_object<messages>(history.size(), std::move(history)));
+
+    // Local messages are shown up to the one waiting for its reply source
+    auto requestIds = tgl.verifyRequests({
+        make_object<getMessages>(groupChatId, std::vector<int64_t>{1}),
+        make_object<viewMessages>(groupChatId, std::vector<int64_t>{5, 4, 3, 2}, true),
+        make_object<getChatHistory>(groupChatId, 5, 0, 30, false)
+    });
+    prpl.verifyEvents(
+        ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
+        ChatSetTopicEvent(groupChatPurpleName, "", ""),
+        ChatClearUsersEvent(groupChatPurpleName),
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "2", PURPLE_MESSAGE_RECV, 2)
+    );
+
+    history.clear();
+    history.push_back(makeMessage(1, userIds[0], groupChatId, false, 1, makeTextMessage("1")));
+    tgl.reply(requestIds.at(0), make_object<messages>(history.size(), std::move(history)));
+    prpl.verifyNoEvents();
+
+    // Server has nothing the database didn't
+    history.clear();
+    for (int64_t id = 4; id >= 1; id--)
+        history.push_back(makeMessage(id, userIds[0], groupChatId, false, id, makeTextMessage(std::to_string(id))));
+    tgl.reply(requestIds.at(2), make_object<messages>(history.size(), std::move(history)));
+    prpl.verifyEvents(
+        ServGotChatEvent(connection, purpleChatId, userNameInChat,
+                         fmt::format(replyPattern, userNameInChat, "1", "3"), PURPLE_MESSAGE_RECV, 3),
+        ServGotChatEvent(connection, purpleChatId, userNameInChat,
+                         fmt::format(replyPattern, userNameInChat, "2", "4"), PURPLE_MESSAGE_RECV, 4),
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "5", PURPLE_MESSAGE_RECV, 5)
+    );
+    tgl.verifyNoRequests();
+}
+
+TEST_F(MessageHistoryTest, RecoverQuietChat)
+{
+    const int purpleChatId = 1;
+    purple_account_set_string(account, ("last-message-chat" + std::to_string(groupChatId)).c_str(), "1");
+    loginWithSupergroup();
+
+    tgl.update(make_object<updateChatLastMessage>(
+        groupChatId, nullptr, 0
+    ));
+    tgl.verifyNoRequests();
+
+    // No new message arrives, history is fetched anyway after a while
+    runTimeouts();
+    tgl.verifyRequest(getChatHistory(groupChatId, 0, 0, 30, true));
+
+    std::vector<object_ptr<message>> history;
+    history.push_back(makeMessage(3, userIds[0], groupChatId, false, 3, makeTextMessage("3")));
+    history.push_back(makeMessage(2, userIds[0], groupChatId, false, 2, makeTextMessage("2")));
+    history.push_back(makeMessage(1, userIds[0], groupChatId, false, 1, makeTextMessage("1")));
+    tgl.reply(make_object<messages>(history.size(), std::move(history)));
+    prpl.verifyEvents(
+        ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
+        ChatSetTopicEvent(groupChatPurpleName, "", ""),
+        ChatClearUsersEvent(groupChatPurpleName),
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "2", PURPLE_MESSAGE_RECV, 2),
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "3", PURPLE_MESSAGE_RECV, 3)
+    );
+    auto requestIds = tgl.verifyRequests({
+        make_object<viewMessages>(groupChatId, std::vector<int64_t>{3, 2}, true),
+        make_object<getChatHistory>(groupChatId, 0, 0, 30, false)
+    });
+
+    history.clear();
+    history.push_back(makeMessage(3, userIds[0], groupChatId, false, 3, makeTextMessage("3")));
+    history.push_back(makeMessage(2, userIds[0], groupChatId, false, 2, makeTextMessage("2")));
+    history.push_back(makeMessage(1, userIds[0], groupChatId, false, 1, makeTextMessage("1")));
+    tgl.reply(requestIds.at(1), make_object<messages>(history.size(), std::move(history)));
+    prpl.verifyNoEvents();
+    tgl.verifyNoRequests();
+}
+
+TEST_F(MessageHistoryTest, LocalHistoryWithHole)
+{
+    const int purpleChatId = 1;
+    purple_account_set_string(account, ("last-message-chat" + std::to_string(groupChatId)).c_str(), "1");
+    loginWithSupergroup();
+
+    tgl.update(make_object<updateChatLastMessage>(
+        groupChatId, nullptr, 0
+    ));
+
+    tgl.update(make_object<updateNewMessage>(
+        makeMessage(6, userIds[0], groupChatId, false, 6, makeTextMessage("6"))
+    ));
+    tgl.verifyRequest(getChatHistory(groupChatId, 6, 0, 30, true));
+
+    // Database reaches the last known message, but doesn't have the ones sent while offline
+    std::vector<object_ptr<message>> history;
+    history.push_back(makeMessage(5, userIds[0], groupChatId, false, 5, makeTextMessage("5")));
+    history.push_back(makeMessage(2, userIds[0], groupChatId, false, 2, makeTextMessage("2")));
+    history.push_back(makeMessage(1, userIds[0], groupChatId, false, 1, makeTextMessage("1")));
+    tgl.reply(make_object<messages>(history.size(), std::move(history)));
+    prpl.verifyEvents(
+        ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
+        ChatSetTopicEvent(groupChatPurpleName, "", ""),
+        ChatClearUsersEvent(groupChatPurpleName),
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "2", PURPLE_MESSAGE_RECV, 2),
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "5", PURPLE_MESSAGE_RECV, 5),
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "6", PURPLE_MESSAGE_RECV, 6)
+    );
+    auto requestIds = tgl.verifyRequests({
+        make_object<viewMessages>(groupChatId, std::vector<int64_t>{6, 5, 2}, true),
+        make_object<getChatHistory>(groupChatId, 6, 0, 30, false)
+    });
+
+    // Messages the database lacked are added afterwards
+    history.clear();
+    for (int64_t id = 5; id >= 1; id--)
+        history.push_back(makeMessage(id, userIds[0], groupChatId, false, id, makeTextMessage(std::to_string(id))));
+    tgl.reply(requestIds.at(1), make_object<messages>(history.size(), std::move(history)));
+
+    prpl.verifyEvents(
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "3", PURPLE_MESSAGE_RECV, 3),
+        ServGotChatEvent(connection, purpleChatId, userNameInChat, "4", PURPLE_MESSAGE_RECV, 4)
+    );
+    tgl.verifyRequest(viewMessages(groupChatId, {4, 3}, true));
+}
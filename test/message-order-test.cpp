@@ -19,7 +19,7 @@ TEST_F(MessageOrderTest, ReplyOrdering)
 
     tgl.update(make_object<updateNewMessage>(std::move(message)));
     uint64_t getMessageReqId = tgl.verifyRequest(
-        getMessage(chatIds[0], srcMsgId)
+        getMessages(chatIds[0], {srcMsgId})
     );
     prpl.verifyNoEvents();
 
@@ -28,7 +28,8 @@ TEST_F(MessageOrderTest, ReplyOrdering)
     )));
     prpl.verifyNoEvents();
 
-    tgl.reply(getMessageReqId, makeMessage(srcMsgId, userIds[0], chatIds[0], false, srcDate, makeTextMessage("original")));
+    tgl.reply(getMessageReqId, makeMessages(makeMessage(srcMsgId, userIds[0], chatIds[0], false, srcDate,
+                                                        makeTextMessage("original"))));
     prpl.verifyEvents(
         ServGotImEvent(
             connection, purpleUserName(0),
@@ -53,7 +54,7 @@ TEST_F(MessageOrderTest, Reply_FlushAtLogout)
     message->reply_to_message_id_ = srcMsgId;
 
     tgl.update(make_object<updateNewMessage>(std::move(message)));
-    tgl.verifyRequest(getMessage(chatIds[0], srcMsgId));
+    tgl.verifyRequest(getMessages(chatIds[0], {srcMsgId}));
     prpl.verifyNoEvents();
 
     tgl.update(make_object<updateNewMessage>(makeMessage(
@@ -73,6 +74,43 @@ TEST_F(MessageOrderTest, Reply_FlushAtLogout)
     tgl.verifyRequest(viewMessages(chatIds[0], {msgIds[0], msgIds[1]}, true));
 }
 
+TEST_F(MessageOrderTest, Reply_QueueLimit)
+{
+    const int32_t dates[2]  = {10002, 10003};
+    const int64_t msgIds[2] = {2, 3};
+    const int32_t srcDate   = 10001;
+    const int64_t srcMsgId  = 1;
+    purple_account_set_string(account, "pending-queue-limit", "1");
+    loginWithOneContact();
+
+    object_ptr<message> message = makeMessage(
+        msgIds[0], userIds[0], chatIds[0], false, dates[0], makeTextMessage("reply")
+    );
+    message->reply_to_message_id_ = srcMsgId;
+
+    tgl.update(make_object<updateNewMessage>(std::move(message)));
+    uint64_t getMessageReqId = tgl.verifyRequest(getMessages(chatIds[0], {srcMsgId}));
+    prpl.verifyNoEvents();
+
+    // Second message exceeds the limit, so the first one is shown without waiting for reply source
+    tgl.update(make_object<updateNewMessage>(makeMessage(
+        msgIds[1], userIds[0], chatIds[0], false, dates[1], makeTextMessage("followUp")
+    )));
+    prpl.verifyEvents(
+        ServGotImEvent(
+            connection, purpleUserName(0),
+            fmt::format(replyPattern, "Unknown user", "[message unavailable]", "reply"),
+            PURPLE_MESSAGE_RECV, dates[0]
+        ),
+        ServGotImEvent(connection, purpleUserName(0), "followUp", PURPLE_MESSAGE_RECV, dates[1])
+    );
+    tgl.verifyRequest(viewMessages(chatIds[0], {msgIds[0], msgIds[1]}, true));
+
+    tgl.reply(getMessageReqId, makeMessages(makeMessage(srcMsgId, userIds[0], chatIds[0], false, srcDate,
+                                                        makeTextMessage("original"))));
+    prpl.verifyNoEvents();
+}
+
 TEST_F(MessageOrderTest, Photo_Download_FlushAtLogout)
 {
     const int32_t date   = 10001;
@@ -147,14 +185,15 @@ TEST_P(MessageOrderTestLongDownloadInReply, LongDownloadInReply)
 
     tgl.update(make_object<updateNewMessage>(std::move(message)));
     auto requestIds = tgl.verifyRequests({
-        make_object<getMessage>(chatIds[0], srcMsgId),
-        make_object<downloadFile>(fileId, 1, 0, 0, true)
+        make_object<downloadFile>(fileId, 1, 0, 0, true),
+        make_object<getMessages>(chatIds[0], std::vector<int64_t>{srcMsgId})
     });
-    uint64_t getMessageReqId = requestIds.at(0);
-    uint64_t downloadReqId = requestIds.at(1);
+    uint64_t downloadReqId = requestIds.at(0);
+    uint64_t getMessageReqId = requestIds.at(1);
     prpl.verifyNoEvents();
 
-    tgl.reply(getMessageReqId, makeMessage(srcMsgId, userIds[0], chatIds[0], false, srcDate, makeTextMessage("1<2")));
+    tgl.reply(getMessageReqId, makeMessages(makeMessage(srcMsgId, userIds[0], chatIds[0], false, srcDate,
+                                                        makeTextMessage("1<2"))));
 
     runTimeouts();
     std::string tempFileName;
@@ -802,17 +802,17 @@ TEST_F(PrivateChatTest, ReplyToOldMessage)
     message->reply_to_message_id_ = srcMsgId;
 
     tgl.update(make_object<updateNewMessage>(std::move(message)));
-    tgl.verifyRequest(getMessage(chatIds[0], srcMsgId));
+    tgl.verifyRequest(getMessages(chatIds[0], {srcMsgId}));
     prpl.verifyNoEvents();
 
-    tgl.reply(makeMessage(
+    tgl.reply(makeMessages(makeMessage(
         srcMsgId,
         userIds[0],
         chatIds[0],
         false,
         srcDate,
         makeTextMessage("1<2")
-    ));
+    )));
     prpl.verifyEvents(
         ServGotImEvent(
             connection,
@@ -845,7 +845,7 @@ TEST_F(PrivateChatTest, ReplyToOldMessage_FetchTimeout)
 
     tgl.update(make_object<updateNewMessage>(std::move(message)));
     uint64_t getMessageReqId = tgl.verifyRequest(
-        getMessage(chatIds[0], srcMsgId)
+        getMessages(chatIds[0], {srcMsgId})
     );
     prpl.verifyNoEvents();
 
@@ -861,11 +861,50 @@ TEST_F(PrivateChatTest, ReplyToOldMessage_FetchTimeout)
     );
     tgl.verifyRequest(viewMessages(chatIds[0], {msgId}, true));
 
-    tgl.reply(getMessageReqId, makeMessage(
+    tgl.reply(getMessageReqId, makeMessages(makeMessage(
         srcMsgId, userIds[0], chatIds[0], false, srcDate,
         makeTextMessage("1<2")
-    ));
+    )));
+    prpl.verifyNoEvents();
+}
+
+TEST_F(PrivateChatTest, ReplyToOldMessage_Burst)
+{
+    const int32_t dates[]     = {10003, 10004, 10005};
+    const int64_t msgIds[]    = {3, 4, 5};
+    const int32_t srcDates[]  = {10001, 10002};
+    const int64_t srcMsgIds[] = {1, 2};
+    loginWithOneContact();
+
+    // Replies arriving together are resolved with one request, even to the same message
+    std::vector<object_ptr<Object>> updates;
+    for (unsigned i = 0; i < 3; i++) {
+        object_ptr<message> message = makeMessage(msgIds[i], userIds[0], chatIds[0], false, dates[i],
+                                                  makeTextMessage("reply" + std::to_string(i)));
+        message->reply_to_message_id_ = srcMsgIds[i / 2];
+        updates.push_back(make_object<updateNewMessage>(std::move(message)));
+    }
+    tgl.updates(std::move(updates));
+    tgl.verifyRequest(getMessages(chatIds[0], {srcMsgIds[0], srcMsgIds[1]}));
     prpl.verifyNoEvents();
+
+    std::vector<object_ptr<message>> repliedMessages;
+    for (unsigned i = 0; i < 2; i++)
+        repliedMessages.push_back(makeMessage(srcMsgIds[i], userIds[0], chatIds[0], false, srcDates[i],
+                                              makeTextMessage("source" + std::to_string(i))));
+    tgl.reply(make_object<messages>(2, std::move(repliedMessages)));
+    prpl.verifyEvents(
+        ServGotImEvent(connection, purpleUserName(0),
+                       fmt::format(replyPattern, userFirstNames[0] + " " + userLastNames[0], "source0", "reply0"),
+                       PURPLE_MESSAGE_RECV, dates[0]),
+        ServGotImEvent(connection, purpleUserName(0),
+                       fmt::format(replyPattern, userFirstNames[0] + " " + userLastNames[0], "source0", "reply1"),
+                       PURPLE_MESSAGE_RECV, dates[1]),
+        ServGotImEvent(connection, purpleUserName(0),
+                       fmt::format(replyPattern, userFirstNames[0] + " " + userLastNames[0], "source1", "reply2"),
+                       PURPLE_MESSAGE_RECV, dates[2])
+    );
+    tgl.verifyRequest(viewMessages(chatIds[0], {msgIds[0], msgIds[1], msgIds[2]}, true));
 }
 
 TEST_F(PrivateChatTest, TypingNotification)
@@ -1161,3 +1200,27 @@ TEST_F(PrivateChatTest, DisablingReadReceipts)
     setUiName("pidgin");
     testReadReceipt(true);
 }
+
+TEST_F(PrivateChatTest, DelayedReadReceipts)
+{
+    const int64_t messageIds[] = {1, 2};
+    const int32_t date         = 10001;
+
+    loginWithOneContact();
+    purple_account_set_string(account, "read-receipts-delay", "1");
+
+    for (int64_t messageId: messageIds) {
+        tgl.update(make_object<updateNewMessage>(makeMessage(
+            messageId, userIds[0], chatIds[0], false, date,
+            makeTextMessage("text")
+        )));
+        prpl.verifyEvents(ServGotImEvent(
+            connection, purpleUserName(0), "text", PURPLE_MESSAGE_RECV, date
+        ));
+    }
+    tgl.verifyNoRequests();
+
+    // One request for all messages shown in the meantime
+    tgl.runTimeouts();
+    tgl.verifyRequest(viewMessages(chatIds[0], {messageIds[0], messageIds[1]}, true));
+}
@@ -304,6 +304,14 @@ static void compare(const getMessage &actual, const getMessage &expected)
     COMPARE(message_id_);
 }
 
+static void compare(const getMessages &actual, const getMessages &expected)
+{
+    COMPARE(chat_id_);
+    COMPARE(message_ids_.size());
+    for (size_t i = 0; i < actual.message_ids_.size(); i++)
+        COMPARE(message_ids_[i]);
+}
+
 static void compare(const sendChatAction &actual, const sendChatAction &expected)
 {
     COMPARE(chat_id_);
@@ -510,6 +518,7 @@ static void compareRequests(const Function &actual, const Function &expected,
         C(checkAuthenticationCode)
         C(registerUser)
         C(getMessage)
+        C(getMessages)
         C(sendChatAction)
         C(addProxy)
         case disableProxy::ID: break; // no data fields
@@ -555,6 +564,16 @@ void TestTransceiver::update(object_ptr<Object> object)
     receive({0, std::move(object)});
 }
 
+void TestTransceiver::updates(std::vector<object_ptr<Object>> objects)
+{
+    std::vector<td::Client::Response> responses;
+    for (object_ptr<Object> &object: objects) {
+        std::cout << "Sending update: " << responseToString(*object) << "\n";
+        responses.push_back({0, std::move(object)});
+    }
+    receive(std::move(responses));
+}
+
 void TestTransceiver::reply(object_ptr<Object> object)
 {
     ASSERT_FALSE(m_lastRequestIds.empty()) << "No requests to reply to";
@@ -705,6 +724,13 @@ object_ptr<messageText> makeTextMessage(const std::string &text)
     );
 }
 
+object_ptr<messages> makeMessages(object_ptr<message> &&message_)
+{
+    std::vector<object_ptr<message>> result;
+    result.push_back(std::move(message_));
+    return make_object<messages>(1, std::move(result));
+}
+
 object_ptr<photo> makePhotoRemote(int32_t fileId, unsigned size, unsigned width, unsigned height)
 {
     std::vector<object_ptr<photoSize>> sizes;
@@ -19,6 +19,8 @@ public:
     void verifyNoRequests();
 
     void update(td::td_api::object_ptr<td::td_api::Object> object);
+    // Processed together like a burst of updates from tdlib
+    void updates(std::vector<td::td_api::object_ptr<td::td_api::Object>> objects);
 
     // Replies to the first non-replied request from the last verifyRequest(s) batch, or fails the
     // test case if there is no such request
@@ -71,6 +73,8 @@ object_ptr<message> makeMessage(std::int64_t id_, std::int32_t sender_user_id_,
                                 bool is_outgoing_, std::int32_t date_, object_ptr<MessageContent> &&content_);
 
 object_ptr<messageText> makeTextMessage(const std::string &text);
+// Response to getMessages
+object_ptr<messages> makeMessages(object_ptr<message> &&message_);
 
 object_ptr<photo> makePhotoRemote(int32_t fileId, unsigned size, unsigned width, unsigned height);
 object_ptr<photo> makePhotoLocal(int32_t fileId, unsigned size, const std::string &path,
@@ -0,0 +1,32 @@
+#include "transceiver.h"
+#include "purple-info.h"
+#include "libpurple-mock.h"
+#include <gtest/gtest.h>
+#include <memory>
+
+static void runIdleFunctions()
+{
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+}
+
+// Uses real tdlib clients, which are closed right away without ever getting parameters
+TEST(SharedReceiverTest, CloseOnMainThread)
+{
+    PurpleAccount *account = purple_account_new("+12345", NULL);
+    purple_account_set_bool(account, AccountOptions::SharedReceiveThread, TRUE);
+    unsigned offThreadDebugCount = getOffThreadDebugCount();
+
+    for (unsigned i = 0; i < 3; i++) {
+        auto first  = std::make_unique<TdTransceiver>(nullptr, account, nullptr, nullptr);
+        auto second = std::make_unique<TdTransceiver>(nullptr, account, nullptr, nullptr);
+        first.reset();
+        runIdleFunctions();
+        second.reset();
+        runIdleFunctions();
+    }
+
+    // TdTransceiverImpl destructor logs a message, so if the receive thread held the last reference
+    // to it, it would show here
+    EXPECT_EQ(offThreadDebugCount, getOffThreadDebugCount());
+}
@@ -2,54 +2,255 @@
 #include "config.h"
 #include "purple-info.h"
 #include <algorithm>
+#include <unordered_map>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <set>
 #include <assert.h>
 
-struct TimerCallbackData {
-    TdTransceiver             *m_transceiver;
-    uint64_t                   requestId;
+struct TimerInfo {
     TdTransceiver::ResponseCb2 callback;
     bool                       cancelResponse;
+    uint64_t                   expiresAt;  // in timer wheel ticks
 };
 
-struct TimerInfo {
-    guint                              timerId;
-    std::unique_ptr<TimerCallbackData> data;
+enum {
+    TIMER_WHEEL_SIZE = 64, // seconds
+    // Maximum number of queries in flight per priority lane
+    INTERACTIVE_QUERY_LIMIT = 256,
+    BACKGROUND_QUERY_LIMIT  = 16,
+    DOWNLOAD_QUERY_LIMIT    = 8,
+};
+
+// Latency histogram with power-of-two microsecond buckets, so percentiles are approximate
+// (reported as upper bound of the bucket)
+struct LatencyStats {
+    enum {
+        BUCKETS = 32
+    };
+    std::string name;
+    unsigned    count   = 0;
+    gint64      totalUs = 0;
+    gint64      maxUs   = 0;
+    unsigned    buckets[BUCKETS] = {};
+
+    void   add(gint64 us);
+    gint64 percentile(unsigned percent) const;
+};
+
+void LatencyStats::add(gint64 us)
+{
+    unsigned bucket = 0;
+    while ((bucket < BUCKETS-1) && ((gint64)1 << bucket) < us)
+        bucket++;
+    buckets[bucket]++;
+    count++;
+    totalUs += us;
+    if (us > maxUs)
+        maxUs = us;
+}
+
+gint64 LatencyStats::percentile(unsigned percent) const
+{
+    unsigned threshold = (count * (uint64_t)percent + 99) / 100;
+    unsigned seen      = 0;
+    for (unsigned bucket = 0; bucket < BUCKETS; bucket++) {
+        seen += buckets[bucket];
+        if (seen >= threshold)
+            return std::min((gint64)1 << bucket, maxUs);
+    }
+    return maxUs;
+}
+
+// Name of tdlib function or object class, such as "getChatHistory"
+static std::string getTypeName(const td::TlObject &object)
+{
+    std::string s = td::td_api::to_string(object);
+    size_t end = s.find_first_of(" {\n");
+    return s.substr(0, end);
+}
+
+struct QueryStart {
+    std::int32_t functionId;
+    gint64       sentAt;
+};
+
+struct QueryLane {
+    unsigned                        limit;
+    unsigned                        inFlight = 0;
+    std::deque<td::Client::Request> queued;
 };
 
+// Bounded single-producer single-consumer queue carrying responses from the poll thread to glib
+// main thread. Producer only writes m_tail, consumer only writes m_head, so no lock is needed.
+class ResponseRing {
+public:
+    static constexpr size_t CAPACITY = 4096; // must be a power of 2
+
+    ResponseRing() : m_slots(CAPACITY) {}
+    bool push(td::Client::Response &&response);
+    bool pop(td::Client::Response &response);
+    bool empty() const;
+private:
+    std::vector<td::Client::Response> m_slots;
+    std::atomic<size_t>               m_head{0};
+    std::atomic<size_t>               m_tail{0};
+};
+
+bool ResponseRing::push(td::Client::Response &&response)
+{
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) == CAPACITY)
+        return false;
+    m_slots[tail & (CAPACITY-1)] = std::move(response);
+    m_tail.store(tail+1, std::memory_order_release);
+    return true;
+}
+
+bool ResponseRing::pop(td::Client::Response &response)
+{
+    size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire))
+        return false;
+    response = std::move(m_slots[head & (CAPACITY-1)]);
+    m_head.store(head+1, std::memory_order_release);
+    return true;
+}
+
+bool ResponseRing::empty() const
+{
+    return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+}
+
+class TdTransceiverImpl;
+
+// Receives responses for all accounts using shared td::ClientManager in one thread, and passes
+// them on to respective TdTransceiverImpl. Other methods are called from glib main thread.
+class SharedTdReceiver {
+public:
+    ~SharedTdReceiver();
+    std::int32_t addClient(const std::shared_ptr<TdTransceiverImpl> &impl);
+    void         send(std::int32_t clientId, td::Client::Request &&request);
+    // Waits for authorizationStateClosed for the client, after close request has been sent
+    void         waitForClose(std::int32_t clientId);
+private:
+    struct ClientSink {
+        std::shared_ptr<TdTransceiverImpl> impl;
+        // Responses waiting for space in impl->m_rxQueue, only used by receive thread
+        std::deque<td::Client::Response>   backlog;
+    };
+
+    void threadLoop();
+    std::shared_ptr<ClientSink> findClient(std::int32_t clientId);
+    void removeClient(std::int32_t clientId);
+    void deliver(std::int32_t clientId, std::vector<td::Client::Response> &responses);
+    bool flushBacklog(ClientSink &client);
+
+    // The mutex protects m_clients map (but not its values)
+    std::mutex                                        m_mutex;
+    std::condition_variable                           m_clientClosed;
+    std::map<std::int32_t, std::shared_ptr<ClientSink>> m_clients;
+    std::thread                                       m_thread;
+    std::atomic_bool                                  m_stop{false};
+    // Only used by receive thread
+    std::set<std::int32_t>                            m_backlogged;
+};
+
+static SharedTdReceiver g_sharedReceiver;
+
 // This class is used to share ownership of its instances between TdTransceiver and glib idle
 // function queue. This way, those idle functions can be called safely after TdTransceiver is
-// destroyed.
+// destroyed. At most one such idle function is pending at any time: it is added by the poll
+// thread when the response queue goes from empty to non-empty (tracked by m_wakeupPending).
 class TdTransceiverImpl {
 public:
-    TdTransceiverImpl(PurpleTdClient *owner, TdTransceiver::UpdateCb updateCb, ITransceiverBackend *testBackend);
+    TdTransceiverImpl(PurpleTdClient *owner, TdTransceiver::UpdateCb updateCb, ITransceiverBackend *testBackend,
+                      const std::vector<UpdateFilterRule> &updateFilter, bool sharedClient);
     ~TdTransceiverImpl();
-    static int rxCallback(void *user_data);
-    void       cancelTimer(uint64_t requestId);
+    static int  rxCallback(void *user_data);
+    static void wakeUp(const std::shared_ptr<TdTransceiverImpl> &self);
+    void        send(td::Client::Request &&request);
+    void        submit(td::Client::Request &&request, TdTransceiver::Priority priority);
+    void        onQueryDone(uint64_t requestId);
+    void        drainLanes();
+    void        addQueryLatency(uint64_t requestId);
+    void        addUpdateDispatchTime(const td::td_api::Object &update, gint64 dispatchUs);
+    void        cancelTimer(uint64_t requestId);
+    bool        isSliceOver(gint64 sliceStart, unsigned responseCount);
+    void        endSlice(gint64 sliceStart, unsigned responseCount, bool burstDone);
+    void        sliceDone(unsigned responseCount);
+
+    // Used by poll thread
+    bool        filterUpdate(const td::Client::Response &response);
+    void        coalesceUpdates(std::vector<td::Client::Response> &batch);
 
     PurpleTdClient                     *m_owner;
     std::unique_ptr<td::Client>         m_client;
+    // Client id in shared td::ClientManager, if m_client is not used
+    std::int32_t                        m_clientId = 0;
     ITransceiverBackend                *m_testBackend;
-
-    // The mutex protects m_rxQueue and reference counters of all shared pointers to this object.
-    // All other members are only used from the glib main thread
-    std::mutex                          m_rxMutex;
-    std::vector<td::Client::Response>   m_rxQueue;
+    // Constant after construction
+    std::map<std::int32_t, UpdateFilterRule::KeyFunction> m_updateFilter;
+
+    // m_rxQueue, m_wakeupPending and m_stopping are shared with the poll thread. All other members
+    // are only used from the glib main thread
+    ResponseRing                        m_rxQueue;
+    std::atomic_bool                    m_wakeupPending;
+    std::atomic_bool                    m_stopping;
+    // Statistics of poll thread update filter
+    std::atomic<unsigned>               m_droppedUpdates{0};
+    std::atomic<unsigned>               m_mergedUpdates{0};
 
     TdTransceiver::UpdateCb             m_updateCb;
+    TdTransceiver::SliceDoneCb          m_sliceDoneCb = nullptr;
     uint64_t                                            m_lastQueryId;
-    std::map<std::uint64_t, TdTransceiver::ResponseCb2> m_responseHandlers;
-    std::vector<TimerInfo>                              m_timers;
+    std::unordered_map<std::uint64_t, TdTransceiver::ResponseCb2> m_responseHandlers;
+    // Indexed by TdTransceiver::Priority
+    QueryLane                           m_lanes[3];
+    std::unordered_map<std::uint64_t, unsigned>                   m_inFlightLanes;
+
+    // Time from sendQuery to response handler per function type, and dispatch time per update type
+    std::unordered_map<std::uint64_t, QueryStart>                 m_queryStarts;
+    std::map<std::int32_t, LatencyStats>                          m_queryStats;
+    std::map<std::int32_t, LatencyStats>                          m_updateStats;
+
+    // Query timers are kept in a timer wheel with one second resolution, driven by a single glib
+    // timeout (m_wheelTimerId) which only runs while there are any timers. Cancelled timers are
+    // only removed from m_timers, their stale wheel entries get dropped when the slot comes up.
+    std::unordered_map<std::uint64_t, TimerInfo>                  m_timers;
+    std::vector<std::uint64_t>          m_timerWheel[TIMER_WHEEL_SIZE];
+    uint64_t                            m_timerTick    = 0;
+    guint                               m_wheelTimerId = 0;
+
+    // Dispatch budget for one main loop iteration (0 = unlimited), and statistics of slices
+    // it took to process the bursts of responses
+    unsigned                            m_sliceTimeMs       = 0;
+    unsigned                            m_sliceMaxResponses = 0;
+    unsigned                            m_burstSlices       = 0;
+    unsigned                            m_burstResponses    = 0;
+    unsigned                            m_maxBurstSlices    = 0;
+    gint64                              m_worstSliceUs      = 0;
 };
 
 TdTransceiverImpl::TdTransceiverImpl(PurpleTdClient *owner, TdTransceiver::UpdateCb updateCb,
-                                     ITransceiverBackend *testBackend
+                                     ITransceiverBackend *testBackend,
+                                     const std::vector<UpdateFilterRule> &updateFilter,
+                                     bool sharedClient
 )
 :   m_owner(owner),
     m_testBackend(testBackend),
+    m_wakeupPending(false),
+    m_stopping(false),
     m_updateCb(updateCb),
     m_lastQueryId(0)
 {
-    if (!testBackend)
+    for (const UpdateFilterRule &rule: updateFilter)
+        m_updateFilter[rule.updateId] = rule.coalesceKey;
+    m_lanes[(unsigned)TdTransceiver::Priority::Interactive].limit = INTERACTIVE_QUERY_LIMIT;
+    m_lanes[(unsigned)TdTransceiver::Priority::Background].limit  = BACKGROUND_QUERY_LIMIT;
+    m_lanes[(unsigned)TdTransceiver::Priority::Download].limit    = DOWNLOAD_QUERY_LIMIT;
+    if (!testBackend && !sharedClient)
         m_client = std::make_unique<td::Client>();
 }
 
@@ -58,25 +259,147 @@ TdTransceiverImpl::~TdTransceiverImpl()
     purple_debug_misc(config::pluginId, "Destroyed TdTransceiverImpl\n");
 }
 
+void TdTransceiverImpl::send(td::Client::Request &&request)
+{
+    if (m_testBackend)
+        m_testBackend->send(std::move(request));
+    else if (m_client)
+        m_client->send(std::move(request));
+    else
+        g_sharedReceiver.send(m_clientId, std::move(request));
+}
+
+void TdTransceiverImpl::submit(td::Client::Request &&request, TdTransceiver::Priority priority)
+{
+    // With test backend, queries are always sent right away
+    if (m_testBackend) {
+        send(std::move(request));
+        return;
+    }
+
+    unsigned   laneIndex = (unsigned)priority;
+    QueryLane &lane      = m_lanes[laneIndex];
+    if (lane.queued.empty() && (lane.inFlight < lane.limit)) {
+        lane.inFlight++;
+        m_inFlightLanes[request.id] = laneIndex;
+        send(std::move(request));
+    } else {
+        purple_debug_misc(config::pluginId, "Deferring query id %lu, %u queries in flight\n",
+                          (unsigned long)request.id, lane.inFlight);
+        lane.queued.push_back(std::move(request));
+    }
+}
+
+void TdTransceiverImpl::addQueryLatency(uint64_t requestId)
+{
+    auto it = m_queryStarts.find(requestId);
+    if (it != m_queryStarts.end()) {
+        m_queryStats[it->second.functionId].add(g_get_monotonic_time() - it->second.sentAt);
+        m_queryStarts.erase(it);
+    }
+}
+
+void TdTransceiverImpl::addUpdateDispatchTime(const td::td_api::Object &update, gint64 dispatchUs)
+{
+    LatencyStats &stats = m_updateStats[update.get_id()];
+    if (stats.name.empty())
+        stats.name = getTypeName(update);
+    stats.add(dispatchUs);
+}
+
+void TdTransceiverImpl::onQueryDone(uint64_t requestId)
+{
+    auto it = m_inFlightLanes.find(requestId);
+    if (it != m_inFlightLanes.end()) {
+        m_lanes[it->second].inFlight--;
+        m_inFlightLanes.erase(it);
+        if (!m_stopping)
+            drainLanes();
+    }
+}
+
+// Sends queued queries while lanes have room, taking one from each lane in turn
+void TdTransceiverImpl::drainLanes()
+{
+    bool sent;
+    do {
+        sent = false;
+        for (unsigned laneIndex = 0; laneIndex < G_N_ELEMENTS(m_lanes); laneIndex++) {
+            QueryLane &lane = m_lanes[laneIndex];
+            if (!lane.queued.empty() && (lane.inFlight < lane.limit)) {
+                td::Client::Request request = std::move(lane.queued.front());
+                lane.queued.pop_front();
+                lane.inFlight++;
+                m_inFlightLanes[request.id] = laneIndex;
+                send(std::move(request));
+                sent = true;
+            }
+        }
+    } while (sent);
+}
+
+// Called by poll thread after pushing responses to m_rxQueue
+void TdTransceiverImpl::wakeUp(const std::shared_ptr<TdTransceiverImpl> &self)
+{
+    // Passing shared pointer through glib event queue using pointer to pointer seems funky,
+    // but it works
+    if (!self->m_wakeupPending.exchange(true))
+        g_idle_add(TdTransceiverImpl::rxCallback, new std::shared_ptr<TdTransceiverImpl>(self));
+}
+
 void TdTransceiverImpl::cancelTimer(uint64_t requestId)
 {
-    auto pTimer = std::find_if(m_timers.begin(), m_timers.end(),
-                               [requestId](const TimerInfo &timer) { return (timer.data->requestId == requestId); });
-    if (pTimer != m_timers.end()) {
-        if (!m_testBackend)
-            g_source_remove(pTimer->timerId);
-        else
-            m_testBackend->cancelTimer(pTimer->timerId);
-        m_timers.erase(pTimer);
+    m_timers.erase(requestId);
+}
+
+bool TdTransceiverImpl::isSliceOver(gint64 sliceStart, unsigned responseCount)
+{
+    // With test backend, responses are always processed synchronously
+    if (m_testBackend || !m_owner)
+        return false;
+    if (m_sliceMaxResponses && (responseCount >= m_sliceMaxResponses))
+        return true;
+    return m_sliceTimeMs && (g_get_monotonic_time() - sliceStart >= (gint64)m_sliceTimeMs*1000);
+}
+
+void TdTransceiverImpl::endSlice(gint64 sliceStart, unsigned responseCount, bool burstDone)
+{
+    gint64 sliceUs = g_get_monotonic_time() - sliceStart;
+    if (sliceUs > m_worstSliceUs)
+        m_worstSliceUs = sliceUs;
+    m_burstSlices++;
+    m_burstResponses += responseCount;
+
+    if (burstDone) {
+        if (m_burstSlices > m_maxBurstSlices)
+            m_maxBurstSlices = m_burstSlices;
+        if (m_burstSlices > 1)
+            purple_debug_misc(config::pluginId,
+                              "Dispatched %u responses in %u slices (longest burst: %u slices, "
+                              "worst slice: %u ms, updates dropped: %u, merged: %u)\n",
+                              m_burstResponses, m_burstSlices, m_maxBurstSlices,
+                              unsigned(m_worstSliceUs/1000), m_droppedUpdates.load(),
+                              m_mergedUpdates.load());
+        m_burstSlices = 0;
+        m_burstResponses = 0;
     }
 }
 
+void TdTransceiverImpl::sliceDone(unsigned responseCount)
+{
+    if (responseCount && m_owner && m_sliceDoneCb)
+        (m_owner->*m_sliceDoneCb)();
+}
+
 TdTransceiver::TdTransceiver(PurpleTdClient *owner, PurpleAccount *account, UpdateCb updateCb,
-                             ITransceiverBackend *testBackend)
-:   m_account(account),
-    m_stopThread(false)
+                             ITransceiverBackend *testBackend,
+                             const std::vector<UpdateFilterRule> &updateFilter)
+:   m_account(account)
 {
-    m_impl = std::make_shared<TdTransceiverImpl>(owner, updateCb, testBackend);
+    bool sharedClient = !testBackend &&
+                        purple_account_get_bool(account, AccountOptions::SharedReceiveThread,
+                                                AccountOptions::SharedReceiveThreadDefault);
+    m_impl = std::make_shared<TdTransceiverImpl>(owner, updateCb, testBackend, updateFilter, sharedClient);
 
     if (testBackend) {
         m_testBackend = testBackend;
@@ -92,24 +415,37 @@ TdTransceiver::TdTransceiver(PurpleTdClient *owner, PurpleAccount *account, Upda
             g_thread_init(NULL);
 #endif
 
-        m_pollThread = std::thread([this]() { pollThreadLoop(); });
+        // 0 means processing everything at once, so response count is not limited either
+        unsigned sliceTimeMs = getUpdateSliceTimeMs(account);
+        setDispatchBudget(sliceTimeMs, sliceTimeMs ? DEFAULT_SLICE_MAX_RESPONSES : 0);
+        m_statsTimer = g_timeout_add_seconds(STATS_DUMP_INTERVAL, statsDumpCallback, this);
+        if (sharedClient)
+            m_impl->m_clientId = g_sharedReceiver.addClient(m_impl);
+        else
+            m_pollThread = std::thread([this]() { pollThreadLoop(); });
     }
 }
 
 TdTransceiver::~TdTransceiver()
 {
-    for (const TimerInfo &timer: m_impl->m_timers) {
+    if (m_impl->m_wheelTimerId) {
         if (!m_testBackend)
-            g_source_remove(timer.timerId);
+            g_source_remove(m_impl->m_wheelTimerId);
         else
-            m_testBackend->cancelTimer(timer.timerId);
+            m_testBackend->cancelTimer(m_impl->m_wheelTimerId);
+        m_impl->m_wheelTimerId = 0;
     }
     m_impl->m_timers.clear();
+    if (m_statsTimer)
+        g_source_remove(m_statsTimer);
 
-    m_stopThread = true;
+    m_impl->m_stopping = true;
     if (!m_testBackend) {
-        m_impl->m_client->send({UINT64_MAX, td::td_api::make_object<td::td_api::close>()});
-        m_pollThread.join();
+        m_impl->send({UINT64_MAX, td::td_api::make_object<td::td_api::close>()});
+        if (m_impl->m_client)
+            m_pollThread.join();
+        else
+            g_sharedReceiver.waitForClose(m_impl->m_clientId);
     }
 
     // Orphan m_impl - if the background thread generated idle callbacks while we were waiting for
@@ -117,41 +453,218 @@ TdTransceiver::~TdTransceiver()
     // m_impl->m_owner gets set to NULL), and only then with TdTransceiverImpl instance be destroyed
     m_impl->m_owner = nullptr;
 
-    // Since poll thread is no longer running, there is no need to lock the mutex before decrementing
-    // shared pointer reference count
     m_impl.reset();
     purple_debug_misc(config::pluginId, "Destroyed TdTransceiver\n");
 }
 
-void *TdTransceiver::queueResponse(td::Client::Response &&response)
+static bool isClosedResponse(const td::Client::Response &response)
 {
-    m_impl->m_rxQueue.push_back(std::move(response));
-    return new std::shared_ptr<TdTransceiverImpl>(m_impl);
+    if (response.object->get_id() == td::td_api::updateAuthorizationState::ID) {
+        auto &authState = static_cast<const td::td_api::updateAuthorizationState &>(*response.object);
+        return authState.authorization_state_ && (authState.authorization_state_->get_id() ==
+               td::td_api::authorizationStateClosed::ID);
+    }
+    return false;
+}
+
+// Returns false if the update should be dropped
+bool TdTransceiverImpl::filterUpdate(const td::Client::Response &response)
+{
+    if ((response.id != 0) || m_updateFilter.empty())
+        return true;
+    if (m_updateFilter.find(response.object->get_id()) != m_updateFilter.end())
+        return true;
+
+    m_droppedUpdates++;
+    return false;
+}
+
+void TdTransceiverImpl::coalesceUpdates(std::vector<td::Client::Response> &batch)
+{
+    std::map<std::pair<std::int32_t, UpdateFilterRule::CoalesceKey>, size_t> lastIndex;
+
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (batch[i].id != 0)
+            continue;
+        auto pRule = m_updateFilter.find(batch[i].object->get_id());
+        if ((pRule == m_updateFilter.end()) || !pRule->second)
+            continue;
+
+        auto key = std::make_pair(pRule->first, pRule->second(*batch[i].object));
+        auto pLast = lastIndex.find(key);
+        if (pLast != lastIndex.end()) {
+            // Latest value is kept in its own place, to retain order relative to other updates
+            batch[pLast->second].object.reset();
+            pLast->second = i;
+            m_mergedUpdates++;
+        } else
+            lastIndex.emplace(key, i);
+    }
 }
 
 void TdTransceiver::pollThreadLoop()
 {
-    while (1) {
-        td::Client::Response response = m_impl->m_client->receive(1);
+    std::vector<td::Client::Response> batch;
+    bool closed = false;
 
-        if (response.object) {
-            if (response.object->get_id() == td::td_api::updateAuthorizationState::ID) {
-                auto &authState = static_cast<const td::td_api::updateAuthorizationState &>(*response.object);
-                if (authState.authorization_state_ && (authState.authorization_state_->get_id() ==
-                    td::td_api::authorizationStateClosed::ID))
-                {
-                    break;
-                }
-            }
-            // Passing shared pointer through glib event queue using pointer to pointer seems funky,
-            // but it works
-            void *implRef;
-            {
-                std::unique_lock<std::mutex> lock(m_impl->m_rxMutex);
-                implRef = queueResponse(std::move(response));
+    while (!closed) {
+        // Block for first response, then collect whatever else is immediately available
+        td::Client::Response response = m_impl->m_client->receive(1);
+        while (response.object) {
+            if (isClosedResponse(response)) {
+                closed = true;
+                break;
             }
-            g_idle_add(TdTransceiverImpl::rxCallback, implRef);
+            if (m_impl->filterUpdate(response))
+                batch.push_back(std::move(response));
+            if (batch.size() >= POLL_BATCH_SIZE)
+                break;
+            response = m_impl->m_client->receive(0);
+        }
+
+        m_impl->coalesceUpdates(batch);
+        for (td::Client::Response &queued: batch) {
+            if (!queued.object)
+                continue;
+            // If main thread is lagging behind and the queue is full, wait for it to catch up,
+            // unless we are shutting down and nobody is going to process the responses anyway
+            while (!m_impl->m_rxQueue.push(std::move(queued)) && !m_impl->m_stopping)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            TdTransceiverImpl::wakeUp(m_impl);
         }
+        batch.clear();
+    }
+}
+
+SharedTdReceiver::~SharedTdReceiver()
+{
+    if (m_thread.joinable()) {
+        m_stop = true;
+        m_thread.join();
+    }
+}
+
+std::int32_t SharedTdReceiver::addClient(const std::shared_ptr<TdTransceiverImpl> &impl)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!m_thread.joinable()) {
+        m_stop = false;
+        m_thread = std::thread([this]() { threadLoop(); });
+    }
+
+    std::int32_t clientId = td::ClientManager::get_manager_singleton()->create_client_id();
+    m_clients[clientId] = std::make_shared<ClientSink>();
+    m_clients[clientId]->impl = impl;
+    purple_debug_misc(config::pluginId, "Added client %d to shared receive thread\n", (int)clientId);
+    return clientId;
+}
+
+void SharedTdReceiver::send(std::int32_t clientId, td::Client::Request &&request)
+{
+    td::ClientManager::get_manager_singleton()->send(clientId, request.id, std::move(request.function));
+}
+
+void SharedTdReceiver::waitForClose(std::int32_t clientId)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_clientClosed.wait(lock, [this, clientId]() { return (m_clients.find(clientId) == m_clients.end()); });
+
+    if (m_clients.empty()) {
+        m_stop = true;
+        lock.unlock();
+        m_thread.join();
+    }
+}
+
+std::shared_ptr<SharedTdReceiver::ClientSink> SharedTdReceiver::findClient(std::int32_t clientId)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto it = m_clients.find(clientId);
+    return (it != m_clients.end()) ? it->second : nullptr;
+}
+
+void SharedTdReceiver::removeClient(std::int32_t clientId)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_clients.erase(clientId);
+    m_clientClosed.notify_all();
+}
+
+// Returns true if some responses are still waiting for space in the queue
+bool SharedTdReceiver::flushBacklog(ClientSink &client)
+{
+    TdTransceiverImpl &impl   = *client.impl;
+    bool               pushed = false;
+
+    // Unlike dedicated poll thread, never wait for a lagging main thread here, because that would
+    // hold up all other accounts, including TdTransceiver destructor waiting for its client to close
+    while (!client.backlog.empty() && impl.m_rxQueue.push(std::move(client.backlog.front()))) {
+        client.backlog.pop_front();
+        pushed = true;
+    }
+    if (impl.m_stopping)
+        client.backlog.clear();
+    if (pushed)
+        TdTransceiverImpl::wakeUp(client.impl);
+
+    return !client.backlog.empty();
+}
+
+void SharedTdReceiver::deliver(std::int32_t clientId, std::vector<td::Client::Response> &responses)
+{
+    std::shared_ptr<ClientSink> client = findClient(clientId);
+    if (!client)
+        return;
+
+    std::vector<td::Client::Response> batch;
+    for (td::Client::Response &response: responses) {
+        if (isClosedResponse(response)) {
+            // Let go of TdTransceiverImpl before TdTransceiver destructor gets to continue, so that
+            // the last reference is dropped in glib main thread rather than this one
+            client->backlog.clear();
+            client->impl.reset();
+            removeClient(clientId);
+            return;
+        }
+        if (client->impl->filterUpdate(response))
+            batch.push_back(std::move(response));
+    }
+
+    client->impl->coalesceUpdates(batch);
+    for (td::Client::Response &response: batch)
+        if (response.object)
+            client->backlog.push_back(std::move(response));
+    if (flushBacklog(*client))
+        m_backlogged.insert(clientId);
+}
+
+void SharedTdReceiver::threadLoop()
+{
+    td::ClientManager *manager = td::ClientManager::get_manager_singleton();
+    std::map<std::int32_t, std::vector<td::Client::Response>> batches;
+
+    while (!m_stop) {
+        // While some clients have responses waiting for space in their queues, poll more often
+        auto response = manager->receive(m_backlogged.empty() ? 1 : 0.01);
+        unsigned count = 0;
+        while (response.object) {
+            batches[response.client_id].push_back({response.request_id, std::move(response.object)});
+            if (++count >= TdTransceiver::POLL_BATCH_SIZE)
+                break;
+            response = manager->receive(0);
+        }
+
+        std::set<std::int32_t> backlogged;
+        std::swap(backlogged, m_backlogged);
+        for (std::int32_t clientId: backlogged) {
+            std::shared_ptr<ClientSink> client = findClient(clientId);
+            if (client && flushBacklog(*client))
+                m_backlogged.insert(clientId);
+        }
+
+        for (auto &batch: batches)
+            deliver(batch.first, batch.second);
+        batches.clear();
     }
 }
 
@@ -160,18 +673,32 @@ int TdTransceiverImpl::rxCallback(gpointer user_data)
     std::shared_ptr<TdTransceiverImpl> *ppSelf =
         static_cast<std::shared_ptr<TdTransceiverImpl> *>(user_data);
     std::shared_ptr<TdTransceiverImpl> &self = *ppSelf;
+    gint64   sliceStart    = g_get_monotonic_time();
+    unsigned responseCount = 0;
 
     while (1) {
+        if (self->isSliceOver(sliceStart, responseCount)) {
+            // Let glib main loop run other sources, this idle handler will be called again to
+            // process the rest. m_wakeupPending stays set so poll thread won't add another one.
+            self->sliceDone(responseCount);
+            self->endSlice(sliceStart, responseCount, false);
+            return TRUE;
+        }
+
         td::Client::Response response;
-        {
-            std::unique_lock<std::mutex> lock(self->m_rxMutex);
-            if (self->m_rxQueue.empty())
+        if (!self->m_rxQueue.pop(response)) {
+            // Allow the poll thread to schedule next wakeup, but re-check the queue in case
+            // something was pushed before the flag was cleared
+            self->m_wakeupPending = false;
+            if (self->m_rxQueue.empty() || self->m_wakeupPending.exchange(true))
                 break;
-            response = std::move(self->m_rxQueue.front());
-            self->m_rxQueue.erase(self->m_rxQueue.begin());
+            continue;
         }
 
+        responseCount++;
         self->cancelTimer(response.id);
+        if (response.id != 0)
+            self->onQueryDone(response.id);
 
         if (!response.object)
             ; // impossible
@@ -180,9 +707,12 @@ int TdTransceiverImpl::rxCallback(gpointer user_data)
             purple_debug_misc(config::pluginId,
                               "Ignoring response (object id %d) as transceiver is already destroyed\n",
                               (int)response.object->get_id());
-        else if (response.id == 0)
+        else if (response.id == 0) {
+            gint64 dispatchStart = g_get_monotonic_time();
             ((self->m_owner)->*(self->m_updateCb))(*response.object);
-        else {
+            self->addUpdateDispatchTime(*response.object, g_get_monotonic_time() - dispatchStart);
+        } else {
+            self->addQueryLatency(response.id);
             TdTransceiver::ResponseCb2 callback = nullptr;
             auto it = self->m_responseHandlers.find(response.id);
             if (it != self->m_responseHandlers.end()) {
@@ -196,40 +726,54 @@ int TdTransceiverImpl::rxCallback(gpointer user_data)
         }
     }
 
-    std::unique_lock<std::mutex> lock(self->m_rxMutex, std::defer_lock);
-    // owner=NULL means TdTransceiver has been destroyed, so the poll thread is no longer running
-    // and no mutex lock is needed - in fact, it must be avoided because otherwise unlocking the
-    // mutex after clearing the pointer will be use after free.
-    if (self->m_owner)
-        lock.lock();
+    self->sliceDone(responseCount);
+    self->endSlice(sliceStart, responseCount, true);
+
+    // Poll thread only copies TdTransceiver::m_impl, which keeps its own reference, so dropping
+    // ours here can only destroy the object after TdTransceiver is gone
     self.reset();
     delete ppSelf;
 
     return FALSE; // This idle handler will not be called again
 }
 
-uint64_t TdTransceiver::sendQuery(td::td_api::object_ptr<td::td_api::Function> f, ResponseCb2 handler)
+void TdTransceiver::setDispatchBudget(unsigned sliceTimeMs, unsigned sliceMaxResponses)
+{
+    m_impl->m_sliceTimeMs       = sliceTimeMs;
+    m_impl->m_sliceMaxResponses = sliceMaxResponses;
+}
+
+void TdTransceiver::setSliceDoneCallback(SliceDoneCb callback)
+{
+    m_impl->m_sliceDoneCb = callback;
+}
+
+uint64_t TdTransceiver::sendQuery(td::td_api::object_ptr<td::td_api::Function> f, ResponseCb2 handler,
+                                  Priority priority)
 {
     uint64_t queryId = ++m_impl->m_lastQueryId;
     purple_debug_misc(config::pluginId, "Sending query id %lu\n", (unsigned long)queryId);
+
+    LatencyStats &stats = m_impl->m_queryStats[f->get_id()];
+    if (stats.name.empty())
+        stats.name = getTypeName(*f);
+    m_impl->m_queryStarts[queryId] = QueryStart{f->get_id(), g_get_monotonic_time()};
     if (handler)
         m_impl->m_responseHandlers.emplace(queryId, std::move(handler));
-    if (m_testBackend)
-        m_testBackend->send({queryId, std::move(f)});
-    else
-        m_impl->m_client->send({queryId, std::move(f)});
+    m_impl->submit({queryId, std::move(f)}, priority);
     return queryId;
 }
 
-uint64_t TdTransceiver::sendQuery(td::td_api::object_ptr<td::td_api::Function> f, ResponseCb handler)
+uint64_t TdTransceiver::sendQuery(td::td_api::object_ptr<td::td_api::Function> f, ResponseCb handler,
+                                  Priority priority)
 {
     if (!handler)
-        return sendQuery(std::move(f), ResponseCb2());
+        return sendQuery(std::move(f), ResponseCb2(), priority);
 
     return sendQuery(std::move(f),
                      [tdClient=m_impl->m_owner, handler](uint64_t requestId, TdObjectPtr object) {
                         (tdClient->*handler)(requestId, std::move(object));
-                     });
+                     }, priority);
 }
 
 uint64_t TdTransceiver::sendQueryWithTimeout(td::td_api::object_ptr<td::td_api::Function> f,
@@ -243,23 +787,27 @@ uint64_t TdTransceiver::sendQueryWithTimeout(td::td_api::object_ptr<td::td_api::
 void TdTransceiver::setQueryTimer(uint64_t queryId, ResponseCb2 handler, unsigned timeoutSeconds,
                                   bool cancelNormalResponse)
 {
-    TimerInfo timer;
-    timer.data = std::make_unique<TimerCallbackData>();
-    TimerCallbackData *data = timer.data.get();
-
-    data->m_transceiver   = this;
-    data->requestId       = queryId;
-    data->callback        = handler;
-    data->cancelResponse  = cancelNormalResponse;
-
-    guint timerId;
-    if (!m_testBackend)
-        timerId = g_timeout_add_seconds(timeoutSeconds, timerCallback, data);
-    else
-        timerId = m_testBackend->addTimeout(timeoutSeconds, timerCallback, data);
-
-    timer.timerId = timerId;
-    m_impl->m_timers.push_back(std::move(timer));
+    TdTransceiverImpl &impl = *m_impl;
+    if (timeoutSeconds == 0)
+        timeoutSeconds = 1;
+
+    // If the wheel is already turning, next tick can come any moment, so add one more to make
+    // sure at least timeoutSeconds will pass. Timeouts longer than the wheel stay in their slot
+    // for several turns.
+    uint64_t expiresAt = impl.m_timerTick + timeoutSeconds + (impl.m_wheelTimerId ? 1 : 0);
+
+    TimerInfo &timer     = impl.m_timers[queryId];
+    timer.callback       = std::move(handler);
+    timer.cancelResponse = cancelNormalResponse;
+    timer.expiresAt      = expiresAt;
+    impl.m_timerWheel[expiresAt % TIMER_WHEEL_SIZE].push_back(queryId);
+
+    if (!impl.m_wheelTimerId) {
+        if (!m_testBackend)
+            impl.m_wheelTimerId = g_timeout_add_seconds(1, timerCallback, this);
+        else
+            impl.m_wheelTimerId = m_testBackend->addTimeout(1, timerCallback, this);
+    }
 }
 
 void TdTransceiver::setQueryTimer(uint64_t queryId, ResponseCb handler, unsigned timeoutSeconds,
@@ -271,21 +819,102 @@ void TdTransceiver::setQueryTimer(uint64_t queryId, ResponseCb handler, unsigned
                   }, timeoutSeconds, cancelNormalResponse);
 }
 
+guint TdTransceiver::addTimeout(unsigned seconds, GSourceFunc function, gpointer data)
+{
+    if (m_testBackend)
+        return m_testBackend->addTimeout(seconds, function, data);
+    else
+        return g_timeout_add_seconds(seconds, function, data);
+}
+
+void TdTransceiver::cancelTimeout(guint id)
+{
+    if (m_testBackend)
+        m_testBackend->cancelTimer(id);
+    else
+        g_source_remove(id);
+}
+
 gboolean TdTransceiver::timerCallback(gpointer userdata)
 {
-    TimerCallbackData *data        = static_cast<TimerCallbackData *>(userdata);
-    TdTransceiver     *transceiver = data->m_transceiver;
+    TdTransceiverImpl &impl = *static_cast<TdTransceiver *>(userdata)->m_impl;
+
+    uint64_t tick = ++impl.m_timerTick;
+    std::vector<std::uint64_t> &slot = impl.m_timerWheel[tick % TIMER_WHEEL_SIZE];
+    std::vector<std::uint64_t> requestIds;
+    std::swap(requestIds, slot);
+
+    for (uint64_t requestId: requestIds) {
+        auto it = impl.m_timers.find(requestId);
+        if ((it == impl.m_timers.end()) || (it->second.expiresAt % TIMER_WHEEL_SIZE != tick % TIMER_WHEEL_SIZE))
+            // Cancelled or re-armed
+            continue;
+        if (it->second.expiresAt != tick) {
+            slot.push_back(requestId);
+            continue;
+        }
 
-    data->callback(data->requestId, nullptr);
+        TimerInfo timer = std::move(it->second);
+        impl.m_timers.erase(it);
+        timer.callback(requestId, nullptr);
 
-    if (data->cancelResponse)
-        transceiver->m_impl->m_responseHandlers.erase(data->requestId);
-    transceiver->m_impl->cancelTimer(data->requestId);
+        if (timer.cancelResponse)
+            impl.m_responseHandlers.erase(requestId);
+    }
 
-    return FALSE; // one-time callback
+    if (impl.m_timers.empty()) {
+        impl.m_wheelTimerId = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+std::string TdTransceiver::getStatistics() const
+{
+    std::string result = "Queries (count, p50/p99/max ms):\n";
+    for (const auto &entry: m_impl->m_queryStats) {
+        const LatencyStats &stats = entry.second;
+        if (stats.count)
+            result += "  " + stats.name + ": " + std::to_string(stats.count) + ", " +
+                      std::to_string(stats.percentile(50)/1000) + "/" +
+                      std::to_string(stats.percentile(99)/1000) + "/" +
+                      std::to_string(stats.maxUs/1000) + "\n";
+    }
+
+    result += "Updates (count, total/p99/max dispatch ms):\n";
+    for (const auto &entry: m_impl->m_updateStats) {
+        const LatencyStats &stats = entry.second;
+        result += "  " + stats.name + ": " + std::to_string(stats.count) + ", " +
+                  std::to_string(stats.totalUs/1000) + "/" +
+                  std::to_string(stats.percentile(99)/1000) + "/" +
+                  std::to_string(stats.maxUs/1000) + "\n";
+    }
+
+    result += "Updates dropped in poll thread: " + std::to_string(m_impl->m_droppedUpdates.load()) +
+              ", merged: " + std::to_string(m_impl->m_mergedUpdates.load()) + "\n";
+    result += "Longest burst: " + std::to_string(m_impl->m_maxBurstSlices) + " slices, worst slice: " +
+              std::to_string(m_impl->m_worstSliceUs/1000) + " ms\n";
+
+    return result;
+}
+
+gboolean TdTransceiver::statsDumpCallback(gpointer userdata)
+{
+    TdTransceiver *self = static_cast<TdTransceiver *>(userdata);
+    purple_debug_info(config::pluginId, "Statistics for %s:\n%s",
+                      purple_account_get_username(self->m_account), self->getStatistics().c_str());
+    return TRUE;
 }
 
 void ITransceiverBackend::receive(td::Client::Response response)
 {
-    TdTransceiverImpl::rxCallback(m_owner->queueResponse(std::move(response)));
+    m_owner->m_impl->m_rxQueue.push(std::move(response));
+    TdTransceiverImpl::rxCallback(new std::shared_ptr<TdTransceiverImpl>(m_owner->m_impl));
+}
+
+void ITransceiverBackend::receive(std::vector<td::Client::Response> responses)
+{
+    for (td::Client::Response &response: responses)
+        m_owner->m_impl->m_rxQueue.push(std::move(response));
+    TdTransceiverImpl::rxCallback(new std::shared_ptr<TdTransceiverImpl>(m_owner->m_impl));
 }
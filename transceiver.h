@@ -6,6 +6,7 @@
 #include <thread>
 #include <mutex>
 #include <map>
+#include <vector>
 #include <atomic>
 #include <purple.h>
 #include <functional>
@@ -23,26 +24,55 @@ public:
     virtual guint addTimeout(guint interval, GSourceFunc function, gpointer data) = 0;
     virtual void  cancelTimer(guint id) = 0;
     void          receive(td::Client::Response response);
+    // All processed in one dispatch slice
+    void          receive(std::vector<td::Client::Response> responses);
 private:
     TdTransceiver *m_owner = nullptr;
 };
 
+// Describes how poll thread pre-processes updates of given type before passing them to glib main
+// thread. Updates of types not listed in the rule table are dropped.
+struct UpdateFilterRule {
+    using CoalesceKey = std::pair<int64_t, int64_t>;
+    using KeyFunction = CoalesceKey (*)(const td::td_api::Object &update);
+
+    std::int32_t updateId;
+    // If set, of the updates with the same key received in one batch only the last one is kept
+    KeyFunction  coalesceKey;
+};
+
 // A wrapper around td::Client which processes incoming events (updates and responses to requests)
 // in glib main thread using idle function, and also provides request-id-to-callback mapping
 class TdTransceiver {
     friend class ITransceiverBackend;
+    friend class SharedTdReceiver;
 private:
     using TdObjectPtr = td::td_api::object_ptr<td::td_api::Object>;
 public:
     using ResponseCb  = void (PurpleTdClient::*)(uint64_t requestId, TdObjectPtr object);
     using ResponseCb2 = std::function<void(uint64_t, TdObjectPtr)>;
     using UpdateCb    = void (PurpleTdClient::*)(td::td_api::Object &object);
+    using SliceDoneCb = void (PurpleTdClient::*)();
+
+    // Background queries are held back while too many of them are in flight, so that they do not
+    // delay interactive ones
+    enum class Priority {
+        Interactive,
+        Background,
+        // Synchronous file downloads, which stay in flight for as long as the download takes, so
+        // they get a lane of their own rather than holding up other background queries
+        Download
+    };
 
+    // Empty updateFilter means passing all updates as they are
     TdTransceiver(PurpleTdClient *owner, PurpleAccount *account, UpdateCb updateCb,
-                  ITransceiverBackend *testBackend);
+                  ITransceiverBackend *testBackend,
+                  const std::vector<UpdateFilterRule> &updateFilter = {});
     ~TdTransceiver();
-    uint64_t sendQuery(td::td_api::object_ptr<td::td_api::Function> f, ResponseCb handler);
-    uint64_t sendQuery(td::td_api::object_ptr<td::td_api::Function> f, ResponseCb2 handler);
+    uint64_t sendQuery(td::td_api::object_ptr<td::td_api::Function> f, ResponseCb handler,
+                       Priority priority = Priority::Interactive);
+    uint64_t sendQuery(td::td_api::object_ptr<td::td_api::Function> f, ResponseCb2 handler,
+                       Priority priority = Priority::Interactive);
 
     uint64_t sendQueryWithTimeout(td::td_api::object_ptr<td::td_api::Function> f,
                                   ResponseCb2 handler, unsigned timeoutSeconds);
@@ -50,16 +80,40 @@ public:
                            bool cancelNormalResponse);
     void     setQueryTimer(uint64_t queryId, ResponseCb2 handler, unsigned timeoutSeconds,
                            bool cancelNormalResponse);
+
+    // Limits time (in milliseconds) and number of responses processed in one glib main loop
+    // iteration, 0 meaning no limit. Remaining responses are processed on next iterations.
+    void     setDispatchBudget(unsigned sliceTimeMs, unsigned sliceMaxResponses);
+    // Called after the responses of each such iteration are processed, so that the work they queued
+    // up can be done in one go
+    void     setSliceDoneCallback(SliceDoneCb callback);
+
+    // Timer in glib main loop, or a fake one with test backend
+    guint    addTimeout(unsigned seconds, GSourceFunc function, gpointer data);
+    void     cancelTimeout(guint id);
+
+    // Human-readable query latency and update dispatch time statistics
+    std::string getStatistics() const;
 private:
+    enum {
+        DEFAULT_SLICE_MAX_RESPONSES = 500,
+        // Maximum number of responses received from tdlib before passing them on, so that
+        // updates can be coalesced
+        POLL_BATCH_SIZE             = 256,
+        // Seconds between statistics dumps to debug log
+        STATS_DUMP_INTERVAL         = 300,
+    };
+
     void  pollThreadLoop();
-    void *queueResponse(td::Client::Response &&response);
     static gboolean timerCallback(gpointer userdata);
+    static gboolean statsDumpCallback(gpointer userdata);
 
     std::shared_ptr<TdTransceiverImpl>  m_impl;
     PurpleAccount                      *m_account;
+    // Not used if td::ClientManager is shared with other accounts
     std::thread                         m_pollThread;
-    std::atomic_bool                    m_stopThread;
     ITransceiverBackend                *m_testBackend;
+    guint                               m_statsTimer = 0;
 };
 
 #endif